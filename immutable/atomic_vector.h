@@ -0,0 +1,294 @@
+
+/*
+ * Atomic cell holding the current version of a vector.
+ *
+ * Copying a vector is not atomic, because it copies a pointer and increments
+ * a reference count in two steps. atomic_vector publishes vector versions to
+ * concurrent readers without a lock, using split reference counts: the cell
+ * stores the pointer to the rrb head together with a 16-bit local count in a
+ * single 64-bit word.
+ *
+ * When a head is stored in the cell, the cell adds `prepaid` references to its
+ * reference count at once. A reader takes one of these references with a
+ * single fetch_add on the local count, so load() never waits for writers or
+ * other readers. Whoever sees the local count reach half of the prepaid
+ * references tops them up again. A writer that replaces the head hands back
+ * the references that were not taken yet.
+ *
+ * This requires that pointers fit into 48 bits, and that fewer than
+ * prepaid / 2 loads of the same cell are in flight at the same time. Every
+ * head is checked when it is stored. A head whose address does not fit, e.g.
+ * with 57-bit virtual addresses or tagged pointers, is published through a
+ * separate pointer instead, which readers copy under a spin lock. Defining
+ * RRB_NO_POINTER_PACKING publishes every head that way.
+ *
+ * Writers are serialized by the same spin lock, so only loads are lock-free.
+ *
+ * Readers that hold an epoch_guard can also borrow() the current version,
+ * which takes no reference at all. Therefore writers retire the references of
+ * a replaced version to epoch-based reclamation (see rrb_epoch.h) instead of
+ * dropping them right away. They are dropped once no guard that could have
+ * borrowed the version is left, at the latest when the writing thread exits.
+ * Call epoch_reclaim() on the writing thread to drop them at a known point,
+ * e.g. before checking memory usage.
+ */
+
+#pragma once
+
+#include "vector.h"
+#include "rrb_epoch.h"
+
+#include <atomic>
+#include <thread>
+
+namespace immutable
+  {
+
+  // A version of a vector that was borrowed from an atomic_vector. It does not
+  // own a reference, so it is only valid while the epoch_guard that it was
+  // borrowed under is alive.
+  template <typename T, int N = 5>
+  using borrowed_vector = vector_view<T, true, N>;
+
+  template <typename T, int N = 5>
+  class atomic_vector
+    {
+    public:
+      typedef vector<T, true, N> vector_type;
+
+      atomic_vector() : atomic_vector(vector_type())
+        {
+        }
+
+      explicit atomic_vector(const vector_type& v) : _cell(0), _wide(nullptr), _lock(false)
+        {
+        _publish(v._impl.ptr);
+        }
+
+      atomic_vector(const atomic_vector&) = delete;
+      atomic_vector& operator = (const atomic_vector&) = delete;
+
+      // No reader may still be borrowing from the cell when it is destroyed.
+      ~atomic_vector()
+        {
+        const uint64_t cell = _cell.load(std::memory_order_acquire);
+        if (_pointer(cell) != nullptr)
+          _return_unused(_pointer(cell), _count(cell));
+        else
+          rrb_details::release(_wide.load(std::memory_order_acquire));
+        }
+
+      vector_type load() const
+        {
+        const uint64_t cell = _cell.fetch_add(count_one, std::memory_order_acquire) + count_one;
+        rrb_type* p = _pointer(cell);
+        if (p == nullptr)
+          return _load_wide();
+        if (_count(cell) >= prepaid / 2)
+          _refill(cell);
+        // adopt the reference that we took from the prepaid ones
+        ref<rrb_type> r;
+        r.ptr = p;
+        vector_type result;
+        result._impl.swap(r);
+        return result;
+        }
+
+      // Returns the current version without taking a reference. The guard must
+      // outlive every use of the result.
+      borrowed_vector<T, N> borrow(const epoch_guard&) const
+        {
+        for (;;)
+          {
+          rrb_type* p = _pointer(_cell.load());
+          if (p == nullptr)
+            p = _wide.load();
+          // a wide head that was replaced in the meantime is seen as null
+          if (p != nullptr)
+            return borrowed_vector<T, N>(p);
+          }
+        }
+
+      void store(const vector_type& v)
+        {
+        _lock_writers();
+        rrb_type* old_wide = _wide.load();
+        const uint64_t old = _publish(v._impl.ptr);
+        _unlock_writers();
+        _retire(old, old_wide);
+        }
+
+      // Replaces the current version by desired if it is still expected. If
+      // not, expected is set to the current version.
+      bool compare_exchange(vector_type& expected, const vector_type& desired)
+        {
+        _lock_writers();
+        rrb_type* current = _pointer(_cell.load(std::memory_order_acquire));
+        rrb_type* old_wide = _wide.load();
+        if ((current != nullptr ? current : old_wide) != expected._impl.ptr)
+          {
+          _unlock_writers();
+          expected = load();
+          return false;
+          }
+        const uint64_t old = _publish(desired._impl.ptr);
+        _unlock_writers();
+        _retire(old, old_wide);
+        return true;
+        }
+
+      // Replaces the current version v by fn(v), retrying when another writer
+      // published a version in the meantime. Returns the published version.
+      template <typename Fn>
+      vector_type update(Fn fn)
+        {
+        vector_type current = load();
+        for (;;)
+          {
+          vector_type next = fn(current);
+          if (compare_exchange(current, next))
+            return next;
+          }
+        }
+
+    private:
+      typedef rrb<T, true, N> rrb_type;
+
+      enum : uint64_t
+        {
+        pointer_bits = 48,
+        pointer_mask = (uint64_t(1) << pointer_bits) - 1,
+        count_one = uint64_t(1) << pointer_bits,
+        prepaid = 1 << 14
+        };
+
+      static rrb_type* _pointer(uint64_t cell)
+        {
+        return (rrb_type*)(uintptr_t)(cell & pointer_mask);
+        }
+
+      static uint32_t _count(uint64_t cell)
+        {
+        return (uint32_t)(cell >> pointer_bits);
+        }
+
+      static bool _fits(const rrb_type* p)
+        {
+#ifdef RRB_NO_POINTER_PACKING
+        (void)p;
+        return false;
+#else
+        return ((uint64_t)(uintptr_t)p & ~(uint64_t)pointer_mask) == 0;
+#endif
+        }
+
+      static uint64_t _prepay(rrb_type* p)
+        {
+        p->_ref_count.fetch_add(prepaid, std::memory_order_relaxed);
+        return (uint64_t)(uintptr_t)p;
+        }
+
+      // Makes p the current version, with the writer lock held, and returns
+      // the replaced cell. Readers keep taking references until the exchange,
+      // so only the returned cell has the final count. A head that does not
+      // fit in the cell is stored in _wide, and the cell then holds a null
+      // pointer.
+      uint64_t _publish(rrb_type* p)
+        {
+        if (_fits(p))
+          {
+          _wide.store(nullptr);
+          return _cell.exchange(_prepay(p));
+          }
+        rrb_details::addref(p);
+        _wide.store(p);
+        return _cell.exchange(0);
+        }
+
+      void _lock_writers() const
+        {
+        while (_lock.exchange(true, std::memory_order_acquire))
+          std::this_thread::yield();
+        }
+
+      void _unlock_writers() const
+        {
+        _lock.store(false, std::memory_order_release);
+        }
+
+      vector_type _load_wide() const
+        {
+        _lock_writers();
+        rrb_type* p = _wide.load();
+        // the version was replaced by one that fits in the cell
+        if (p == nullptr)
+          {
+          _unlock_writers();
+          return load();
+          }
+        rrb_details::addref(p);
+        _unlock_writers();
+        ref<rrb_type> r;
+        r.ptr = p;
+        vector_type result;
+        result._impl.swap(r);
+        return result;
+        }
+
+      // Drops the prepaid references of p that no reader has taken.
+      static void _return_unused(rrb_type* p, uint32_t taken)
+        {
+        assert(taken <= prepaid);
+        const uint32_t unused = prepaid - taken;
+        if (unused == 0)
+          return;
+        if (unused > 1)
+          p->_ref_count.fetch_sub(unused - 1, std::memory_order_relaxed);
+        rrb_details::release(p);
+        }
+
+      static void _reclaim(void* p, uint64_t taken)
+        {
+        _return_unused((rrb_type*)p, (uint32_t)taken);
+        }
+
+      static void _reclaim_wide(void* p, uint64_t)
+        {
+        rrb_details::release((rrb_type*)p);
+        }
+
+      // Borrowers may still read the version in a cell that was replaced, so
+      // its references are only dropped once they are done.
+      static void _retire(uint64_t cell, rrb_type* wide)
+        {
+        if (_pointer(cell) != nullptr)
+          rrb_details::epoch_retire(&_reclaim, _pointer(cell), _count(cell));
+        else
+          rrb_details::epoch_retire(&_reclaim_wide, wide, 0);
+        }
+
+      // Resets the local count to zero by prepaying the references that were
+      // taken. The caller holds a reference to the head in cell, so the
+      // temporary increment can always be undone safely.
+      void _refill(uint64_t cell) const
+        {
+        rrb_type* p = _pointer(cell);
+        while (_pointer(cell) == p && _count(cell) >= prepaid / 2)
+          {
+          const uint32_t taken = _count(cell);
+          p->_ref_count.fetch_add(taken, std::memory_order_relaxed);
+          if (_cell.compare_exchange_weak(cell, (uint64_t)(uintptr_t)p, std::memory_order_acq_rel, std::memory_order_acquire))
+            return;
+          p->_ref_count.fetch_sub(taken, std::memory_order_relaxed);
+          }
+        }
+
+    private:
+      mutable std::atomic<uint64_t> _cell;
+      // the current version if it does not fit in the cell, with a reference
+      std::atomic<rrb_type*> _wide;
+      // serializes writers, and readers of _wide
+      mutable std::atomic<bool> _lock;
+    };
+
+  }
@@ -0,0 +1,464 @@
+
+/*
+ * Compressed immutable vectors, for versions that are kept but rarely read.
+ *
+ * A compressed_vector mirrors the tree of the vector that it was made from,
+ * down to the parents of the leaves. The elements below each such parent
+ * (2^(2N) elements when its leaves are full) are compressed together into one
+ * block, see rrb_compress.h. Elements are decompressed a block at a time on
+ * access, and the last two decompressed blocks are cached, so reading a
+ * compressed_vector in order decompresses every block once. A
+ * compressed_vector object is not safe to read from several threads at once,
+ * but its copies are, as every copy has its own cache.
+ *
+ * Versions that share nodes can share their compressed blocks as well, by
+ * compressing them through the same compression_store. The store maps every
+ * node that it compressed to its compressed copy, so compressing a version
+ * that was derived from one that was compressed before only compresses the
+ * nodes that changed. Like a node_store, the store keeps references to these
+ * nodes, and collect() drops the ones that are no longer used outside of the
+ * store.
+ */
+
+#pragma once
+
+#include "vector.h"
+#include "rrb_compress.h"
+
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
+
+namespace immutable
+  {
+
+  template <typename T, bool atomic_ref_counting = true, int N = 5>
+  class compression_store;
+
+  template <typename T, bool atomic_ref_counting = true, int N = 5>
+  class compressed_vector;
+
+  namespace rrb_details
+    {
+
+    template <typename T>
+    struct compressed_node
+      {
+      rrb_index_type size;
+      // the children and the cumulative sizes of the children, empty in blocks
+      std::vector<std::shared_ptr<const compressed_node>> child;
+      std::vector<rrb_index_type> ends;
+      // the compressed elements of a block
+      std::vector<uint8_t> bytes;
+      };
+
+    template <typename T>
+    inline std::shared_ptr<const compressed_node<T>> compress_block(const std::vector<T>& elements)
+      {
+      std::shared_ptr<compressed_node<T>> block = std::make_shared<compressed_node<T>>();
+      block->size = (rrb_index_type)elements.size();
+      block->bytes = compress_elements(elements.data(), elements.size());
+      return block;
+      }
+
+    } // namespace rrb_details
+
+  template <typename T, bool atomic_ref_counting, int N>
+  class compression_store
+    {
+    public:
+      compression_store() : _live_after_collect(0) {}
+
+      compression_store(const compression_store&) = delete;
+      compression_store& operator = (const compression_store&) = delete;
+
+      // Number of nodes whose compressed copies are kept by the store.
+      size_t size() const
+        {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _compressed.size();
+        }
+
+      // Drops all nodes that are no longer used outside of the store.
+      void collect()
+        {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _collect();
+        }
+
+      void clear()
+        {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _compressed.clear();
+        _live_after_collect = 0;
+        }
+
+    private:
+      typedef rrb_details::tree_node<T, atomic_ref_counting> tree_type;
+      typedef std::shared_ptr<const rrb_details::compressed_node<T>> compressed_type;
+
+      const compressed_type* _find(const tree_type* node) const
+        {
+        auto it = _compressed.find(node);
+        return it == _compressed.end() ? nullptr : &it->second.second;
+        }
+
+      void _insert(const ref<tree_type>& node, const compressed_type& compressed)
+        {
+        _compressed.insert(std::make_pair((const tree_type*)node.ptr, std::make_pair(node, compressed)));
+        }
+
+      void _collect()
+        {
+        // Dropping a node may release the last outside reference to one of
+        // its children, so repeat until nothing changes anymore.
+        bool erased = true;
+        while (erased)
+          {
+          erased = false;
+          for (auto it = _compressed.begin(); it != _compressed.end();)
+            {
+            if (it->second.first.unique())
+              {
+              it = _compressed.erase(it);
+              erased = true;
+              }
+            else
+              ++it;
+            }
+          }
+        _live_after_collect = _compressed.size();
+        }
+
+      void _maybe_collect()
+        {
+        if (_compressed.size() > 1024 && _compressed.size() > 2 * _live_after_collect)
+          _collect();
+        }
+
+    private:
+      mutable std::mutex _mutex;
+      std::unordered_map<const tree_type*, std::pair<ref<tree_type>, compressed_type>> _compressed;
+      size_t _live_after_collect;
+
+      friend class compressed_vector<T, atomic_ref_counting, N>;
+    };
+
+  // Iterates over a compressed_vector. The references that it hands out stay
+  // valid until the compressed_vector is read again.
+  template <typename T, bool atomic_ref_counting, int N>
+  class compressed_vector_iterator
+    {
+    public:
+      typedef compressed_vector_iterator<T, atomic_ref_counting, N> self_type;
+      typedef std::forward_iterator_tag iterator_category;
+      typedef T value_type;
+      typedef rrb_index_type size_type;
+      typedef const T* pointer;
+      typedef const T& reference;
+      typedef std::ptrdiff_t difference_type;
+
+      compressed_vector_iterator() : _v(nullptr), _index(0) {}
+
+      compressed_vector_iterator(const compressed_vector<T, atomic_ref_counting, N>* v, size_type index) : _v(v), _index(index) {}
+
+      reference operator* () const
+        {
+        return (*_v)[_index];
+        }
+
+      pointer operator ->() const
+        {
+        return &(this->operator*());
+        }
+
+      self_type operator++(int)
+        {
+        self_type tmp(*this);
+        ++(*this);
+        return tmp;
+        }
+
+      self_type& operator++()
+        {
+        ++_index;
+        return *this;
+        }
+
+      bool operator == (const self_type& other) const
+        {
+        return (_index == other._index) && (_v == other._v);
+        }
+
+      bool operator != (const self_type& other) const
+        {
+        return !(*this == other);
+        }
+
+    private:
+      const compressed_vector<T, atomic_ref_counting, N>* _v;
+      size_type _index;
+    };
+
+  template <typename T, bool atomic_ref_counting, int N>
+  class compressed_vector
+    {
+    static_assert(std::is_trivially_copyable<T>::value, "compressed_vector elements must be trivially copyable");
+
+    public:
+      using vector_type = vector<T, atomic_ref_counting, N>;
+      using value_type = T;
+      using size_type = rrb_index_type;
+      using iterator = compressed_vector_iterator<T, atomic_ref_counting, N>;
+      using const_iterator = iterator;
+
+      compressed_vector() : _size(0), _next_cache(0)
+        {
+        }
+
+      explicit compressed_vector(const vector_type& v) : _size(0), _next_cache(0)
+        {
+        _compress(v, nullptr);
+        }
+
+      compressed_vector(const vector_type& v, compression_store<T, atomic_ref_counting, N>& store) : _size(0), _next_cache(0)
+        {
+        std::lock_guard<std::mutex> lock(store._mutex);
+        store._maybe_collect();
+        _compress(v, &store);
+        }
+
+      // copies start with an empty cache
+      compressed_vector(const compressed_vector& other) : _root(other._root), _tail(other._tail), _size(other._size), _next_cache(0)
+        {
+        }
+
+      compressed_vector& operator = (const compressed_vector& other)
+        {
+        _root = other._root;
+        _tail = other._tail;
+        _size = other._size;
+        for (auto& c : _cache)
+          c = cache_entry();
+        return *this;
+        }
+
+      iterator begin() const
+        {
+        return iterator(this, 0);
+        }
+
+      iterator end() const
+        {
+        return iterator(this, _size);
+        }
+
+      bool empty() const
+        {
+        return _size == 0;
+        }
+
+      size_type size() const
+        {
+        return _size;
+        }
+
+      // The reference stays valid until the compressed_vector is read again.
+      const T& operator [] (size_type index) const
+        {
+        const cache_entry& last = _cache[_next_cache ^ 1];
+        if (index - last.first < last.elements.size())
+          return last.elements[index - last.first];
+        const cache_entry& c = _block_for(index);
+        return c.elements[index - c.first];
+        }
+
+      const T& at(size_type index) const
+        {
+        if (index >= _size)
+          throw std::out_of_range("invalid compressed_vector<T> index");
+        return (*this)[index];
+        }
+
+      // The decompressed elements of the block that holds element index, as
+      // rrb_region_for returns them. They stay valid until the
+      // compressed_vector is read again.
+      std::tuple<const T*, size_type, size_type> region_for(size_type index) const
+        {
+        const cache_entry& c = _block_for(index);
+        return std::make_tuple(c.elements.data(), c.first, c.first + (size_type)c.elements.size());
+        }
+
+      vector_type decompress() const
+        {
+        return vector_type(begin(), end());
+        }
+
+      // The number of compressed bytes, counting blocks that occur more than
+      // once in this vector once per occurrence.
+      size_t compressed_bytes() const
+        {
+        return _compressed_bytes(_root.get()) + (_tail ? _tail->bytes.size() : 0);
+        }
+
+      // Calls fn(node, bytes) for the nodes of the compressed tree, where bytes
+      // approximates the memory that node takes itself. The children of a
+      // node are only visited if fn returns true.
+      template <typename Fn>
+      void visit_nodes(Fn fn) const
+        {
+        _visit_nodes(_root.get(), fn);
+        _visit_nodes(_tail.get(), fn);
+        }
+
+    private:
+      typedef rrb_details::compressed_node<T> node_type;
+      typedef std::shared_ptr<const node_type> node_pointer;
+      typedef rrb_details::tree_node<T, atomic_ref_counting> tree_type;
+      typedef rrb_details::internal_node<T, atomic_ref_counting> internal_type;
+
+      struct cache_entry
+        {
+        cache_entry() : block(nullptr), first(0) {}
+
+        const node_type* block;
+        size_type first;
+        std::vector<T> elements;
+        };
+
+      void _compress(const vector_type& v, compression_store<T, atomic_ref_counting, N>* store)
+        {
+        const ref<rrb<T, atomic_ref_counting, N>> impl = v.raw();
+        _size = impl->cnt;
+        if (impl->root.ptr != nullptr)
+          _root = _compress_node(impl->root, impl->shift, store);
+        _tail = rrb_details::compress_block(std::vector<T>(impl->tail->child, impl->tail->child + impl->tail_len));
+        }
+
+      static node_pointer _compress_node(const ref<tree_type>& node, uint32_t shift, compression_store<T, atomic_ref_counting, N>* store)
+        {
+        using namespace rrb_details;
+        if (store != nullptr)
+          {
+          const node_pointer* found = store->_find(node.ptr);
+          if (found != nullptr)
+            return *found;
+          }
+        node_pointer result;
+        if (shift <= (uint32_t)bits<N>::rrb_bits)
+          {
+          std::vector<T> elements;
+          auto append = [&](const T* p, uint32_t len, rrb_index_type) -> bool
+            {
+            elements.insert(elements.end(), p, p + len);
+            return true;
+            };
+          walk_leaves<T, atomic_ref_counting, N>(node.ptr, shift, 0, 0, append);
+          result = compress_block(elements);
+          }
+        else
+          {
+          const internal_type* internal = (const internal_type*)node.ptr;
+          std::shared_ptr<node_type> compressed = std::make_shared<node_type>();
+          compressed->size = 0;
+          for (uint32_t i = 0; i < internal->len; ++i)
+            {
+            const ref<tree_type> child = internal->child[i];
+            compressed->child.push_back(_compress_node(child, shift - bits<N>::rrb_bits, store));
+            compressed->size += compressed->child.back()->size;
+            compressed->ends.push_back(compressed->size);
+            }
+          result = compressed;
+          }
+        if (store != nullptr)
+          store->_insert(node, result);
+        return result;
+        }
+
+      static size_t _compressed_bytes(const node_type* node)
+        {
+        if (node == nullptr)
+          return 0;
+        size_t bytes = node->bytes.size();
+        for (const node_pointer& child : node->child)
+          bytes += _compressed_bytes(child.get());
+        return bytes;
+        }
+
+      template <typename Fn>
+      static void _visit_nodes(const node_type* node, Fn& fn)
+        {
+        if (node == nullptr)
+          return;
+        // the node and the control block of its shared_ptr
+        const size_t bytes = sizeof(node_type) + 2 * sizeof(void*) + node->bytes.capacity()
+          + node->child.capacity() * sizeof(node_pointer) + node->ends.capacity() * sizeof(size_type);
+        if (!fn((const void*)node, bytes))
+          return;
+        for (const node_pointer& child : node->child)
+          _visit_nodes(child.get(), fn);
+        }
+
+      const cache_entry& _block_for(size_type index) const
+        {
+        assert(index < _size);
+        const node_type* block = _tail.get();
+        size_type first = _size - _tail->size;
+        if (index < first)
+          {
+          block = _root.get();
+          first = 0;
+          while (!block->child.empty())
+            {
+            const size_t i = std::upper_bound(block->ends.begin(), block->ends.end(), index - first) - block->ends.begin();
+            if (i > 0)
+              first += block->ends[i - 1];
+            block = block->child[i].get();
+            }
+          }
+        for (uint32_t c = 0; c < 2; ++c)
+          {
+          cache_entry& entry = _cache[c];
+          if (entry.block == block)
+            {
+            // an equal block may occur at several places
+            entry.first = first;
+            _next_cache = c ^ 1;
+            return entry;
+            }
+          }
+        cache_entry& entry = _cache[_next_cache];
+        entry.block = block;
+        entry.first = first;
+        entry.elements.resize(block->size);
+        rrb_details::decompress_elements(block->bytes, entry.elements.data(), block->size);
+        _next_cache ^= 1;
+        return entry;
+        }
+
+    private:
+      node_pointer _root;
+      node_pointer _tail;
+      size_type _size;
+      mutable cache_entry _cache[2];
+      // the cache entry to replace next, the other one was used last
+      mutable uint32_t _next_cache;
+    };
+
+  // compresses a version of a vector, see compressed_vector
+  template <typename T, bool atomic_ref_counting, int N>
+  inline compressed_vector<T, atomic_ref_counting, N> compress(const vector<T, atomic_ref_counting, N>& v)
+    {
+    return compressed_vector<T, atomic_ref_counting, N>(v);
+    }
+
+  template <typename T, bool atomic_ref_counting, int N>
+  inline compressed_vector<T, atomic_ref_counting, N> compress(const vector<T, atomic_ref_counting, N>& v, compression_store<T, atomic_ref_counting, N>& store)
+    {
+    return compressed_vector<T, atomic_ref_counting, N>(v, store);
+    }
+
+  }
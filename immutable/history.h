@@ -0,0 +1,317 @@
+
+/*
+ * A history of versions of a vector, for undo/redo and auditing.
+ *
+ * Versions are numbered in the order in which they are recorded, and any
+ * retained version is checked out in O(1). The history keeps track of the
+ * memory that its versions take together, counting every node that several
+ * versions share once. It does so by counting, for every node, the number of
+ * retained versions and nodes that point to it, so recording or dropping a
+ * version only visits the nodes that it does not share with the others.
+ *
+ * When a memory budget is set, recording a version that brings the history
+ * over budget drops the oldest versions, or compresses them (see
+ * compressed_vector.h) and only drops them once all old versions are
+ * compressed. The newest `keep` versions are always retained uncompressed.
+ * Checking out a compressed version decompresses it, in O(n).
+ *
+ * Memory is counted as the sizes of the heads, nodes, size tables and
+ * compressed blocks, without the memory that elements own themselves.
+ */
+
+#pragma once
+
+#include "vector.h"
+#include "compressed_vector.h"
+
+#include <deque>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
+
+namespace immutable
+  {
+
+  enum class history_policy
+    {
+    evict_oldest,
+    compress_oldest
+    };
+
+  template <typename T, bool atomic_ref_counting = true, int N = 5>
+  class history
+    {
+    public:
+      using vector_type = vector<T, atomic_ref_counting, N>;
+      using version_type = uint64_t;
+
+      // A budget of 0 bytes does not limit the memory.
+      explicit history(size_t memory_budget = 0, history_policy policy = history_policy::evict_oldest, size_t keep = 1)
+        : _budget(memory_budget), _policy(policy), _keep(std::max<size_t>(keep, 1)), _first(0), _uncompressed_from(0), _bytes(0)
+        {
+        }
+
+      history(const history&) = delete;
+      history& operator = (const history&) = delete;
+
+      // Records v as the newest version, and returns its number.
+      version_type record(const vector_type& v)
+        {
+        _versions.emplace_back();
+        _versions.back().v = v;
+        _retain_vector(v);
+        _enforce_budget();
+        return last();
+        }
+
+      // Throws std::out_of_range if the version was dropped or never recorded.
+      vector_type checkout(version_type version) const
+        {
+        const entry& e = _entry(version);
+        return e.compressed ? e.compressed->decompress() : e.v;
+        }
+
+      bool contains(version_type version) const
+        {
+        return version >= _first && version < _first + _versions.size();
+        }
+
+      bool is_compressed(version_type version) const
+        {
+        return _entry(version).compressed != nullptr;
+        }
+
+      bool empty() const
+        {
+        return _versions.empty();
+        }
+
+      // the number of retained versions
+      size_t size() const
+        {
+        return _versions.size();
+        }
+
+      // the oldest retained version
+      version_type first() const
+        {
+        return _first;
+        }
+
+      // the newest version, only valid if the history is not empty
+      version_type last() const
+        {
+        return _first + _versions.size() - 1;
+        }
+
+      // the memory that the retained versions take together, in bytes
+      size_t memory_usage() const
+        {
+        return _bytes;
+        }
+
+      // the memory that only this version takes, which dropping it would free
+      size_t unique_bytes(version_type version) const
+        {
+        const entry& e = _entry(version);
+        size_t bytes = 0;
+        auto add_unique = [&](const void* node, size_t node_bytes) -> bool
+          {
+          if (_parents.find(node)->second.parents != 1)
+            return false;
+          bytes += node_bytes;
+          return true;
+          };
+        if (e.compressed)
+          e.compressed->visit_nodes(add_unique);
+        else
+          _visit_vector(e.v, add_unique);
+        return bytes;
+        }
+
+      void set_memory_budget(size_t memory_budget)
+        {
+        _budget = memory_budget;
+        _enforce_budget();
+        }
+
+      // Drops all versions older than version.
+      void drop_before(version_type version)
+        {
+        while (!_versions.empty() && _first < version)
+          _drop_oldest();
+        }
+
+    private:
+      typedef rrb_details::tree_node<T, atomic_ref_counting> tree_type;
+      typedef rrb_details::internal_node<T, atomic_ref_counting> internal_type;
+      typedef rrb_details::leaf_node<T, atomic_ref_counting> leaf_type;
+      typedef std::integral_constant<bool, std::is_trivially_copyable<T>::value> compressible;
+
+      // stands in for compressed_vector when T cannot be compressed
+      struct uncompressible
+        {
+        uncompressible(const vector_type&, compression_store<T, atomic_ref_counting, N>&) {}
+        vector_type decompress() const { return vector_type(); }
+        template <typename Fn>
+        void visit_nodes(Fn) const {}
+        };
+
+      typedef typename std::conditional<compressible::value, compressed_vector<T, atomic_ref_counting, N>, uncompressible>::type compressed_type;
+
+      // The bytes are those of the first visit, in case a size table is
+      // shared by nodes of different lengths.
+      struct counted
+        {
+        counted() : parents(0), bytes(0) {}
+
+        uint32_t parents;
+        size_t bytes;
+        };
+
+      struct entry
+        {
+        vector_type v;
+        std::unique_ptr<compressed_type> compressed;
+        };
+
+      const entry& _entry(version_type version) const
+        {
+        if (!contains(version))
+          throw std::out_of_range("invalid history version");
+        return _versions[(size_t)(version - _first)];
+        }
+
+      // Calls fn(node, bytes) for the head, the nodes and the size tables of
+      // v, see compressed_vector::visit_nodes.
+      template <typename Fn>
+      static void _visit_vector(const vector_type& v, Fn& fn)
+        {
+        const ref<rrb<T, atomic_ref_counting, N>> impl = v.raw();
+        if (!fn((const void*)impl.ptr, sizeof(rrb<T, atomic_ref_counting, N>)))
+          return;
+        _visit_node((const tree_type*)impl->tail.ptr, 0, fn);
+        if (impl->root.ptr != nullptr)
+          _visit_node(impl->root.ptr, impl->shift, fn);
+        }
+
+      template <typename Fn>
+      static void _visit_node(const tree_type* node, uint32_t shift, Fn& fn)
+        {
+        using namespace rrb_details;
+        if (shift == 0)
+          {
+          const leaf_type* leaf = (const leaf_type*)node;
+          fn((const void*)leaf, sizeof(leaf_type) + leaf->len * sizeof(T));
+          return;
+          }
+        const internal_type* internal = (const internal_type*)node;
+        if (!fn((const void*)internal, sizeof(internal_type) + internal->len * sizeof(void*)))
+          return;
+        if (internal->size_table.ptr != nullptr)
+          fn((const void*)internal->size_table.ptr, sizeof(rrb_size_table<atomic_ref_counting>) + internal->len * sizeof(rrb_index_type));
+        for (uint32_t i = 0; i < internal->len; ++i)
+          _visit_node((const tree_type*)internal->child[i].ptr, shift - bits<N>::rrb_bits, fn);
+        }
+
+      // Counts one more parent for node, and returns whether it is new.
+      bool _retain(const void* node, size_t bytes)
+        {
+        counted& c = _parents[node];
+        if (c.parents++ > 0)
+          return false;
+        c.bytes = bytes;
+        _bytes += bytes;
+        return true;
+        }
+
+      // Counts one parent less for node, and returns whether it is gone.
+      bool _release(const void* node, size_t)
+        {
+        auto it = _parents.find(node);
+        assert(it != _parents.end());
+        if (--it->second.parents > 0)
+          return false;
+        _bytes -= it->second.bytes;
+        _parents.erase(it);
+        return true;
+        }
+
+      void _retain_vector(const vector_type& v)
+        {
+        auto retain = [this](const void* node, size_t bytes) { return _retain(node, bytes); };
+        _visit_vector(v, retain);
+        }
+
+      void _release_vector(const vector_type& v)
+        {
+        auto release = [this](const void* node, size_t bytes) { return _release(node, bytes); };
+        _visit_vector(v, release);
+        }
+
+      void _drop_oldest()
+        {
+        entry& e = _versions.front();
+        if (e.compressed)
+          e.compressed->visit_nodes([this](const void* node, size_t bytes) { return _release(node, bytes); });
+        else
+          _release_vector(e.v);
+        _versions.pop_front();
+        ++_first;
+        _uncompressed_from = std::max(_uncompressed_from, _first);
+        }
+
+      // Compresses the oldest uncompressed version, if it is not one of the
+      // newest `keep` versions, and returns whether it did.
+      bool _compress_oldest(std::true_type)
+        {
+        if (_uncompressed_from + _keep > last())
+          return false;
+        entry& e = _versions[(size_t)(_uncompressed_from - _first)];
+        e.compressed.reset(new compressed_type(e.v, _store));
+        e.compressed->visit_nodes([this](const void* node, size_t bytes) { return _retain(node, bytes); });
+        _release_vector(e.v);
+        e.v = vector_type();
+        ++_uncompressed_from;
+        return true;
+        }
+
+      // Elements that cannot be compressed are dropped instead.
+      bool _compress_oldest(std::false_type)
+        {
+        return false;
+        }
+
+      void _enforce_budget()
+        {
+        if (_budget == 0)
+          return;
+        bool compressed = false;
+        while (_bytes > _budget && _versions.size() > _keep)
+          {
+          if (_policy == history_policy::compress_oldest && _compress_oldest(compressible()))
+            compressed = true;
+          else
+            _drop_oldest();
+          }
+        // release the nodes of the compressed versions that the store kept
+        if (compressed)
+          _store.collect();
+        }
+
+    private:
+      std::deque<entry> _versions;
+      size_t _budget;
+      history_policy _policy;
+      size_t _keep;
+      // the number of the oldest retained version
+      version_type _first;
+      // the number of the oldest version that is not compressed
+      version_type _uncompressed_from;
+      std::unordered_map<const void*, counted> _parents;
+      size_t _bytes;
+      compression_store<T, atomic_ref_counting, N> _store;
+    };
+
+  }
@@ -0,0 +1,242 @@
+
+/*
+ * Immutable vectors of bits or small unsigned integers.
+ *
+ * A packed_vector<Bits> stores its elements as Bits-bit fields of 64-bit
+ * words (field i is in word i / (64 / Bits)), in a vector<uint64_t>. With the
+ * default branching factor a leaf of 32 words holds 2048 bits, instead of the
+ * 32 bytes of a leaf of vector<bool>. The fields after the last element are
+ * kept zero.
+ *
+ * count, rank and select compare whole words at a time. For bit_vector they
+ * use the set bit counts that the nodes cache (see rrb_packed.h), and take
+ * O(log n) time. For wider fields they scan the words.
+ */
+
+#pragma once
+
+#include "vector.h"
+#include "rrb_packed.h"
+
+#include <initializer_list>
+#include <iterator>
+#include <stdexcept>
+#include <type_traits>
+
+namespace immutable
+  {
+
+  template <uint32_t Bits = 1, bool atomic_ref_counting = true, int N = 5>
+  class packed_vector
+    {
+    static_assert(Bits == 1 || Bits == 2 || Bits == 4 || Bits == 8, "packed_vector fields must be 1, 2, 4 or 8 bits wide");
+
+    public:
+      using word_vector_type = vector<uint64_t, atomic_ref_counting, N>;
+      using value_type = typename std::conditional<Bits == 1, bool, uint8_t>::type;
+      using size_type = rrb_index_type;
+
+      enum : uint32_t { fields_per_word = 64 / Bits };
+
+      packed_vector() : _size(0)
+        {
+        }
+
+      packed_vector(size_type count, value_type value) : _size(count)
+        {
+        std::vector<uint64_t> words((count + fields_per_word - 1) / fields_per_word, _broadcast(value));
+        if (count % fields_per_word != 0)
+          words.back() &= _low_fields(count % fields_per_word);
+        _words = word_vector_type(words.begin(), words.end());
+        }
+
+      template <typename Iterator, typename = typename std::iterator_traits<Iterator>::iterator_category>
+      packed_vector(Iterator first, Iterator last) : _size(0)
+        {
+        std::vector<uint64_t> words;
+        for (; first != last; ++first, ++_size)
+          {
+          if (_size % fields_per_word == 0)
+            words.push_back(0);
+          words.back() |= _field(*first) << (_size % fields_per_word * Bits);
+          }
+        _words = word_vector_type(words.begin(), words.end());
+        }
+
+      packed_vector(std::initializer_list<value_type> values) : packed_vector(values.begin(), values.end())
+        {
+        }
+
+      bool empty() const
+        {
+        return _size == 0;
+        }
+
+      size_type size() const
+        {
+        return _size;
+        }
+
+      value_type operator [] (size_type index) const
+        {
+        return (value_type)((_words[index / fields_per_word] >> (index % fields_per_word * Bits)) & field_mask);
+        }
+
+      value_type at(size_type index) const
+        {
+        if (index >= _size)
+          throw std::out_of_range("invalid packed_vector index");
+        return (*this)[index];
+        }
+
+      packed_vector set(size_type index, value_type value) const
+        {
+        const size_type word = index / fields_per_word;
+        const uint32_t shift = index % fields_per_word * Bits;
+        const uint64_t w = (_words[word] & ~(field_mask << shift)) | (_field(value) << shift);
+        return packed_vector(_words.set(word, w), _size);
+        }
+
+      packed_vector push_back(value_type value) const
+        {
+        if (_size % fields_per_word == 0)
+          return packed_vector(_words.push_back(_field(value)), _size + 1);
+        return packed_vector(_words, _size + 1).set(_size, value);
+        }
+
+      packed_vector pop_back() const
+        {
+        if ((_size - 1) % fields_per_word == 0)
+          return packed_vector(_words.pop_back(), _size - 1);
+        return packed_vector(set(_size - 1, 0)._words, _size - 1);
+        }
+
+      // the number of elements equal to value
+      size_type count(value_type value) const
+        {
+        return rank(value, _size);
+        }
+
+      // the number of elements equal to value among the first pos elements
+      size_type rank(value_type value, size_type pos) const
+        {
+        if (pos > _size)
+          throw std::out_of_range("invalid packed_vector index");
+        if (Bits == 1)
+          {
+          const size_type ones = rrb_packed_rank(_words.raw(), pos);
+          return value ? ones : pos - ones;
+          }
+        const size_type full_words = pos / fields_per_word;
+        size_type matches = 0;
+        auto count_words = [&](const uint64_t* p, uint32_t len, rrb_index_type offset) -> bool
+          {
+          if (offset >= full_words)
+            return false;
+          const uint32_t n = (uint32_t)std::min<rrb_index_type>(len, full_words - offset);
+          for (uint32_t i = 0; i < n; ++i)
+            matches += rrb_details::word_popcount(_matching_fields(p[i], value));
+          return true;
+          };
+        rrb_walk_leaves(_words.raw().ptr, 0, count_words);
+        if (pos % fields_per_word != 0)
+          matches += rrb_details::word_popcount(_matching_fields(_words[full_words], value) & _low_fields(pos % fields_per_word));
+        return matches;
+        }
+
+      // the index of the n-th element equal to value, counting from 0, or
+      // size() if there are not that many
+      size_type select(value_type value, size_type n) const
+        {
+        if (Bits == 1)
+          return std::min(rrb_packed_select(_words.raw(), value != 0, n), _size);
+        size_type found = _size;
+        auto select_words = [&](const uint64_t* p, uint32_t len, rrb_index_type offset) -> bool
+          {
+          for (uint32_t i = 0; i < len; ++i)
+            {
+            const uint64_t matching = _matching_fields(p[i], value);
+            const uint32_t matches = rrb_details::word_popcount(matching);
+            if (n < matches)
+              {
+              found = (offset + i) * fields_per_word + rrb_details::word_select(matching, (uint32_t)n) / Bits;
+              return false;
+              }
+            n -= matches;
+            }
+          return true;
+          };
+        rrb_walk_leaves(_words.raw().ptr, 0, select_words);
+        return std::min(found, _size);
+        }
+
+      bool operator == (const packed_vector& other) const
+        {
+        return _size == other._size && _words == other._words;
+        }
+
+      bool operator != (const packed_vector& other) const
+        {
+        return !(*this == other);
+        }
+
+      const word_vector_type& words() const
+        {
+        return _words;
+        }
+
+    private:
+      packed_vector(const word_vector_type& words, size_type size) : _words(words), _size(size)
+        {
+        }
+
+      static const uint64_t field_mask = ((uint64_t)1 << Bits) - 1;
+      // the lowest bit of every field
+      static const uint64_t low_bits = ~(uint64_t)0 / field_mask;
+      // the highest bit of every field
+      static const uint64_t high_bits = low_bits << (Bits - 1);
+
+      static uint64_t _field(uint64_t value)
+        {
+        assert(value <= field_mask);
+        return value & field_mask;
+        }
+
+      static uint64_t _broadcast(uint64_t value)
+        {
+        return _field(value) * low_bits;
+        }
+
+      // a mask of the first `fields` fields, fields < fields_per_word
+      static uint64_t _low_fields(uint32_t fields)
+        {
+        return ((uint64_t)1 << (fields * Bits)) - 1;
+        }
+
+      // A word with the highest bit of every field of w that equals value set.
+      // The field sums cannot carry into the next field, as both terms are
+      // below half the field range.
+      static uint64_t _matching_fields(uint64_t w, uint64_t value)
+        {
+        const uint64_t x = w ^ _broadcast(value);
+        const uint64_t nonzero = (((x & ~high_bits) + ~high_bits) | x) & high_bits;
+        return ~nonzero & high_bits;
+        }
+
+      word_vector_type _words;
+      size_type _size;
+    };
+
+  template <uint32_t Bits, bool atomic_ref_counting, int N>
+  const uint64_t packed_vector<Bits, atomic_ref_counting, N>::field_mask;
+
+  template <uint32_t Bits, bool atomic_ref_counting, int N>
+  const uint64_t packed_vector<Bits, atomic_ref_counting, N>::low_bits;
+
+  template <uint32_t Bits, bool atomic_ref_counting, int N>
+  const uint64_t packed_vector<Bits, atomic_ref_counting, N>::high_bits;
+
+  template <bool atomic_ref_counting = true, int N = 5>
+  using bit_vector = packed_vector<1, atomic_ref_counting, N>;
+
+  }
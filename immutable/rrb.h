@@ -34,15 +34,38 @@
 #include <vector>
 #include <algorithm>
 #include <atomic>
+#include <thread>
 #include <tuple>
+#include <type_traits>
 
 #ifndef _WIN32
 #include <string.h>
 #endif
 
+// Keeps rarely taken slow paths out of the inlined reference counting code.
+#ifdef _MSC_VER
+#define RRB_NOINLINE __declspec(noinline)
+#else
+#define RRB_NOINLINE __attribute__((noinline))
+#endif
+
+// The type of element counts and indices. 32 bits by default, which limits
+// vectors to 4G elements. Define RRB_INDEX_TYPE as uint64_t, identically in
+// every translation unit, for larger vectors at the cost of larger size tables.
+#ifndef RRB_INDEX_TYPE
+#define RRB_INDEX_TYPE uint32_t
+#endif
+
+// _mm_prefetch, for rrb_details::prefetch
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#endif
+
 namespace immutable
   {
 
+  typedef RRB_INDEX_TYPE rrb_index_type;
+
   template <typename T, bool atomic_ref_counting, int N>
   struct rrb;
 
@@ -94,22 +117,28 @@ namespace immutable
   ref<rrb<T, atomic_ref_counting, N> > rrb_pop(const ref<rrb<T, atomic_ref_counting, N> >& in);
 
   template <typename T, bool atomic_ref_counting, int N>
-  ref<rrb<T, atomic_ref_counting, N> > rrb_update(const ref<rrb<T, atomic_ref_counting, N> >& in, uint32_t index, T element);
+  ref<rrb<T, atomic_ref_counting, N> > rrb_update(const ref<rrb<T, atomic_ref_counting, N> >& in, rrb_index_type index, T element);
+
+  template <typename T, bool atomic_ref_counting, int N>
+  const T& rrb_nth(const ref<rrb<T, atomic_ref_counting, N> >& in, rrb_index_type index);
+
+  template <typename T, bool atomic_ref_counting, int N>
+  std::tuple<const T*, rrb_index_type, rrb_index_type> rrb_region_for(const ref<rrb<T, atomic_ref_counting, N> >& in, rrb_index_type index);
 
   template <typename T, bool atomic_ref_counting, int N>
-  const T& rrb_nth(const ref<rrb<T, atomic_ref_counting, N> >& in, uint32_t index);
+  const T& rrb_nth(const rrb<T, atomic_ref_counting, N>* in, rrb_index_type index);
 
   template <typename T, bool atomic_ref_counting, int N>
-  std::tuple<const T*, uint32_t, uint32_t> rrb_region_for(const ref<rrb<T, atomic_ref_counting, N> >& in, uint32_t index);
+  std::tuple<const T*, rrb_index_type, rrb_index_type> rrb_region_for(const rrb<T, atomic_ref_counting, N>* in, rrb_index_type index);
 
   template <typename T, bool atomic_ref_counting, int N>
-  uint32_t rrb_count(const ref<rrb<T, atomic_ref_counting, N> >& rrb);
+  rrb_index_type rrb_count(const ref<rrb<T, atomic_ref_counting, N> >& rrb);
 
   template <typename T, bool atomic_ref_counting, int N>
   const T& rrb_peek(const ref<rrb<T, atomic_ref_counting, N> >& rrb);
 
   template <typename T, bool atomic_ref_counting, int N>
-  ref<rrb<T, atomic_ref_counting, N>> rrb_slice(const ref<rrb<T, atomic_ref_counting, N> >& rrb, uint32_t from, uint32_t to);
+  ref<rrb<T, atomic_ref_counting, N>> rrb_slice(const ref<rrb<T, atomic_ref_counting, N> >& rrb, rrb_index_type from, rrb_index_type to);
 
   template <typename T, bool atomic_ref_counting, int N>
   ref<rrb<T, atomic_ref_counting, N>> rrb_concat(const ref<rrb<T, atomic_ref_counting, N> >& left, const ref<rrb<T, atomic_ref_counting, N> >& right);
@@ -117,7 +146,15 @@ namespace immutable
   namespace rrb_details
     {
 
-    typedef uint32_t guid_type;
+    // 64 bits, so that guids never wrap around in long running processes
+    typedef uint64_t guid_type;
+
+    // The parallel operations take the number of threads to use, where 0
+    // means one thread per core.
+    inline uint32_t thread_count(uint32_t threads)
+      {
+      return threads == 0 ? std::max<uint32_t>(1, std::thread::hardware_concurrency()) : threads;
+      }
 
     template <int N>
     struct bits
@@ -127,15 +164,37 @@ namespace immutable
         rrb_bits = N,
         rrb_branching = (1 << N),
         rrb_mask = (1 << N) - 1,
-        rrb_max_height = (32 + (N - 1)) / N,
+        rrb_max_height = (sizeof(rrb_index_type) * 8 + (N - 1)) / N,
         rrb_invariant = 1,
         rrb_extras = 2
         };
 
       }; // bits
 
+    // Asks the cpu to load the cache line at p, without waiting for it.
+    // Sorted gathers always prefetch the next child they descend into. Define
+    // RRB_PREFETCH to let iterators and leaf walks prefetch the next leaf
+    // while they read the current one as well, and to interleave the
+    // descents of unsorted gathers (see rrb_gather). It pays off on vectors
+    // that do not fit in cache, and only costs a few instructions per leaf on
+    // smaller ones.
+    inline void prefetch(const void* p)
+      {
+#if defined(__GNUC__) || defined(__clang__)
+      __builtin_prefetch(p);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+      _mm_prefetch((const char*)p, _MM_HINT_T0);
+#else
+      (void)p;
+#endif
+      }
+
     typedef enum { LEAF_NODE, INTERNAL_NODE } node_type;
 
+    // Flags of an rrb head. A head with an EMBEDDED_TAIL lives in the same
+    // allocation as its tail leaf (see rrb_small_create).
+    enum { EMBEDDED_TAIL = 1 };
+
     template <bool atomic_ref_counting>
     struct rrb_size_table;
 
@@ -204,6 +263,18 @@ namespace immutable
     template <typename T, int N>
     void addref(const rrb<T, false, N>* p_node);
 
+    template <bool atomic_ref_counting>
+    void destroy(const rrb_size_table<atomic_ref_counting>* p_table);
+
+    template <typename T, bool atomic_ref_counting>
+    void destroy(const leaf_node<T, atomic_ref_counting>* p_node);
+
+    template <typename T, bool atomic_ref_counting>
+    void destroy(const internal_node<T, atomic_ref_counting>* p_node);
+
+    template <typename T, bool atomic_ref_counting, int N>
+    void destroy(const rrb<T, atomic_ref_counting, N>* p_node);
+
     template <typename T, int N>
     void release(const transient_rrb<T, true, N>* p_node);
 
@@ -219,7 +290,7 @@ namespace immutable
     template <bool atomic_ref_counting>
     struct rrb_size_table
       {
-      uint32_t* size;
+      rrb_index_type* size;
       mutable std::atomic<uint32_t> _ref_count;
       guid_type guid;
       };
@@ -227,141 +298,354 @@ namespace immutable
     template <>
     struct rrb_size_table<false>
       {
-      uint32_t* size;
+      rrb_index_type* size;
       mutable uint32_t _ref_count;
       guid_type guid;
       };
 
+    // Only trees of text (see rrb_text.h) and of packed words (see
+    // rrb_packed.h) cache a summary of each subtree in their nodes. The nodes
+    // of other trees derive from the empty version, which takes no space.
+    template <typename T>
+    struct node_has_summary
+      {
+      enum { value = std::is_same<T, char>::value || std::is_same<T, uint64_t>::value };
+      };
+
+    template <typename T, bool atomic_ref_counting, bool has_summary = node_has_summary<T>::value>
+    struct node_summary
+      {
+      enum { summary_cached = 0 };
+      };
+
+    template <typename T>
+    struct node_summary<T, true, true>
+      {
+      enum { summary_cached = 1 };
+      mutable std::atomic<uint64_t> summary;
+      };
+
+    template <typename T>
+    struct node_summary<T, false, true>
+      {
+      enum { summary_cached = 1 };
+      mutable uint64_t summary;
+      };
+
     template <typename T, bool atomic_ref_counting>
-    struct internal_node
+    struct internal_node : node_summary<T, atomic_ref_counting>
       {
       node_type type;
       uint32_t len;
       mutable std::atomic<uint32_t> _ref_count;
       guid_type guid;
+      mutable std::atomic<uint64_t> hash;
       ref<rrb_size_table<atomic_ref_counting> > size_table;
       ref<internal_node<T, atomic_ref_counting> >* child;
       };
 
     template <typename T>
-    struct internal_node<T, false>
+    struct internal_node<T, false> : node_summary<T, false>
       {
       node_type type;
       uint32_t len;
       mutable uint32_t _ref_count;
       guid_type guid;
+      mutable uint64_t hash;
       ref<rrb_size_table<false> > size_table;
       ref<internal_node<T, false> >* child;
       };
 
     template <typename T, bool atomic_ref_counting>
-    struct tree_node
+    struct tree_node : node_summary<T, atomic_ref_counting>
       {
       node_type type;
       uint32_t len;
       mutable std::atomic<uint32_t> _ref_count;
       guid_type guid;
+      mutable std::atomic<uint64_t> hash;
       };
 
     template <typename T>
-    struct tree_node<T, false>
+    struct tree_node<T, false> : node_summary<T, false>
       {
       node_type type;
       uint32_t len;
       mutable uint32_t _ref_count;
       guid_type guid;
+      mutable uint64_t hash;
       };
 
     template <typename T, bool atomic_ref_counting>
-    struct leaf_node
+    struct leaf_node : node_summary<T, atomic_ref_counting>
       {
       node_type type;
       uint32_t len;
       mutable std::atomic<uint32_t> _ref_count;
       guid_type guid;
+      mutable std::atomic<uint64_t> hash;
       T* child;
       };
 
     template <typename T>
-    struct leaf_node<T, false>
+    struct leaf_node<T, false> : node_summary<T, false>
       {
       node_type type;
       uint32_t len;
       mutable uint32_t _ref_count;
       guid_type guid;
+      mutable uint64_t hash;
       T* child;
       };
 
-    inline void release(const rrb_size_table<true>* p_table)
+    /**
+     * Deferred decrements for atomically reference counted nodes. While a
+     * deferred_ref_counting_scope is active on a thread, release only records
+     * the decrement in a small thread-local table instead of doing an atomic
+     * fetch_sub. An addref of a node with a pending decrement cancels it,
+     * without touching the shared reference count at all. The table is
+     * flushed when the scope ends, or when it fills up. Nodes are never freed
+     * too early, because the shared count is only ever too high while
+     * decrements are pending.
+     */
+
+    struct deferred_release
       {
-      if (p_table)
+      const void* ptr;
+      uint32_t count;
+      void (*release_n)(const void*, uint32_t);
+      };
+
+    struct deferred_releases
+      {
+      enum { capacity = 256, max_used = 192 };
+      deferred_release entries[capacity];
+      uint16_t used_slots[max_used];
+      uint32_t used;
+      bool flushing;
+      };
+
+    inline deferred_releases*& current_deferred_releases()
+      {
+      static thread_local deferred_releases* releases = nullptr;
+      return releases;
+      }
+
+    // The number of threads with an active scope. While it is zero, addref and
+    // release skip the thread-local lookup.
+    inline std::atomic<uint32_t>& deferred_scopes()
+      {
+      static std::atomic<uint32_t> scopes(0);
+      return scopes;
+      }
+
+    inline uint32_t deferred_slot(const void* p)
+      {
+      return (uint32_t)((((uint64_t)(uintptr_t)p >> 4) * 0x9e3779b97f4a7c15ull) >> 56) & (deferred_releases::capacity - 1);
+      }
+
+    inline void flush_deferred_releases(deferred_releases* releases)
+      {
+      // Destroying a node releases its children, which must not be deferred
+      // into the table that we are emptying.
+      releases->flushing = true;
+      for (uint32_t i = 0; i < releases->used; ++i)
         {
-        if (1 == p_table->_ref_count.fetch_sub(1, std::memory_order_acq_rel))
+        deferred_release& e = releases->entries[releases->used_slots[i]];
+        if (e.count > 0)
           {
-          free((void*)p_table);
+          const uint32_t count = e.count;
+          e.count = 0;
+          e.release_n(e.ptr, count);
           }
+        e.ptr = nullptr;
+        }
+      releases->used = 0;
+      releases->flushing = false;
+      }
+
+    // Returns false if the decrement was not handled and must be done now.
+    // ref_count is the current reference count of p. If all references but
+    // ours are our own pending decrements, nobody else shares p anymore, so
+    // all of them are applied right away. Releasing such a node immediately
+    // releases its children, whose decrements can then be coalesced.
+    RRB_NOINLINE inline bool defer_release(const void* p, uint32_t ref_count, void (*release_n)(const void*, uint32_t))
+      {
+      deferred_releases* releases = current_deferred_releases();
+      if (releases == nullptr || releases->flushing)
+        return false;
+      uint32_t i = deferred_slot(p);
+      for (;;)
+        {
+        deferred_release& e = releases->entries[i];
+        if (e.ptr == p)
+          {
+          if (e.count + 1 == ref_count)
+            {
+            const uint32_t count = e.count + 1;
+            e.count = 0;
+            release_n(p, count);
+            return true;
+            }
+          if (e.count == 0)
+            e.release_n = release_n; // the address may have been reused by another node type
+          ++e.count;
+          return true;
+          }
+        if (e.ptr == nullptr)
+          {
+          if (ref_count == 1)
+            return false;
+          if (releases->used == deferred_releases::max_used)
+            {
+            flush_deferred_releases(releases);
+            i = deferred_slot(p);
+            continue;
+            }
+          e.ptr = p;
+          e.count = 1;
+          e.release_n = release_n;
+          releases->used_slots[releases->used++] = (uint16_t)i;
+          return true;
+          }
+        i = (i + 1) & (deferred_releases::capacity - 1);
         }
       }
 
-    inline void release(const rrb_size_table<false>* p_table)
+    // Returns true if a pending decrement of p was cancelled.
+    RRB_NOINLINE inline bool cancel_deferred_release(const void* p)
       {
-      if (p_table)
+      deferred_releases* releases = current_deferred_releases();
+      if (releases == nullptr)
+        return false;
+      uint32_t i = deferred_slot(p);
+      for (;;)
         {
-        if (1 == p_table->_ref_count--)
+        deferred_release& e = releases->entries[i];
+        if (e.ptr == p)
           {
-          free((void*)p_table);
+          if (e.count == 0)
+            return false;
+          --e.count;
+          return true;
           }
+        if (e.ptr == nullptr)
+          return false;
+        i = (i + 1) & (deferred_releases::capacity - 1);
         }
       }
 
-    template <typename T>
-    inline void release(const leaf_node<T, true>* p_node)
+    // Drops count references to p at once, and destroys p if they were the last.
+    template <typename Node>
+    inline void release_n(const void* p, uint32_t count)
       {
-      if (p_node)
+      const Node* p_node = (const Node*)p;
+      if (count == p_node->_ref_count.fetch_sub(count, std::memory_order_acq_rel))
+        destroy(p_node);
+      }
+
+    // Destroying a node that is no longer referenced is kept out of line, so
+    // that the inlined reference counting code never sees the node freed.
+    template <bool atomic_ref_counting>
+    RRB_NOINLINE inline void destroy(const rrb_size_table<atomic_ref_counting>* p_table)
+      {
+      free((void*)p_table);
+      }
+
+    template <typename T, bool atomic_ref_counting>
+    RRB_NOINLINE inline void destroy(const leaf_node<T, atomic_ref_counting>* p_node)
+      {
+      for (uint32_t i = 0; i < p_node->len; ++i)
+        p_node->child[i].~T();
+      free((void*)p_node);
+      }
+
+    template <typename T, bool atomic_ref_counting>
+    RRB_NOINLINE inline void destroy(const internal_node<T, atomic_ref_counting>* p_node)
+      {
+      p_node->size_table.dec();
+      for (uint32_t i = 0; i < p_node->len; ++i)
         {
-        if (1 == p_node->_ref_count.fetch_sub(1, std::memory_order_acq_rel))
+        if (p_node->child[i].ptr && p_node->child[i]->type == LEAF_NODE)
           {
-          for (uint32_t i = 0; i < p_node->len; ++i)
-            p_node->child[i].~T();
-          free((void*)p_node);
+          release((leaf_node<T, atomic_ref_counting>*)p_node->child[i].ptr);
           }
+        else
+          release(p_node->child[i].ptr);
+        }
+      free((void*)p_node);
+      }
+
+    // The head is read before anything is freed: a head with an
+    // EMBEDDED_TAIL is freed together with its tail leaf, so it is not touched
+    // after the tail is released.
+    template <typename T, bool atomic_ref_counting, int N>
+    RRB_NOINLINE inline void destroy(const rrb<T, atomic_ref_counting, N>* p_node)
+      {
+      const leaf_node<T, atomic_ref_counting>* tail = p_node->tail.ptr;
+      const bool embedded = (p_node->flags & EMBEDDED_TAIL) != 0;
+      release<T>(p_node->root.ptr);
+      if (!embedded)
+        free((void*)p_node);
+      release(tail);
+      }
+
+    template <typename Node>
+    inline void release_atomic(const Node* p_node)
+      {
+      if (p_node == nullptr)
+        return;
+      // a node that nobody else references has no pending decrements
+      if (deferred_scopes().load(std::memory_order_relaxed) == 0 || p_node->_ref_count.load(std::memory_order_relaxed) == 1 || !defer_release(p_node, p_node->_ref_count.load(std::memory_order_relaxed), &release_n<Node>))
+        {
+        if (1 == p_node->_ref_count.fetch_sub(1, std::memory_order_acq_rel))
+          destroy(p_node);
+        }
+      }
+
+    template <typename Node>
+    inline void addref_atomic(const Node* p_node)
+      {
+      if (p_node == nullptr)
+        return;
+      if (deferred_scopes().load(std::memory_order_relaxed) == 0 || !cancel_deferred_release(p_node))
+        p_node->_ref_count.fetch_add(1, std::memory_order_relaxed);
+      }
+
+    inline void release(const rrb_size_table<true>* p_table)
+      {
+      release_atomic(p_table);
+      }
+
+    inline void release(const rrb_size_table<false>* p_table)
+      {
+      if (p_table)
+        {
+        if (1 == p_table->_ref_count--)
+          destroy(p_table);
         }
       }
 
+    template <typename T>
+    inline void release(const leaf_node<T, true>* p_node)
+      {
+      release_atomic(p_node);
+      }
+
     template <typename T>
     inline void release(const leaf_node<T, false>* p_node)
       {
       if (p_node)
         {
         if (1 == p_node->_ref_count--)
-          {
-          for (uint32_t i = 0; i < p_node->len; ++i)
-            p_node->child[i].~T();
-          free((void*)p_node);
-          }
+          destroy(p_node);
         }
       }
 
     template <typename T>
     inline void release(const internal_node<T, true>* p_node)
       {
-      if (p_node)
-        {
-        if (1 == p_node->_ref_count.fetch_sub(1, std::memory_order_acq_rel))
-          {
-          p_node->size_table.dec();
-          for (uint32_t i = 0; i < p_node->len; ++i)
-            {
-            if (p_node->child[i].ptr && p_node->child[i]->type == LEAF_NODE)
-              {
-              release((leaf_node<T, true>*)p_node->child[i].ptr);
-              }
-            else
-              release(p_node->child[i].ptr);
-            }
-          free((void*)p_node);
-          }
-        }
+      release_atomic(p_node);
       }
 
     template <typename T>
@@ -370,19 +654,7 @@ namespace immutable
       if (p_node)
         {
         if (1 == p_node->_ref_count--)
-          {
-          p_node->size_table.dec();
-          for (uint32_t i = 0; i < p_node->len; ++i)
-            {
-            if (p_node->child[i].ptr && p_node->child[i]->type == LEAF_NODE)
-              {
-              release((leaf_node<T, false>*)p_node->child[i].ptr);
-              }
-            else
-              release(p_node->child[i].ptr);
-            }
-          free((void*)p_node);
-          }
+          destroy(p_node);
         }
       }
 
@@ -413,15 +685,7 @@ namespace immutable
     template <typename T, int N>
     inline void release(const rrb<T, true, N>* p_node)
       {
-      if (p_node)
-        {
-        if (1 == p_node->_ref_count.fetch_sub(1, std::memory_order_acq_rel))
-          {
-          release(p_node->tail.ptr);
-          release<T>(p_node->root.ptr);
-          free((void*)p_node);
-          }
-        }
+      release_atomic(p_node);
       }
 
     template <typename T, int N>
@@ -430,47 +694,38 @@ namespace immutable
       if (p_node)
         {
         if (1 == p_node->_ref_count--)
-          {
-          release(p_node->tail.ptr);
-          release<T>(p_node->root.ptr);
-          free((void*)p_node);
-          }
+          destroy(p_node);
         }
       }
 
 
     inline void addref(const rrb_size_table<true>* p_node)
       {
-      if (p_node)
-        p_node->_ref_count.fetch_add(1, std::memory_order_relaxed);
+      addref_atomic(p_node);
       }
 
     template <typename T>
     inline void addref(const leaf_node<T, true>* p_node)
       {
-      if (p_node)
-        p_node->_ref_count.fetch_add(1, std::memory_order_relaxed);
+      addref_atomic(p_node);
       }
 
     template <typename T>
     inline void addref(const internal_node<T, true>* p_node)
       {
-      if (p_node)
-        p_node->_ref_count.fetch_add(1, std::memory_order_relaxed);
+      addref_atomic(p_node);
       }
 
     template <typename T>
     inline void addref(const tree_node<T, true>* p_node)
       {
-      if (p_node)
-        p_node->_ref_count.fetch_add(1, std::memory_order_relaxed);
+      addref_atomic(p_node);
       }
 
     template <typename T, int N>
     inline void addref(const rrb<T, true, N>* p_node)
       {
-      if (p_node)
-        p_node->_ref_count.fetch_add(1, std::memory_order_relaxed);
+      addref_atomic(p_node);
       }
 
     inline void addref(const rrb_size_table<false>* p_node)
@@ -507,11 +762,53 @@ namespace immutable
         ++p_node->_ref_count;
       }
 
+    // Nodes cache the hash of the sequence of elements they contain (see
+    // rrb_hash.h) and, for text and packed words, a summary of their subtree
+    // (see node_summary). A cached value of 0 means that it was not computed
+    // yet.
+    inline uint64_t load_cached(const std::atomic<uint64_t>& hash)
+      {
+      return hash.load(std::memory_order_relaxed);
+      }
+
+    inline uint64_t load_cached(uint64_t hash)
+      {
+      return hash;
+      }
+
+    inline void store_cached(std::atomic<uint64_t>& hash, uint64_t value)
+      {
+      hash.store(value, std::memory_order_relaxed);
+      }
+
+    inline void store_cached(uint64_t& hash, uint64_t value)
+      {
+      hash = value;
+      }
+
+    template <typename Node>
+    inline void reset_summary(Node* node, std::true_type)
+      {
+      store_cached(node->summary, 0);
+      }
+
+    template <typename Node>
+    inline void reset_summary(Node*, std::false_type)
+      {
+      }
+
+    template <typename Node>
+    inline void reset_caches(Node* node)
+      {
+      store_cached(node->hash, 0);
+      reset_summary(node, std::integral_constant<bool, Node::summary_cached != 0>());
+      }
+
     template <bool atomic_ref_counting>
     inline rrb_size_table<atomic_ref_counting>* size_table_create(uint32_t size)
       {
-      rrb_size_table<atomic_ref_counting>* table = (rrb_size_table<atomic_ref_counting>*)malloc(sizeof(rrb_size_table<atomic_ref_counting>) + size * sizeof(uint32_t));
-      table->size = (uint32_t*)((char*)table + sizeof(rrb_size_table<atomic_ref_counting>));
+      rrb_size_table<atomic_ref_counting>* table = (rrb_size_table<atomic_ref_counting>*)malloc(sizeof(rrb_size_table<atomic_ref_counting>) + size * sizeof(rrb_index_type));
+      table->size = (rrb_index_type*)((char*)table + sizeof(rrb_size_table<atomic_ref_counting>));
       table->guid = 0;
       return table;
       }
@@ -519,9 +816,9 @@ namespace immutable
     template <bool atomic_ref_counting>
     inline rrb_size_table<atomic_ref_counting>* size_table_clone(const rrb_size_table<atomic_ref_counting>* original, uint32_t len)
       {
-      rrb_size_table<atomic_ref_counting>* clone = (rrb_size_table<atomic_ref_counting>*)malloc(sizeof(rrb_size_table<atomic_ref_counting>) + len * sizeof(uint32_t));
-      clone->size = (uint32_t*)((char*)clone + sizeof(rrb_size_table<atomic_ref_counting>));
-      memcpy(clone->size, original->size, sizeof(uint32_t) * len);
+      rrb_size_table<atomic_ref_counting>* clone = (rrb_size_table<atomic_ref_counting>*)malloc(sizeof(rrb_size_table<atomic_ref_counting>) + len * sizeof(rrb_index_type));
+      clone->size = (rrb_index_type*)((char*)clone + sizeof(rrb_size_table<atomic_ref_counting>));
+      memcpy(clone->size, original->size, sizeof(rrb_index_type) * len);
       clone->guid = 0;
       return clone;
       }
@@ -529,9 +826,9 @@ namespace immutable
     template <bool atomic_ref_counting>
     inline rrb_size_table<atomic_ref_counting>* size_table_inc(const rrb_size_table<atomic_ref_counting> *original, uint32_t len)
       {
-      rrb_size_table<atomic_ref_counting>* table = (rrb_size_table<atomic_ref_counting>*)malloc(sizeof(rrb_size_table<atomic_ref_counting>) + (len + 1) * sizeof(uint32_t));
-      table->size = (uint32_t*)((char*)table + sizeof(rrb_size_table<atomic_ref_counting>));
-      memcpy(table->size, original->size, sizeof(uint32_t) * len);
+      rrb_size_table<atomic_ref_counting>* table = (rrb_size_table<atomic_ref_counting>*)malloc(sizeof(rrb_size_table<atomic_ref_counting>) + (len + 1) * sizeof(rrb_index_type));
+      table->size = (rrb_index_type*)((char*)table + sizeof(rrb_size_table<atomic_ref_counting>));
+      memcpy(table->size, original->size, sizeof(rrb_index_type) * len);
       table->guid = 0;
       return table;
       }
@@ -541,11 +838,81 @@ namespace immutable
       {
       rrb<T, atomic_ref_counting, N>* clone = (rrb<T, atomic_ref_counting, N>*)malloc(sizeof(rrb<T, atomic_ref_counting, N>));
       memcpy(clone, original, sizeof(rrb<T, atomic_ref_counting, N>));
+      clone->flags = 0;
       clone->root.inc();
       clone->tail.inc();
       return clone;
       }
 
+    // Creates an empty head, for trees that are filled in by the caller.
+    template <typename T, bool atomic_ref_counting, int N>
+    inline rrb<T, atomic_ref_counting, N>* rrb_head_create()
+      {
+      rrb<T, atomic_ref_counting, N>* head = (rrb<T, atomic_ref_counting, N>*)malloc(sizeof(rrb<T, atomic_ref_counting, N>));
+      head->cnt = 0;
+      head->shift = 0;
+      head->tail_len = 0;
+      head->root.ptr = nullptr;
+      head->tail.ptr = nullptr;
+      head->flags = 0;
+      return head;
+      }
+
+    /**
+     * rrb_small_create allocates the head of a tree without root together with
+     * its tail leaf of length len, as one block laid out as
+     * [leaf][head][elements]. The head holds a reference to the leaf, so the
+     * block stays alive as long as the head does. Releasing the leaf frees the
+     * block, which is why a head with an EMBEDDED_TAIL never frees itself.
+     * The elements are default constructed.
+     */
+    template <typename T, bool atomic_ref_counting, int N>
+    inline rrb<T, atomic_ref_counting, N>* rrb_small_create(uint32_t len)
+      {
+      const size_t head_offset = sizeof(leaf_node<T, atomic_ref_counting>);
+      const size_t child_offset = (head_offset + sizeof(rrb<T, atomic_ref_counting, N>) + alignof(T) - 1) / alignof(T) * alignof(T);
+      char* block = (char*)malloc(child_offset + len * sizeof(T));
+      leaf_node<T, atomic_ref_counting>* leaf = (leaf_node<T, atomic_ref_counting>*)block;
+      leaf->len = len;
+      leaf->type = LEAF_NODE;
+      leaf->child = (T*)(block + child_offset);
+      leaf->guid = 0;
+      reset_caches(leaf);
+      for (uint32_t i = 0; i < len; ++i)
+        {
+        T* loc = (T*)((char*)leaf->child + i * sizeof(T));
+        loc = new(loc) T(); // placement new
+        }
+      rrb<T, atomic_ref_counting, N>* head = (rrb<T, atomic_ref_counting, N>*)(block + head_offset);
+      head->cnt = len;
+      head->shift = 0;
+      head->tail_len = len;
+      head->root.ptr = nullptr;
+      head->tail.ptr = leaf;
+      leaf->_ref_count = 1;
+      head->flags = EMBEDDED_TAIL;
+      return head;
+      }
+
+    // Empty trees with atomic reference counting share one head per thread,
+    // so that threads do not contend on the reference count of a single
+    // head. A head that moves to another thread stays valid, since its count
+    // is atomic. The non-atomic reference count of a shared head could not be
+    // updated from several threads, so those get their own single allocation
+    // instead.
+    template <typename T, int N>
+    inline ref<rrb<T, true, N>> rrb_empty(std::true_type)
+      {
+      static thread_local const ref<rrb<T, true, N>> empty(rrb_small_create<T, true, N>(0));
+      return empty;
+      }
+
+    template <typename T, int N>
+    inline ref<rrb<T, false, N>> rrb_empty(std::false_type)
+      {
+      return ref<rrb<T, false, N>>(rrb_small_create<T, false, N>(0));
+      }
+
     template <typename T, bool atomic_ref_counting>
     inline leaf_node<T, atomic_ref_counting>* create_empty_leaf()
       {
@@ -554,6 +921,7 @@ namespace immutable
       empty->len = 0;
       empty->child = nullptr;
       empty->guid = 0;
+      reset_caches(empty);
       return empty;
       }
 
@@ -566,6 +934,7 @@ namespace immutable
       inc->type = LEAF_NODE;
       inc->child = (T*)((char*)inc + sizeof(leaf_node<T, atomic_ref_counting>));
       inc->guid = 0;
+      reset_caches(inc);
       //memcpy(inc->child, original->child, original->len * sizeof(T));
       for (uint32_t i = 0; i < original->len; ++i)
         inc->child[i] = original->child[i]; // don't memcpy, but use copy constructor
@@ -582,6 +951,7 @@ namespace immutable
       leaf->type = LEAF_NODE;
       leaf->child = (T*)((char*)leaf + sizeof(leaf_node<T, atomic_ref_counting>));
       leaf->guid = 0;
+      reset_caches(leaf);
       for (uint32_t i = 0; i < len; ++i)
         {
         T* loc = (T*)((char*)leaf->child + i * sizeof(T));
@@ -599,6 +969,7 @@ namespace immutable
       clone->type = LEAF_NODE;
       clone->child = (T*)((char*)clone + sizeof(leaf_node<T, atomic_ref_counting>));
       clone->guid = 0;
+      reset_caches(clone);
       //memcpy(clone->child, original->child, original->len * sizeof(T));
       for (uint32_t i = 0; i < original->len; ++i)
         clone->child[i] = original->child[i]; // don't memcpy, but use copy constructor
@@ -614,6 +985,7 @@ namespace immutable
       dec->type = LEAF_NODE;
       dec->child = (T*)((char*)dec + sizeof(leaf_node<T, atomic_ref_counting>));
       dec->guid = 0;
+      reset_caches(dec);
       //memcpy(dec->child, original->child, (original->len - 1) * sizeof(T));
       for (uint32_t i = 0; i < original->len - 1; ++i)
         dec->child[i] = original->child[i]; // don't memcpy, but use copy constructor
@@ -642,6 +1014,7 @@ namespace immutable
       node->type = INTERNAL_NODE;
       node->size_table.ptr = nullptr;
       node->guid = 0;
+      reset_caches(node);
       node->child = (ref<internal_node<T, atomic_ref_counting>>*)((char*)node + sizeof(internal_node<T, atomic_ref_counting>));
       memset(node->child, 0, len * sizeof(ref<internal_node<T, atomic_ref_counting>>)); // init pointers to zero      
       return node;
@@ -656,6 +1029,7 @@ namespace immutable
       node->size_table.ptr = nullptr;
       node->size_table = original->size_table;
       node->guid = 0;
+      reset_caches(node);
       node->child = (ref<internal_node<T, atomic_ref_counting>>*)((char*)node + sizeof(internal_node<T, atomic_ref_counting>));
       memset(node->child, 0, original->len * sizeof(ref<internal_node<T, atomic_ref_counting>>)); // init pointers to zero      
       for (uint32_t i = 0; i < original->len; ++i)
@@ -686,6 +1060,7 @@ namespace immutable
       for (uint32_t i = 0; i < original->len; ++i)
         node->child[i] = original->child[i];
       node->guid = 0;
+      reset_caches(node);
       return node;
       }
 
@@ -702,6 +1077,7 @@ namespace immutable
       for (uint32_t i = 0; i < node->len; ++i)
         node->child[i] = original->child[i];
       node->guid = 0;
+      reset_caches(node);
       return node;
       }
 
@@ -722,25 +1098,6 @@ namespace immutable
       return above;
       }
 
-    template <typename T, bool atomic_ref_counting>
-    inline internal_node<T, atomic_ref_counting>* internal_node_merge(const ref<internal_node<T, atomic_ref_counting>>& left, const ref<internal_node<T, atomic_ref_counting>>& centre, const ref<internal_node<T, atomic_ref_counting>>& right)
-      {
-      // If internal node is NULL, its size is zero.
-      uint32_t left_len = (left.ptr == nullptr) ? 0 : left->len - 1;
-      uint32_t centre_len = (centre.ptr == nullptr) ? 0 : centre->len;
-      uint32_t right_len = (right.ptr == nullptr) ? 0 : right->len - 1;
-
-      internal_node<T, atomic_ref_counting>* merged = internal_node_create<T, atomic_ref_counting>(left_len + centre_len + right_len);
-      for (uint32_t i = 0; i < left_len; ++i)
-        merged->child[i] = left->child[i];
-      for (uint32_t i = 0; i < centre_len; ++i)
-        merged->child[left_len + i] = centre->child[i];
-      for (uint32_t i = 0; i < right_len; ++i)
-        merged->child[left_len + centre_len + i] = right->child[i + 1];
-
-      return merged;
-      }
-
     template <typename T, bool atomic_ref_counting>
     inline ref<internal_node<T, atomic_ref_counting>>* append_empty(ref<internal_node<T, atomic_ref_counting>>* to_set, uint32_t empty_height)
       {
@@ -773,7 +1130,7 @@ namespace immutable
       {
       ref<internal_node<T, atomic_ref_counting>> current = in->root;
       ref<internal_node<T, atomic_ref_counting>>* to_set = (ref<internal_node<T, atomic_ref_counting>>*)&new_rrb->root;
-      uint32_t index = in->cnt - 1;
+      rrb_index_type index = in->cnt - 1;
       uint32_t shift = in->shift;
 
       // Copy all non-leaf nodes first. Happens when shift > RRB_BRANCHING
@@ -805,7 +1162,7 @@ namespace immutable
         uint32_t child_index;
         if (current->size_table.ptr == nullptr)
           {
-          child_index = (index >> shift) & bits<N>::rrb_mask;
+          child_index = (uint32_t)(index >> shift) & bits<N>::rrb_mask;
           }
         else
           {
@@ -845,7 +1202,7 @@ namespace immutable
       // TODO: Can find last rightmost jump in constant time for pvec subvecs:
       // use the fact that (index & large_mask) == 1 << (RRB_BITS * H) - 1 -> 0 etc.
 
-      uint32_t index = in->cnt - 1;
+      rrb_index_type index = in->cnt - 1;
 
       uint32_t nodes_to_copy = 0;
       uint32_t nodes_visited = 0;
@@ -871,10 +1228,10 @@ namespace immutable
             nodes_visited++; // this could possibly be done earlier in the code.
             goto copyable_count_end;
             }
-          child_index = (index >> shift) & bits<N>::rrb_mask;
+          child_index = (uint32_t)(index >> shift) & bits<N>::rrb_mask;
           // index filtering is not necessary when the check above is performed at
           // most once.
-          index &= ~(bits<N>::rrb_mask << shift);
+          index &= ~((rrb_index_type)bits<N>::rrb_mask << shift);
           }
         else
           {
@@ -976,6 +1333,15 @@ namespace immutable
     template <typename T, bool atomic_ref_counting, int N>
     inline rrb<T, atomic_ref_counting, N>* rrb_tail_push(const ref<rrb<T, atomic_ref_counting, N>>& in, T element)
       {
+      if (in->root.ptr == nullptr)
+        {
+        // Small trees keep their head and tail in a single allocation.
+        rrb<T, atomic_ref_counting, N>* small_rrb = rrb_small_create<T, atomic_ref_counting, N>(in->tail_len + 1);
+        for (uint32_t i = 0; i < in->tail_len; ++i)
+          small_rrb->tail->child[i] = in->tail->child[i]; // don't memcpy, but use copy constructor
+        small_rrb->tail->child[in->tail_len] = std::move(element);
+        return small_rrb;
+        }
       rrb<T, atomic_ref_counting, N>* new_rrb = rrb_head_clone(in.ptr);
       leaf_node<T, atomic_ref_counting>* new_tail = leaf_node_inc(in->tail.ptr);
       new_tail->child[new_rrb->tail_len] = std::move(element);
@@ -986,10 +1352,10 @@ namespace immutable
       }
 
     template <typename T, bool atomic_ref_counting>
-    inline uint32_t sized_pos(const internal_node<T, atomic_ref_counting>* node, uint32_t* index, uint32_t sp)
+    inline uint32_t sized_pos(const internal_node<T, atomic_ref_counting>* node, rrb_index_type* index, uint32_t sp)
       {
       rrb_size_table<atomic_ref_counting>* table = node->size_table.ptr;
-      uint32_t is = *index >> sp;
+      uint32_t is = (uint32_t)(*index >> sp);
       while (table->size[is] <= *index)
         {
         is++;
@@ -1002,12 +1368,105 @@ namespace immutable
       }
 
     template <typename T, bool atomic_ref_counting>
-    inline const internal_node<T, atomic_ref_counting>* sized(const internal_node<T, atomic_ref_counting>* node, uint32_t* index, uint32_t sp)
+    inline const internal_node<T, atomic_ref_counting>* sized(const internal_node<T, atomic_ref_counting>* node, rrb_index_type* index, uint32_t sp)
       {
       uint32_t is = sized_pos(node, index, sp);
       return (internal_node<T, atomic_ref_counting>*)node->child[is].ptr;
       }
 
+    // The number of elements in child i of node, which must not be the last
+    // child if node has no size table.
+    template <typename T, bool atomic_ref_counting>
+    inline rrb_index_type child_size(const internal_node<T, atomic_ref_counting>* node, uint32_t i, uint32_t shift)
+      {
+      if (node->size_table.ptr == nullptr)
+        return (rrb_index_type)1 << shift;
+      return node->size_table->size[i] - (i == 0 ? 0 : node->size_table->size[i - 1]);
+      }
+
+    /**
+     * The summary of the subtree under node, which is cached in node->summary
+     * (see node_summary). Summary describes what is summarized:
+     *
+     *   value_type                  the type of a summary, zero when value
+     *                               initialized
+     *   leaf(first, last)           the summary of a range of elements
+     *   add(sum, s)                 adds summary s to sum
+     *   pack(s), unpack(cached)     convert to and from the cached word;
+     *                               pack returns 0 for summaries that cannot
+     *                               be cached
+     */
+    template <typename Summary, typename T, bool atomic_ref_counting, int N>
+    inline typename Summary::value_type subtree_summary(const tree_node<T, atomic_ref_counting>* node, uint32_t shift)
+      {
+      const uint64_t cached = load_cached(node->summary);
+      if (cached != 0)
+        return Summary::unpack(cached);
+      typename Summary::value_type sum = typename Summary::value_type();
+      if (shift == 0)
+        {
+        const leaf_node<T, atomic_ref_counting>* leaf = (const leaf_node<T, atomic_ref_counting>*)node;
+        sum = Summary::leaf(leaf->child, leaf->child + leaf->len);
+        }
+      else
+        {
+        const internal_node<T, atomic_ref_counting>* internal = (const internal_node<T, atomic_ref_counting>*)node;
+        for (uint32_t i = 0; i < internal->len; ++i)
+          Summary::add(sum, subtree_summary<Summary, T, atomic_ref_counting, N>((const tree_node<T, atomic_ref_counting>*)internal->child[i].ptr, shift - bits<N>::rrb_bits));
+        }
+      store_cached(node->summary, Summary::pack(sum));
+      return sum;
+      }
+
+    // Descends from root to the leaf that holds index, which must lie before
+    // the tail, and calls skip(child, child_shift) for all children left of
+    // that path, e.g. to sum their cached summaries. Returns the leaf and sets
+    // index to the position of the element in it.
+    template <typename T, bool atomic_ref_counting, int N, typename Skip>
+    inline const leaf_node<T, atomic_ref_counting>* descend_to_index(const tree_node<T, atomic_ref_counting>* root, uint32_t shift, rrb_index_type& index, Skip skip)
+      {
+      const internal_node<T, atomic_ref_counting>* current = (const internal_node<T, atomic_ref_counting>*)root;
+      for (; shift > 0; shift -= bits<N>::rrb_bits)
+        {
+        uint32_t child_index;
+        if (current->size_table.ptr == nullptr)
+          child_index = (uint32_t)(index >> shift) & bits<N>::rrb_mask;
+        else
+          child_index = sized_pos(current, &index, shift);
+        for (uint32_t i = 0; i < child_index; ++i)
+          skip((const tree_node<T, atomic_ref_counting>*)current->child[i].ptr, shift - bits<N>::rrb_bits);
+        current = current->child[child_index].ptr;
+        }
+      index &= bits<N>::rrb_mask;
+      return (const leaf_node<T, atomic_ref_counting>*)current;
+      }
+
+    // Descends from root to a leaf, taking the leftmost child for which
+    // found(child, child_shift, size) returns true, where size is the number
+    // of elements under child. The predicate is tried on the children of
+    // every node from left to right and must hold for one of them, so it can
+    // subtract the summaries of the children it rejects. The size of the last
+    // child of a node without a size table may be too large. Adds the
+    // elements left of the leaf to offset and returns the leaf.
+    template <typename T, bool atomic_ref_counting, int N, typename Found>
+    inline const leaf_node<T, atomic_ref_counting>* descend_by_summary(const tree_node<T, atomic_ref_counting>* root, uint32_t shift, rrb_index_type& offset, Found found)
+      {
+      const internal_node<T, atomic_ref_counting>* current = (const internal_node<T, atomic_ref_counting>*)root;
+      for (; shift > 0; shift -= bits<N>::rrb_bits)
+        {
+        uint32_t i = 0;
+        for (;; ++i)
+          {
+          const rrb_index_type size = child_size(current, i, shift);
+          if (found((const tree_node<T, atomic_ref_counting>*)current->child[i].ptr, shift - bits<N>::rrb_bits, size))
+            break;
+          offset += size;
+          }
+        current = current->child[i].ptr;
+        }
+      return (const leaf_node<T, atomic_ref_counting>*)current;
+      }
+
     /**
      * Destructively replaces the rightmost leaf as the new tail, discarding the
      * old.
@@ -1075,17 +1534,17 @@ namespace immutable
 
 
     template <typename T, bool atomic_ref_counting, int N>
-    inline ref<tree_node<T, atomic_ref_counting>> rrb_drop_left_rec(uint32_t *total_shift, const ref<tree_node<T, atomic_ref_counting>>& root, uint32_t left, uint32_t shift, bool has_right)
+    inline ref<tree_node<T, atomic_ref_counting>> rrb_drop_left_rec(uint32_t *total_shift, const ref<tree_node<T, atomic_ref_counting>>& root, rrb_index_type left, uint32_t shift, bool has_right)
       {
       const uint32_t subshift = shift - bits<N>::rrb_bits;
-      uint32_t subidx = left >> shift;
+      uint32_t subidx = (uint32_t)(left >> shift);
       if (shift > 0)
         {
         ref<internal_node<T, atomic_ref_counting>> internal_root = root;
-        uint32_t idx = left;
+        rrb_index_type idx = left;
         if (internal_root->size_table.ptr == nullptr)
           {
-          idx -= subidx << shift;
+          idx -= (rrb_index_type)subidx << shift;
           }
         else
           { // if (internal_root->size_table != NULL)
@@ -1152,7 +1611,7 @@ namespace immutable
               {
               // left is total amount sliced off. By adding in subidx, we get faster
               // computation later on.
-              sliced_table->size[i] = (subidx + 1 + i) << shift;
+              sliced_table->size[i] = (rrb_index_type)(subidx + 1 + i) << shift;
               // NOTE: This doesn't really work properly for top root, as last node
               // may have a higher count than it *actually* has. To remedy for this,
               // the top function performs a check afterwards, which may insert the
@@ -1161,7 +1620,7 @@ namespace immutable
             }
           else
             { // if (table != NULL)
-            memcpy(sliced_table->size, &table->size[subidx], sliced_len * sizeof(uint32_t));
+            memcpy(sliced_table->size, &table->size[subidx], sliced_len * sizeof(rrb_index_type));
             }
 
           for (uint32_t i = 0; i < sliced_len; i++)
@@ -1192,17 +1651,17 @@ namespace immutable
       }
 
     template <typename T, bool atomic_ref_counting, int N>
-    inline ref<tree_node<T, atomic_ref_counting>> rrb_drop_right_rec(uint32_t *total_shift, const ref<tree_node<T, atomic_ref_counting>>& root, uint32_t right, uint32_t shift, bool has_left)
+    inline ref<tree_node<T, atomic_ref_counting>> rrb_drop_right_rec(uint32_t *total_shift, const ref<tree_node<T, atomic_ref_counting>>& root, rrb_index_type right, uint32_t shift, bool has_left)
       {
       const uint32_t subshift = shift - bits<N>::rrb_bits;
-      uint32_t subidx = right >> shift;
+      uint32_t subidx = (uint32_t)(right >> shift);
       if (shift > 0)
         {
         ref<internal_node<T, atomic_ref_counting>> internal_root = root;
         if (internal_root->size_table.ptr == nullptr)
           {
           ref<tree_node<T, atomic_ref_counting>> child = internal_root->child[subidx];
-          ref<tree_node<T, atomic_ref_counting>> right_hand_node = rrb_drop_right_rec<T, atomic_ref_counting, N>(total_shift, child, right - (subidx << shift), subshift, (subidx != 0) | has_left);
+          ref<tree_node<T, atomic_ref_counting>> right_hand_node = rrb_drop_right_rec<T, atomic_ref_counting, N>(total_shift, child, right - ((rrb_index_type)subidx << shift), subshift, (subidx != 0) | has_left);
           if (subidx == 0)
             {
             if (has_left)
@@ -1229,7 +1688,7 @@ namespace immutable
         else
           { // if (internal_root->size_table != NULL)
           rrb_size_table<atomic_ref_counting>* table = internal_root->size_table.ptr;
-          uint32_t idx = right;
+          rrb_index_type idx = right;
 
           while (table->size[subidx] <= idx)
             {
@@ -1270,7 +1729,7 @@ namespace immutable
             ref<internal_node<T, atomic_ref_counting>> sliced_root = internal_node_create<T, atomic_ref_counting>(subidx + 1);
             ref<rrb_size_table<atomic_ref_counting>> sliced_table = size_table_create<atomic_ref_counting>(subidx + 1);
 
-            memcpy(sliced_table->size, table->size, subidx * sizeof(uint32_t));
+            memcpy(sliced_table->size, table->size, subidx * sizeof(rrb_index_type));
             sliced_table->size[subidx] = right + 1;
 
             for (uint32_t i = 0; i < subidx; ++i)
@@ -1299,7 +1758,7 @@ namespace immutable
       }
 
     template <typename T, bool atomic_ref_counting, int N>
-    inline ref<rrb<T, atomic_ref_counting, N>> rrb_drop_left(ref<rrb<T, atomic_ref_counting, N>> in, uint32_t left)
+    inline ref<rrb<T, atomic_ref_counting, N>> rrb_drop_left(ref<rrb<T, atomic_ref_counting, N>> in, rrb_index_type left)
       {
       using namespace rrb_details;
       if (left >= in->cnt)
@@ -1308,26 +1767,21 @@ namespace immutable
         }
       else if (left > 0)
         {
-        const uint32_t remaining = in->cnt - left;
+        const rrb_index_type remaining = in->cnt - left;
 
         // If we slice into the tail, we just need to modify the tail itself
         if (remaining <= in->tail_len)
           {
-          ref<leaf_node<T, atomic_ref_counting>> new_tail = leaf_node_create<T, atomic_ref_counting>(remaining);
-          //memcpy(new_tail->child, &in->tail->child[in->tail_len - remaining], remaining * sizeof(T));
+          ref<rrb<T, atomic_ref_counting, N>> new_rrb = rrb_small_create<T, atomic_ref_counting, N>((uint32_t)remaining);
+          //memcpy(new_rrb->tail->child, &in->tail->child[in->tail_len - remaining], remaining * sizeof(T));
           for (uint32_t i = 0; i < remaining; ++i)
-            new_tail->child[i] = in->tail->child[in->tail_len - remaining + i]; // don't memcpy, but use copy constructor
-
-          ref<rrb<T, atomic_ref_counting, N>> new_rrb = rrb_create<T, atomic_ref_counting, N>();
-          new_rrb->cnt = remaining;
-          new_rrb->tail_len = remaining;
-          new_rrb->tail = new_tail;
+            new_rrb->tail->child[i] = in->tail->child[in->tail_len - remaining + i]; // don't memcpy, but use copy constructor
           return new_rrb;
           }
         // Otherwise, we don't really have to take the tail into consideration.
         // Good!
 
-        ref<rrb<T, atomic_ref_counting, N>> new_rrb = rrb_create<T, atomic_ref_counting, N>();
+        ref<rrb<T, atomic_ref_counting, N>> new_rrb = rrb_head_create<T, atomic_ref_counting, N>();
         ref<internal_node<T, atomic_ref_counting>> root = rrb_drop_left_rec<T, atomic_ref_counting, N>(&new_rrb->shift, in->root, left, in->shift, false);
         new_rrb->cnt = remaining;
         new_rrb->root = root;
@@ -1401,7 +1855,7 @@ namespace immutable
 
 
     template <typename T, bool atomic_ref_counting, int N>
-    inline ref<rrb<T, atomic_ref_counting, N>> rrb_drop_right(ref<rrb<T, atomic_ref_counting, N>> in, const uint32_t right)
+    inline ref<rrb<T, atomic_ref_counting, N>> rrb_drop_right(ref<rrb<T, atomic_ref_counting, N>> in, const rrb_index_type right)
       {
       using namespace rrb_details;
       if (right == 0)
@@ -1410,12 +1864,12 @@ namespace immutable
         }
       else if (right < in->cnt)
         {
-        const uint32_t tail_offset = in->cnt - in->tail_len;
+        const rrb_index_type tail_offset = in->cnt - in->tail_len;
         // Can just cut the tail slightly
         if (tail_offset < right)
           {
           ref<rrb<T, atomic_ref_counting, N>> new_rrb = rrb_head_clone(in.ptr);
-          const uint32_t new_tail_len = right - tail_offset;
+          const uint32_t new_tail_len = (uint32_t)(right - tail_offset);
           ref<leaf_node<T, atomic_ref_counting>> new_tail = leaf_node_create<T, atomic_ref_counting>(new_tail_len);
           //memcpy(new_tail->child, in->tail->child, new_tail_len * sizeof(T));
           for (uint32_t i = 0; i < new_tail_len; ++i)
@@ -1427,7 +1881,7 @@ namespace immutable
           return new_rrb;
           }
 
-        ref<rrb<T, atomic_ref_counting, N>> new_rrb = rrb_create<T, atomic_ref_counting, N>();
+        ref<rrb<T, atomic_ref_counting, N>> new_rrb = rrb_head_create<T, atomic_ref_counting, N>();
         ref<tree_node<T, atomic_ref_counting>> root = rrb_drop_right_rec<T, atomic_ref_counting, N>(&new_rrb->shift, in->root, right - 1, in->shift, false);
         new_rrb->cnt = right;
         new_rrb->root = root;
@@ -1445,7 +1899,7 @@ namespace immutable
       }
 
     template <typename T, bool atomic_ref_counting, int N>
-    inline uint32_t size_sub_trie(const ref<tree_node<T, atomic_ref_counting>>& node, uint32_t shift)
+    inline rrb_index_type size_sub_trie(const ref<tree_node<T, atomic_ref_counting>>& node, uint32_t shift)
       {
       if (shift > 0)
         {
@@ -1457,10 +1911,10 @@ namespace immutable
           // TODO: for loopify recursive calls
           /* We're not sure how many are in the last child, so look it up */
           ref<tree_node<T, atomic_ref_counting>> child = intern->child[len - 1];
-          uint32_t last_size = size_sub_trie<T, atomic_ref_counting, N>(child, child_shift);
+          rrb_index_type last_size = size_sub_trie<T, atomic_ref_counting, N>(child, child_shift);
           /* We know all but the last ones are filled, and they have child_shift
              elements in them. */
-          return ((len - 1) << shift) + last_size;
+          return ((rrb_index_type)(len - 1) << shift) + last_size;
           }
         else
           {
@@ -1477,7 +1931,7 @@ namespace immutable
     template <typename T, bool atomic_ref_counting, int N>
     inline ref<internal_node<T, atomic_ref_counting>> set_sizes(ref<internal_node<T, atomic_ref_counting>>& node, uint32_t shift)
       {
-      uint32_t sum = 0;
+      rrb_index_type sum = 0;
       ref<rrb_size_table<atomic_ref_counting>> table = size_table_create<atomic_ref_counting>(node->len);
       const uint32_t child_shift = shift - bits<N>::rrb_bits;
 
@@ -1509,28 +1963,53 @@ namespace immutable
 
 
     /**
-     * create_concat_plan takes in the large concatenated internal node and a
-     * pointer to an uint32_t, which will contain the reduced size of the rebalanced
-     * node. It returns a plan as an array of uint32_t's, and modifies the input
-     * pointer to contain the length of said array.
+     * merge_children gathers the children of left (except its last child),
+     * centre and right (except its first child) into all, as raw pointers.
+     * The nodes left, centre and right keep these children alive while we
+     * rebalance, so this temporary array needs no reference counting. all must
+     * have room for 3 * rrb_branching entries. Returns the number of children.
      */
 
     template <typename T, bool atomic_ref_counting, int N>
-    inline std::vector<uint32_t> create_concat_plan(const ref<internal_node<T, atomic_ref_counting>>& all, uint32_t* top_len)
+    inline uint32_t merge_children(const tree_node<T, atomic_ref_counting>** all, const ref<internal_node<T, atomic_ref_counting>>& left, const ref<internal_node<T, atomic_ref_counting>>& centre, const ref<internal_node<T, atomic_ref_counting>>& right)
       {
-      std::vector<uint32_t> node_count(all->len);
+      // If internal node is NULL, its size is zero.
+      const uint32_t left_len = (left.ptr == nullptr) ? 0 : left->len - 1;
+      const uint32_t centre_len = (centre.ptr == nullptr) ? 0 : centre->len;
+      const uint32_t right_len = (right.ptr == nullptr) ? 0 : right->len - 1;
+      assert(left_len + centre_len + right_len <= 3 * bits<N>::rrb_branching);
+
+      uint32_t len = 0;
+      for (uint32_t i = 0; i < left_len; ++i)
+        all[len++] = (const tree_node<T, atomic_ref_counting>*)left->child[i].ptr;
+      for (uint32_t i = 0; i < centre_len; ++i)
+        all[len++] = (const tree_node<T, atomic_ref_counting>*)centre->child[i].ptr;
+      for (uint32_t i = 0; i < right_len; ++i)
+        all[len++] = (const tree_node<T, atomic_ref_counting>*)right->child[i + 1].ptr;
+      return len;
+      }
 
+    /**
+     * create_concat_plan takes in the children of the large concatenated node
+     * and an array node_count with room for all_len entries, which will contain
+     * the plan. It returns the reduced size of the rebalanced node, which is the
+     * length of the plan.
+     */
+
+    template <typename T, bool atomic_ref_counting, int N>
+    inline uint32_t create_concat_plan(const tree_node<T, atomic_ref_counting>* const* all, uint32_t all_len, uint32_t* node_count)
+      {
       uint32_t total_nodes = 0;
-      for (uint32_t i = 0; i < all->len; i++)
+      for (uint32_t i = 0; i < all_len; i++)
         {
-        const uint32_t size = all->child[i]->len;
+        const uint32_t size = all[i]->len;
         node_count[i] = size;
         total_nodes += size;
         }
 
       const uint32_t optimal_slots = ((total_nodes - 1) / bits<N>::rrb_branching) + 1;
 
-      uint32_t shuffled_len = all->len;
+      uint32_t shuffled_len = all_len;
       uint32_t i = 0;
       while (optimal_slots + bits<N>::rrb_extras < shuffled_len)
         {
@@ -1560,16 +2039,29 @@ namespace immutable
           i--;
         }
 
-      *top_len = shuffled_len;
-      return node_count;
+      return shuffled_len;
       }
 
+    // Stores a new reference to node in to_set, which must still be empty.
+    template <typename T, bool atomic_ref_counting>
+    inline void set_child(ref<internal_node<T, atomic_ref_counting>>& to_set, const tree_node<T, atomic_ref_counting>* node)
+      {
+      to_set.ptr = (internal_node<T, atomic_ref_counting>*)node;
+      to_set.inc();
+      }
+
+    /**
+     * execute_concat_plan redistributes the children in all according to the
+     * plan node_size of length slen. The first rrb_branching new children are
+     * stored in new_left, the remaining ones (if any) in new_right. Both nodes
+     * must have been created with the correct length.
+     */
+
     template <typename T, bool atomic_ref_counting, int N>
-    inline ref<internal_node<T, atomic_ref_counting>> execute_concat_plan(const ref<internal_node<T, atomic_ref_counting>>& all, const std::vector<uint32_t>& node_size, uint32_t slen, uint32_t shift)
+    inline void execute_concat_plan(const tree_node<T, atomic_ref_counting>* const* all, const uint32_t* node_size, uint32_t slen, uint32_t shift, internal_node<T, atomic_ref_counting>* new_left, internal_node<T, atomic_ref_counting>* new_right)
       {
       // the all vector doesn't have sizes set yet.
 
-      ref<internal_node<T, atomic_ref_counting>> new_all = internal_node_create<T, atomic_ref_counting>(slen);
       // Current old node index to copy from
       uint32_t idx = 0;
 
@@ -1581,14 +2073,15 @@ namespace immutable
         for (uint32_t i = 0; i < slen; i++)
           {
           const uint32_t new_size = node_size[i];
-          ref<leaf_node<T, atomic_ref_counting>> old = all->child[idx];
+          ref<internal_node<T, atomic_ref_counting>>& to_set = (i < bits<N>::rrb_branching) ? new_left->child[i] : new_right->child[i - bits<N>::rrb_branching];
+          const leaf_node<T, atomic_ref_counting>* old = (const leaf_node<T, atomic_ref_counting>*)all[idx];
 
           if (offset == 0 && new_size == old->len)
             {
             // just pointer copy the node if there is no offset and both have same
             // size
             idx++;
-            new_all->child[i] = old;
+            set_child(to_set, all[idx - 1]);
             }
           else
             {
@@ -1597,11 +2090,11 @@ namespace immutable
             // cur_size is the current size of the new node
             // (the amount of elements copied into it so far)
 
-            while (cur_size < new_size /*&& idx < all->len*/)
+            while (cur_size < new_size /*&& idx < all_len*/)
               {
               // the commented out check is verified by create_concat_plan --
               // otherwise the implementation is erroneous!
-              ref<leaf_node<T, atomic_ref_counting>> old_node = all->child[idx];
+              const leaf_node<T, atomic_ref_counting>* old_node = (const leaf_node<T, atomic_ref_counting>*)all[idx];
 
               if (new_size - cur_size >= old_node->len - offset)
                 {
@@ -1631,7 +2124,7 @@ namespace immutable
                 }
               }
 
-            new_all->child[i] = new_node;
+            to_set = new_node;
             }
           }
         }
@@ -1645,12 +2138,13 @@ namespace immutable
         for (uint32_t i = 0; i < slen; i++)
           {
           const uint32_t new_size = node_size[i];
-          ref<internal_node<T, atomic_ref_counting>> old = all->child[idx];
+          ref<internal_node<T, atomic_ref_counting>>& to_set = (i < bits<N>::rrb_branching) ? new_left->child[i] : new_right->child[i - bits<N>::rrb_branching];
+          const internal_node<T, atomic_ref_counting>* old = (const internal_node<T, atomic_ref_counting>*)all[idx];
 
           if (offset == 0 && new_size == old->len)
             {
             idx++;
-            new_all->child[i] = old;
+            set_child(to_set, all[idx - 1]);
             }
           else
             {
@@ -1658,7 +2152,7 @@ namespace immutable
             uint32_t cur_size = 0;
             while (cur_size < new_size)
               {
-              ref<internal_node<T, atomic_ref_counting>> old_node = all->child[idx];
+              const internal_node<T, atomic_ref_counting>* old_node = (const internal_node<T, atomic_ref_counting>*)all[idx];
 
               if (new_size - cur_size >= old_node->len - offset)
                 {
@@ -1679,25 +2173,28 @@ namespace immutable
                 }
               }
             set_sizes<T, atomic_ref_counting, N>(new_node, shift - bits<N>::rrb_bits); // This is where we set sizes
-            new_all->child[i] = new_node;
+            to_set = new_node;
             }
           }
         }
-      return new_all;
       }
 
     template <typename T, bool atomic_ref_counting, int N>
     inline ref<internal_node<T, atomic_ref_counting>> rebalance(const ref<internal_node<T, atomic_ref_counting>>& left, const ref<internal_node<T, atomic_ref_counting>>& centre, const ref<internal_node<T, atomic_ref_counting>>& right, uint32_t shift, bool is_top)
       {
-      ref<internal_node<T, atomic_ref_counting>> all = internal_node_merge(left, centre, right);
-      // top_len is children count of the internal node returned.
-      uint32_t top_len; // populated through pointer manipulation.
+      // The merged children and the plan live on the stack: left and right
+      // contribute at most rrb_branching - 1 children each, centre at most 2.
+      const tree_node<T, atomic_ref_counting>* all[3 * bits<N>::rrb_branching];
+      uint32_t node_count[3 * bits<N>::rrb_branching];
+      const uint32_t all_len = merge_children<T, atomic_ref_counting, N>(all, left, centre, right);
 
-      std::vector<uint32_t> node_count = create_concat_plan<T, atomic_ref_counting, N>(all, &top_len);
+      // top_len is children count of the internal node returned.
+      const uint32_t top_len = create_concat_plan<T, atomic_ref_counting, N>(all, all_len, node_count);
 
-      ref<internal_node<T, atomic_ref_counting>> new_all = execute_concat_plan<T, atomic_ref_counting, N>(all, node_count, top_len, shift);
       if (top_len <= bits<N>::rrb_branching)
         {
+        ref<internal_node<T, atomic_ref_counting>> new_all = internal_node_create<T, atomic_ref_counting>(top_len);
+        execute_concat_plan<T, atomic_ref_counting, N>(all, node_count, top_len, shift, new_all.ptr, nullptr);
         if (is_top == false)
           {
           return internal_node_new_above1(set_sizes<T, atomic_ref_counting, N>(new_all, shift));
@@ -1709,8 +2206,10 @@ namespace immutable
         }
       else
         {
-        ref<internal_node<T, atomic_ref_counting>> new_left = internal_node_copy(new_all.ptr, 0, bits<N>::rrb_branching);
-        ref<internal_node<T, atomic_ref_counting>> new_right = internal_node_copy(new_all.ptr, bits<N>::rrb_branching, top_len - bits<N>::rrb_branching);
+        // Build both halves directly instead of splitting a temporary node.
+        ref<internal_node<T, atomic_ref_counting>> new_left = internal_node_create<T, atomic_ref_counting>(bits<N>::rrb_branching);
+        ref<internal_node<T, atomic_ref_counting>> new_right = internal_node_create<T, atomic_ref_counting>(top_len - bits<N>::rrb_branching);
+        execute_concat_plan<T, atomic_ref_counting, N>(all, node_count, top_len, shift, new_left.ptr, new_right.ptr);
         return internal_node_new_above<T, atomic_ref_counting>(set_sizes<T, atomic_ref_counting, N>(new_left, shift), set_sizes<T, atomic_ref_counting, N>(new_right, shift));
         }
       }
@@ -1866,36 +2365,33 @@ namespace immutable
   template <typename T, bool atomic_ref_counting = true, int N = 5>
   struct rrb
     {
-    uint32_t cnt;
+    rrb_index_type cnt;
     uint32_t shift;
     uint32_t tail_len;
     ref<rrb_details::leaf_node<T, atomic_ref_counting>> tail;
     ref<rrb_details::tree_node<T, atomic_ref_counting>> root;
     mutable std::atomic<uint32_t> _ref_count;
+    uint32_t flags;
     };
 
   template <typename T, int N>
   struct rrb<T, false, N>
     {
-    uint32_t cnt;
+    rrb_index_type cnt;
     uint32_t shift;
     uint32_t tail_len;
     ref<rrb_details::leaf_node<T, false>> tail;
     ref<rrb_details::tree_node<T, false>> root;
     mutable uint32_t _ref_count;
+    uint32_t flags;
     };
 
+  // Returns an empty tree. The result may be shared, so it must not be
+  // modified in place.
   template <typename T, bool atomic_ref_counting = true, int N = 5>
   inline ref<rrb<T, atomic_ref_counting, N>> rrb_create()
     {
-    rrb<T, atomic_ref_counting, N>* empty = (rrb<T, atomic_ref_counting, N>*)malloc(sizeof(rrb<T, atomic_ref_counting, N>));
-    empty->cnt = 0;
-    empty->shift = 0;
-    empty->root.ptr = nullptr;
-    empty->tail.ptr = nullptr;
-    empty->tail_len = 0;
-    empty->tail = rrb_details::create_empty_leaf<T, atomic_ref_counting>();
-    return ref<rrb<T, atomic_ref_counting, N>>(empty);
+    return rrb_details::rrb_empty<T, N>(std::integral_constant<bool, atomic_ref_counting>());
     }
 
   template <typename T, bool atomic_ref_counting, int N>
@@ -1923,6 +2419,13 @@ namespace immutable
       {
       return rrb_create<T, atomic_ref_counting, N>();
       }
+    if (in->root.ptr == nullptr)
+      {
+      ref<rrb<T, atomic_ref_counting, N>> small_rrb = rrb_small_create<T, atomic_ref_counting, N>(in->tail_len - 1);
+      for (uint32_t i = 0; i < in->tail_len - 1; ++i)
+        small_rrb->tail->child[i] = in->tail->child[i]; // don't memcpy, but use copy constructor
+      return small_rrb;
+      }
     ref<rrb<T, atomic_ref_counting, N>> new_rrb = rrb_head_clone(in.ptr);
     new_rrb->cnt--;
 
@@ -1941,12 +2444,20 @@ namespace immutable
     }
 
   template <typename T, bool atomic_ref_counting, int N>
-  inline ref<rrb<T, atomic_ref_counting, N>> rrb_update(const ref<rrb<T, atomic_ref_counting, N>>& in, uint32_t index, T element)
+  inline ref<rrb<T, atomic_ref_counting, N>> rrb_update(const ref<rrb<T, atomic_ref_counting, N>>& in, rrb_index_type index, T element)
     {
     using namespace rrb_details;
     assert(index < in->cnt);
+    if (in->root.ptr == nullptr)
+      {
+      ref<rrb<T, atomic_ref_counting, N>> small_rrb = rrb_small_create<T, atomic_ref_counting, N>(in->tail_len);
+      for (uint32_t i = 0; i < in->tail_len; ++i)
+        small_rrb->tail->child[i] = in->tail->child[i]; // don't memcpy, but use copy constructor
+      small_rrb->tail->child[index] = std::move(element);
+      return small_rrb;
+      }
     ref<rrb<T, atomic_ref_counting, N>> new_rrb = rrb_head_clone(in.ptr);
-    const uint32_t tail_offset = in->cnt - in->tail_len;
+    const rrb_index_type tail_offset = in->cnt - in->tail_len;
     if (tail_offset <= index)
       {
       ref<leaf_node<T, atomic_ref_counting>> new_tail = leaf_node_clone(in->tail.ptr);
@@ -1964,7 +2475,7 @@ namespace immutable
       uint32_t child_index;
       if (current->size_table.ptr == nullptr)
         {
-        child_index = (index >> shift) & bits<N>::rrb_mask;
+        child_index = (uint32_t)(index >> shift) & bits<N>::rrb_mask;
         }
       else
         {
@@ -1981,11 +2492,19 @@ namespace immutable
     }
 
   template <typename T, bool atomic_ref_counting, int N>
-  inline const T& rrb_nth(const ref<rrb<T, atomic_ref_counting, N>>& rrb, uint32_t index)
+  inline const T& rrb_nth(const ref<rrb<T, atomic_ref_counting, N>>& rrb, rrb_index_type index)
+    {
+    return rrb_nth(rrb.ptr, index);
+    }
+
+  // The raw pointer overloads of rrb_nth and rrb_region_for do not touch any
+  // reference count. The caller keeps the head alive, e.g. with an epoch_guard.
+  template <typename T, bool atomic_ref_counting, int N>
+  inline const T& rrb_nth(const rrb<T, atomic_ref_counting, N>* rrb, rrb_index_type index)
     {
     using namespace rrb_details;
     assert(index < rrb->cnt);
-    const uint32_t tail_offset = rrb->cnt - rrb->tail_len;
+    const rrb_index_type tail_offset = rrb->cnt - rrb->tail_len;
     if (tail_offset <= index)
       {
       return rrb->tail->child[index - tail_offset];
@@ -1997,7 +2516,7 @@ namespace immutable
         {
         if (current->size_table.ptr == nullptr)
           {
-          const uint32_t subidx = (index >> shift) & bits<N>::rrb_mask;
+          const uint32_t subidx = (uint32_t)(index >> shift) & bits<N>::rrb_mask;
           current = current->child[subidx].ptr;
           }
         else
@@ -2010,38 +2529,53 @@ namespace immutable
     }
 
   template <typename T, bool atomic_ref_counting, int N>
-  inline std::tuple<const T*, uint32_t, uint32_t> rrb_region_for(const ref<rrb<T, atomic_ref_counting, N>>& rrb, uint32_t index)
+  inline std::tuple<const T*, rrb_index_type, rrb_index_type> rrb_region_for(const ref<rrb<T, atomic_ref_counting, N>>& rrb, rrb_index_type index)
+    {
+    return rrb_region_for(rrb.ptr, index);
+    }
+
+  template <typename T, bool atomic_ref_counting, int N>
+  inline std::tuple<const T*, rrb_index_type, rrb_index_type> rrb_region_for(const rrb<T, atomic_ref_counting, N>* rrb, rrb_index_type index)
     {
     using namespace rrb_details;
     assert(index < rrb->cnt);
-    const uint32_t tail_offset = rrb->cnt - rrb->tail_len;
+    const rrb_index_type tail_offset = rrb->cnt - rrb->tail_len;
     if (tail_offset <= index)
       {
       return std::make_tuple(rrb->tail->child, tail_offset, rrb->cnt);
       }
     else
       {
-      const uint32_t original_index = index;
+      const rrb_index_type original_index = index;
       const internal_node<T, atomic_ref_counting>* current = (const internal_node<T, atomic_ref_counting>*)rrb->root.ptr;
+#ifdef RRB_PREFETCH
+      // the next sibling of the deepest node on the path that has one, which
+      // holds the elements that an iterator reads after this region
+      const void* next = nullptr;
+#endif
       for (uint32_t shift = rrb->shift; shift > 0; shift -= bits<N>::rrb_bits)
         {
-        if (current->size_table.ptr == nullptr)
-          {
-          const uint32_t subidx = (index >> shift) & bits<N>::rrb_mask;
-          current = current->child[subidx].ptr;
-          }
-        else
-          {
-          current = sized(current, &index, shift);
-          }
+        const uint32_t subidx = current->size_table.ptr == nullptr ? (uint32_t)(index >> shift) & bits<N>::rrb_mask : sized_pos(current, &index, shift);
+#ifdef RRB_PREFETCH
+        if (subidx + 1 < current->len)
+          next = current->child[subidx + 1].ptr;
+#endif
+        current = current->child[subidx].ptr;
+        }
+#ifdef RRB_PREFETCH
+      if (next != nullptr)
+        {
+        prefetch(next);
+        prefetch((const char*)next + 64);
         }
-      const uint32_t index_of_first_element = original_index - (index & bits<N>::rrb_mask);
+#endif
+      const rrb_index_type index_of_first_element = original_index - (index & bits<N>::rrb_mask);
       return std::make_tuple(((const leaf_node<T, atomic_ref_counting>*)current)->child, index_of_first_element, index_of_first_element + ((const leaf_node<T, atomic_ref_counting>*)current)->len);
       }
     }
 
   template <typename T, bool atomic_ref_counting, int N>
-  inline uint32_t rrb_count(const ref<rrb<T, atomic_ref_counting, N>>& rrb)
+  inline rrb_index_type rrb_count(const ref<rrb<T, atomic_ref_counting, N>>& rrb)
     {
     return rrb->cnt;
     }
@@ -2125,7 +2659,7 @@ namespace immutable
       ref<leaf_node<T, atomic_ref_counting>> empty_leaf(nullptr);
       ref<rrb<T, atomic_ref_counting, N>> left_head = rrb_head_clone<T, atomic_ref_counting, N>(left.ptr);
       ref<rrb<T, atomic_ref_counting, N>> left2 = push_down_tail(left, left_head, empty_leaf);
-      ref<rrb<T, atomic_ref_counting, N>> new_rrb = rrb_create<T, atomic_ref_counting, N>();
+      ref<rrb<T, atomic_ref_counting, N>> new_rrb = rrb_head_create<T, atomic_ref_counting, N>();
       new_rrb->cnt = left2->cnt + right->cnt;
 
       ref<internal_node<T, atomic_ref_counting>> root_candidate = concat_sub_tree<T, atomic_ref_counting, N>(left2->root, left2->shift, right->root, right->shift, true);
@@ -2141,10 +2675,66 @@ namespace immutable
     }
 
   template <typename T, bool atomic_ref_counting, int N>
-  inline ref<rrb<T, atomic_ref_counting, N>> rrb_slice(const ref<rrb<T, atomic_ref_counting, N>>& rrb, uint32_t from, uint32_t to)
+  inline ref<rrb<T, atomic_ref_counting, N>> rrb_slice(const ref<rrb<T, atomic_ref_counting, N>>& rrb, rrb_index_type from, rrb_index_type to)
     {
     using namespace rrb_details;
     return rrb_drop_left(rrb_drop_right(rrb, to), from);
     }
 
+    /**
+   * While an object of this class lives, the current thread defers the
+   * reference count decrements of atomically counted vectors and nodes, and
+   * coalesces them with later increments of the same nodes. Repeatedly copying
+   * and dropping references to shared nodes (iterators, path copies in
+   * set/push_back, ...) then no longer bounces their cache lines between
+   * cores. Pending decrements are applied when the outermost scope ends, when
+   * flush() is called, or when the thread-local table fills up, so memory may
+   * be reclaimed a bit later than without a scope.
+   *
+   * Scopes can be nested, and must be destroyed on the thread that created
+   * them. Non-atomic reference counting is not affected. While no thread has
+   * a scope, atomic addref and release only pay for one relaxed load of a
+   * global counter.
+   */
+  class deferred_ref_counting_scope
+    {
+    public:
+      deferred_ref_counting_scope() : _owner(false)
+        {
+        rrb_details::deferred_releases*& releases = rrb_details::current_deferred_releases();
+        if (releases == nullptr)
+          {
+          memset(&_releases, 0, sizeof(_releases));
+          releases = &_releases;
+          _owner = true;
+          rrb_details::deferred_scopes().fetch_add(1, std::memory_order_relaxed);
+          }
+        }
+
+      deferred_ref_counting_scope(const deferred_ref_counting_scope&) = delete;
+      deferred_ref_counting_scope& operator = (const deferred_ref_counting_scope&) = delete;
+
+      ~deferred_ref_counting_scope()
+        {
+        if (_owner)
+          {
+          rrb_details::flush_deferred_releases(&_releases);
+          rrb_details::current_deferred_releases() = nullptr;
+          rrb_details::deferred_scopes().fetch_sub(1, std::memory_order_relaxed);
+          }
+        }
+
+      // Applies all pending decrements of the current thread.
+      void flush()
+        {
+        rrb_details::deferred_releases* releases = rrb_details::current_deferred_releases();
+        if (releases != nullptr)
+          rrb_details::flush_deferred_releases(releases);
+        }
+
+    private:
+      rrb_details::deferred_releases _releases;
+      bool _owner;
+    };
+
   }
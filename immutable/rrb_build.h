@@ -0,0 +1,177 @@
+
+/*
+ * Bottom-up construction of rrb-trees from random access ranges.
+ *
+ * rrb_build fills the leaves directly from the input and then groups them
+ * level by level into full internal nodes. The result is the dense tree
+ * without size tables that pushing the elements one by one would produce,
+ * but without the path copying of push.
+ *
+ * rrb_build_parallel splits the leaves into chunks that each form whole
+ * subtrees of the same height, builds the chunks on separate threads, and
+ * stitches the few levels above the chunks together at the end. Because the
+ * chunks are aligned to subtree boundaries, the result has exactly the same
+ * shape as the one of rrb_build.
+ */
+
+#pragma once
+
+#include "rrb.h"
+
+#include <iterator>
+#include <thread>
+#include <vector>
+
+namespace immutable
+  {
+
+  template <typename T, bool atomic_ref_counting, int N, typename Iterator>
+  ref<rrb<T, atomic_ref_counting, N>> rrb_build(Iterator first, rrb_index_type count);
+
+  template <typename T, bool atomic_ref_counting, int N, typename Iterator>
+  ref<rrb<T, atomic_ref_counting, N>> rrb_build_parallel(Iterator first, rrb_index_type count, uint32_t threads);
+
+  namespace rrb_details
+    {
+
+    template <typename T, bool atomic_ref_counting>
+    using build_level = std::vector<ref<internal_node<T, atomic_ref_counting>>>;
+
+    // Fills the full leaves [first_leaf, last_leaf) from the input.
+    template <typename T, bool atomic_ref_counting, int N, typename Iterator>
+    inline void build_leaves(Iterator first, rrb_index_type first_leaf, rrb_index_type last_leaf, build_level<T, atomic_ref_counting>& out)
+      {
+      out.reserve(out.size() + (last_leaf - first_leaf));
+      Iterator it = first + (typename std::iterator_traits<Iterator>::difference_type)first_leaf * bits<N>::rrb_branching;
+      for (rrb_index_type i = first_leaf; i < last_leaf; ++i)
+        {
+        leaf_node<T, atomic_ref_counting>* leaf = leaf_node_create<T, atomic_ref_counting>(bits<N>::rrb_branching);
+        for (uint32_t j = 0; j < (uint32_t)bits<N>::rrb_branching; ++j, ++it)
+          leaf->child[j] = *it;
+        out.emplace_back((internal_node<T, atomic_ref_counting>*)leaf);
+        }
+      }
+
+    // Replaces the nodes of a level by their parents, taking over their
+    // references. All parents but the last one are full.
+    template <typename T, bool atomic_ref_counting, int N>
+    inline void build_parents(build_level<T, atomic_ref_counting>& level)
+      {
+      const size_t count = level.size();
+      size_t parents = 0;
+      for (size_t i = 0; i < count; i += bits<N>::rrb_branching)
+        {
+        const uint32_t len = (uint32_t)std::min<size_t>(bits<N>::rrb_branching, count - i);
+        internal_node<T, atomic_ref_counting>* parent = internal_node_create<T, atomic_ref_counting>(len);
+        for (uint32_t j = 0; j < len; ++j)
+          {
+          parent->child[j].ptr = level[i + j].ptr;
+          level[i + j].ptr = nullptr;
+          }
+        level[parents++] = ref<internal_node<T, atomic_ref_counting>>(parent);
+        }
+      level.resize(parents);
+      }
+
+    // Builds a head for count > branching elements with the given full leaves
+    // or subtrees of height `height`.
+    template <typename T, bool atomic_ref_counting, int N, typename Iterator>
+    inline ref<rrb<T, atomic_ref_counting, N>> build_head(Iterator first, rrb_index_type count, build_level<T, atomic_ref_counting>& level, uint32_t height)
+      {
+      const uint32_t tail_len = (uint32_t)(count - ((count - 1) >> bits<N>::rrb_bits << bits<N>::rrb_bits));
+      while (level.size() > 1)
+        {
+        build_parents<T, atomic_ref_counting, N>(level);
+        ++height;
+        }
+      rrb<T, atomic_ref_counting, N>* head = rrb_head_create<T, atomic_ref_counting, N>();
+      head->cnt = count;
+      head->shift = height * bits<N>::rrb_bits;
+      head->root.ptr = (tree_node<T, atomic_ref_counting>*)level[0].ptr;
+      level[0].ptr = nullptr;
+      leaf_node<T, atomic_ref_counting>* tail = leaf_node_create<T, atomic_ref_counting>(tail_len);
+      Iterator it = first + (typename std::iterator_traits<Iterator>::difference_type)(count - tail_len);
+      for (uint32_t i = 0; i < tail_len; ++i, ++it)
+        tail->child[i] = *it;
+      head->tail = tail;
+      head->tail_len = tail_len;
+      return head;
+      }
+
+    template <typename T, bool atomic_ref_counting, int N, typename Iterator>
+    inline ref<rrb<T, atomic_ref_counting, N>> build_small(Iterator first, uint32_t count)
+      {
+      rrb<T, atomic_ref_counting, N>* head = rrb_small_create<T, atomic_ref_counting, N>(count);
+      for (uint32_t i = 0; i < count; ++i, ++first)
+        head->tail->child[i] = *first;
+      return head;
+      }
+
+    } // namespace rrb_details
+
+  // Builds a dense tree from the elements [first, first + count).
+  template <typename T, bool atomic_ref_counting, int N, typename Iterator>
+  inline ref<rrb<T, atomic_ref_counting, N>> rrb_build(Iterator first, rrb_index_type count)
+    {
+    using namespace rrb_details;
+    if (count == 0)
+      return rrb_create<T, atomic_ref_counting, N>();
+    if (count <= (uint32_t)bits<N>::rrb_branching)
+      return build_small<T, atomic_ref_counting, N>(first, (uint32_t)count);
+    const rrb_index_type leaves = (count - 1) >> bits<N>::rrb_bits;
+    build_level<T, atomic_ref_counting> level;
+    build_leaves<T, atomic_ref_counting, N>(first, 0, leaves, level);
+    return build_head<T, atomic_ref_counting, N>(first, count, level, 0);
+    }
+
+  // As rrb_build, but builds the lower levels of the tree on up to `threads`
+  // threads (0 uses one thread per core). The result has the same shape as the
+  // one of rrb_build.
+  template <typename T, bool atomic_ref_counting, int N, typename Iterator>
+  inline ref<rrb<T, atomic_ref_counting, N>> rrb_build_parallel(Iterator first, rrb_index_type count, uint32_t threads)
+    {
+    using namespace rrb_details;
+    threads = thread_count(threads);
+    // Chunks are subtrees of chunk_height levels above the leaves, and there
+    // should be a few of them per thread to balance the load.
+    const rrb_index_type leaves = count == 0 ? 0 : (count - 1) >> bits<N>::rrb_bits;
+    uint32_t chunk_height = 0;
+    while (chunk_height + 1 < bits<N>::rrb_max_height && ((uint64_t)leaves >> ((chunk_height + 1) * bits<N>::rrb_bits)) >= 4 * (uint64_t)threads)
+      ++chunk_height;
+    const rrb_index_type chunk_leaves = (rrb_index_type)1 << (chunk_height * bits<N>::rrb_bits);
+    const uint32_t chunks = (uint32_t)((leaves + chunk_leaves - 1) / chunk_leaves);
+    if (threads < 2 || chunk_height == 0 || chunks < 2)
+      return rrb_build<T, atomic_ref_counting, N>(first, count);
+
+    std::vector<build_level<T, atomic_ref_counting>> chunk_roots(chunks);
+    auto build_chunks = [&](uint32_t first_chunk, uint32_t last_chunk)
+      {
+      for (uint32_t c = first_chunk; c < last_chunk; ++c)
+        {
+        build_level<T, atomic_ref_counting>& level = chunk_roots[c];
+        build_leaves<T, atomic_ref_counting, N>(first, c * chunk_leaves, std::min(leaves, (c + 1) * chunk_leaves), level);
+        for (uint32_t h = 0; h < chunk_height; ++h)
+          build_parents<T, atomic_ref_counting, N>(level);
+        }
+      };
+    const uint32_t workers = std::min(threads, chunks);
+    std::vector<std::thread> pool;
+    pool.reserve(workers - 1);
+    for (uint32_t w = 1; w < workers; ++w)
+      pool.emplace_back(build_chunks, (uint32_t)((uint64_t)chunks * w / workers), (uint32_t)((uint64_t)chunks * (w + 1) / workers));
+    build_chunks(0, (uint32_t)((uint64_t)chunks / workers));
+    for (auto& t : pool)
+      t.join();
+
+    build_level<T, atomic_ref_counting> level;
+    level.reserve(chunks);
+    for (auto& roots : chunk_roots)
+      {
+      level.emplace_back();
+      level.back().ptr = roots[0].ptr;
+      roots[0].ptr = nullptr;
+      }
+    return build_head<T, atomic_ref_counting, N>(first, count, level, chunk_height);
+    }
+
+  }
@@ -0,0 +1,268 @@
+
+/*
+ * Element codecs for compressed_vector.
+ *
+ * compress_elements encodes an array of trivially copyable elements into
+ * bytes, and decompress_elements decodes them again. The first byte names
+ * the codec:
+ *
+ * - delta: for integral elements wider than a byte. The differences between
+ *   neighbours are zigzag encoded and bit packed, with one bit width per
+ *   frame of 128 elements, so sorted or slowly changing values take a few
+ *   bits each.
+ * - lz: for other elements, such as text. A greedy LZ77 over the bytes,
+ *   whose tokens are a literal run followed by a back reference.
+ * - raw: a copy of the bytes, used when the codecs above do not gain.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <type_traits>
+#include <vector>
+
+namespace immutable
+  {
+
+  namespace rrb_details
+    {
+
+    enum : uint8_t { codec_raw = 0, codec_delta = 1, codec_lz = 2 };
+
+    enum : uint32_t { delta_frame = 128 };
+
+    inline void put_varint(std::vector<uint8_t>& out, uint64_t v)
+      {
+      for (; v >= 0x80; v >>= 7)
+        out.push_back((uint8_t)(v | 0x80));
+      out.push_back((uint8_t)v);
+      }
+
+    inline uint64_t get_varint(const uint8_t*& p)
+      {
+      uint64_t v = 0;
+      for (uint32_t shift = 0;; shift += 7)
+        {
+        const uint8_t b = *p++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0)
+          return v;
+        }
+      }
+
+    // Appends bit packed values to a byte array, least significant bit first.
+    struct bit_writer
+      {
+      std::vector<uint8_t>& out;
+      uint32_t used; // bits used in the last byte, 8 if it is full
+
+      void put(uint64_t v, uint32_t width)
+        {
+        for (uint32_t done = 0; done < width;)
+          {
+          if (used == 8)
+            {
+            out.push_back(0);
+            used = 0;
+            }
+          const uint32_t take = std::min<uint32_t>(8 - used, width - done);
+          out.back() |= (uint8_t)(((v >> done) & ((1u << take) - 1)) << used);
+          used += take;
+          done += take;
+          }
+        }
+      };
+
+    struct bit_reader
+      {
+      const uint8_t* p;
+      uint32_t used;
+
+      uint64_t get(uint32_t width)
+        {
+        uint64_t v = 0;
+        for (uint32_t done = 0; done < width;)
+          {
+          if (used == 8)
+            {
+            ++p;
+            used = 0;
+            }
+          const uint32_t take = std::min<uint32_t>(8 - used, width - done);
+          v |= (uint64_t)((*p >> used) & ((1u << take) - 1)) << done;
+          used += take;
+          done += take;
+          }
+        return v;
+        }
+      };
+
+    template <typename T>
+    struct delta_codable
+      {
+      enum { value = std::is_integral<T>::value && !std::is_same<T, bool>::value && sizeof(T) > 1 };
+      };
+
+    template <typename T>
+    inline void delta_encode(const T* p, size_t n, std::vector<uint8_t>& out)
+      {
+      const uint32_t bits = sizeof(T) * 8;
+      const uint64_t mask = bits == 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+      out.push_back(codec_delta);
+      uint64_t prev = 0;
+      std::vector<uint64_t> zigzag(delta_frame);
+      for (size_t first = 0; first < n; first += delta_frame)
+        {
+        const size_t len = std::min<size_t>(delta_frame, n - first);
+        uint64_t all = 0;
+        for (size_t i = 0; i < len; ++i)
+          {
+          const uint64_t v = (uint64_t)p[first + i] & mask;
+          const uint64_t d = (v - prev) & mask;
+          const uint64_t sign = (d >> (bits - 1)) & 1;
+          zigzag[i] = ((d << 1) ^ (0 - sign)) & mask;
+          all |= zigzag[i];
+          prev = v;
+          }
+        uint32_t width = 0;
+        while (width < 64 && (all >> width) != 0)
+          ++width;
+        out.push_back((uint8_t)width);
+        bit_writer writer = { out, 8 };
+        for (size_t i = 0; i < len; ++i)
+          writer.put(zigzag[i], width);
+        }
+      }
+
+    template <typename T>
+    inline void delta_decode(const uint8_t* p, T* out, size_t n)
+      {
+      const uint32_t bits = sizeof(T) * 8;
+      const uint64_t mask = bits == 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+      uint64_t prev = 0;
+      for (size_t first = 0; first < n; first += delta_frame)
+        {
+        const size_t len = std::min<size_t>(delta_frame, n - first);
+        const uint32_t width = *p++;
+        bit_reader reader = { p - 1, 8 };
+        for (size_t i = 0; i < len; ++i)
+          {
+          const uint64_t z = reader.get(width);
+          prev = (prev + ((z >> 1) ^ (0 - (z & 1)))) & mask;
+          out[first + i] = (T)prev;
+          }
+        p = reader.p + 1;
+        }
+      }
+
+    inline uint32_t read32(const uint8_t* p)
+      {
+      uint32_t v;
+      memcpy(&v, p, sizeof(v));
+      return v;
+      }
+
+    inline void lz_encode(const uint8_t* src, size_t n, std::vector<uint8_t>& out)
+      {
+      out.push_back(codec_lz);
+      std::vector<int64_t> table((size_t)1 << 12, -1);
+      size_t i = 0, anchor = 0;
+      while (i + 4 <= n)
+        {
+        const uint32_t h = (read32(src + i) * 2654435761u) >> 20;
+        const int64_t candidate = table[h];
+        table[h] = (int64_t)i;
+        if (candidate < 0 || read32(src + candidate) != read32(src + i))
+          {
+          ++i;
+          continue;
+          }
+        size_t len = 4;
+        while (i + len < n && src[candidate + len] == src[i + len])
+          ++len;
+        put_varint(out, i - anchor);
+        out.insert(out.end(), src + anchor, src + i);
+        put_varint(out, len);
+        put_varint(out, i - (size_t)candidate);
+        i += len;
+        anchor = i;
+        }
+      put_varint(out, n - anchor);
+      out.insert(out.end(), src + anchor, src + n);
+      }
+
+    inline void lz_decode(const uint8_t* p, uint8_t* dst, size_t n)
+      {
+      size_t o = 0;
+      for (;;)
+        {
+        const size_t literals = (size_t)get_varint(p);
+        memcpy(dst + o, p, literals);
+        p += literals;
+        o += literals;
+        if (o == n)
+          return;
+        const size_t len = (size_t)get_varint(p);
+        const size_t offset = (size_t)get_varint(p);
+        // the reference may overlap the bytes that it produces
+        for (size_t k = 0; k < len; ++k)
+          dst[o + k] = dst[o + k - offset];
+        o += len;
+        }
+      }
+
+    template <typename T>
+    inline void encode_elements(const T* p, size_t n, std::vector<uint8_t>& out, std::true_type)
+      {
+      delta_encode(p, n, out);
+      }
+
+    template <typename T>
+    inline void encode_elements(const T* p, size_t n, std::vector<uint8_t>& out, std::false_type)
+      {
+      lz_encode((const uint8_t*)p, n * sizeof(T), out);
+      }
+
+    template <typename T>
+    inline void decode_elements(const uint8_t* p, T* out, size_t n, std::true_type)
+      {
+      delta_decode(p, out, n);
+      }
+
+    template <typename T>
+    inline void decode_elements(const uint8_t* p, T* out, size_t n, std::false_type)
+      {
+      lz_decode(p, (uint8_t*)out, n * sizeof(T));
+      }
+
+    // The n elements at p, compressed.
+    template <typename T>
+    inline std::vector<uint8_t> compress_elements(const T* p, size_t n)
+      {
+      std::vector<uint8_t> out;
+      encode_elements(p, n, out, std::integral_constant<bool, delta_codable<T>::value>());
+      if (out.size() > n * sizeof(T))
+        {
+        out.assign(1, codec_raw);
+        out.insert(out.end(), (const uint8_t*)p, (const uint8_t*)(p + n));
+        }
+      out.shrink_to_fit();
+      return out;
+      }
+
+    // Decompresses bytes made by compress_elements into the n elements at out.
+    template <typename T>
+    inline void decompress_elements(const std::vector<uint8_t>& bytes, T* out, size_t n)
+      {
+      const uint8_t* p = bytes.data();
+      if (*p == codec_raw)
+        memcpy((void*)out, p + 1, n * sizeof(T));
+      else
+        decode_elements(p + 1, out, n, std::integral_constant<bool, delta_codable<T>::value>());
+      }
+
+    } // namespace rrb_details
+
+  }
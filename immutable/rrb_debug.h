@@ -41,7 +41,7 @@ namespace immutable
     {
 
     template <typename T, bool atomic_ref_counting, int N>
-    bool validate_subtree(const ref<tree_node<T, atomic_ref_counting>>& root, uint32_t expected_size, uint32_t root_shift)
+    bool validate_subtree(const ref<tree_node<T, atomic_ref_counting>>& root, rrb_index_type expected_size, uint32_t root_shift)
       {
       if (root_shift == 0)
         { // leaf node
@@ -54,8 +54,8 @@ namespace immutable
         ref<leaf_node<T, atomic_ref_counting>> leaf = root;
         if (leaf->len != expected_size)
           {
-          printf("Leaf node claims to be %u elements long, but was expected to be %u\n elements long. Will attempt to read %u elements.\n",
-            leaf->len, expected_size, std::max<uint32_t>(leaf->len, expected_size));
+          printf("Leaf node claims to be %u elements long, but was expected to be %llu\n elements long. Will attempt to read %llu elements.\n",
+            leaf->len, (unsigned long long)expected_size, (unsigned long long)std::max<rrb_index_type>(leaf->len, expected_size));
           return false;
           }
         }
@@ -74,13 +74,13 @@ namespace immutable
           // slot
           if (internal->size_table->size[internal->len - 1] != expected_size)
             {
-            printf("Expected subtree to be of size %u, but its size table says it is %u.\n", expected_size,
-              internal->size_table->size[internal->len - 1]);
+            printf("Expected subtree to be of size %llu, but its size table says it is %llu.\n", (unsigned long long)expected_size,
+              (unsigned long long)internal->size_table->size[internal->len - 1]);
             return false;
             }
           for (uint32_t i = 0; i < internal->len; i++)
             {
-            uint32_t size_sub_trie = internal->size_table->size[i] - (i == 0 ? 0 : internal->size_table->size[i - 1]);
+            rrb_index_type size_sub_trie = internal->size_table->size[i] - (i == 0 ? 0 : internal->size_table->size[i - 1]);
             ref<tree_node<T, atomic_ref_counting>> child = internal->child[i];
             if (!validate_subtree<T, atomic_ref_counting, N>(child, size_sub_trie, root_shift - bits<N>::rrb_bits))
               return false;
@@ -93,18 +93,18 @@ namespace immutable
           // more. Effectively, the tree contains (len - 1) << shift + last_tree_len
           // (1 << shift) >= last_tree_len > 0
           const uint32_t child_shift = root_shift - bits<N>::rrb_bits;
-          const uint32_t child_max_size = 1 << root_shift;
+          const rrb_index_type child_max_size = (rrb_index_type)1 << root_shift;
 
           if (expected_size > internal->len * child_max_size)
             {
-            printf("Expected size (%u) is larger than what can possibly be inside this subtree: %u.\n", expected_size,
-              internal->len * child_max_size);
+            printf("Expected size (%llu) is larger than what can possibly be inside this subtree: %llu.\n", (unsigned long long)expected_size,
+              (unsigned long long)(internal->len * child_max_size));
             return false;
             }
           else if (expected_size < ((internal->len - 1) * child_max_size))
             {
-            printf("Expected size (%u) is smaller than %u, implying that some non-rightmost node\n is not completely populated.\n",
-              expected_size, ((internal->len - 1) << root_shift));
+            printf("Expected size (%llu) is smaller than %llu, implying that some non-rightmost node\n is not completely populated.\n",
+              (unsigned long long)expected_size, (unsigned long long)((internal->len - 1) * child_max_size));
             return false;
             }
           for (uint32_t i = 0; i < internal->len - 1; i++)
@@ -144,7 +144,7 @@ namespace immutable
       {
       if (rrb->cnt - rrb->tail_len != 0)
         {
-        printf("Root is null, but the size of the vector (excluding its tail) is %u.\n", rrb->cnt - rrb->tail_len);
+        printf("Root is null, but the size of the vector (excluding its tail) is %llu.\n", (unsigned long long)(rrb->cnt - rrb->tail_len));
         return false;
         }
       }
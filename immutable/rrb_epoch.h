@@ -0,0 +1,291 @@
+
+/*
+ * Epoch-based reclamation for borrowed rrb-trees.
+ *
+ * Holding a vector keeps its nodes alive through reference counts. That costs
+ * atomic increments and decrements on every copy, which readers of a shared
+ * atomic_vector pay in their hot loops. An epoch_guard is an alternative: while
+ * a thread holds a guard, it may borrow the current version of an
+ * atomic_vector and read it without touching any reference count.
+ *
+ * This works because writers do not drop the references of a replaced version
+ * right away. They retire them instead. Every retired item is stamped with the
+ * global epoch, which is advanced on every retirement, and every thread that
+ * enters a guard announces the epoch that it saw. A retired item is reclaimed
+ * once no guard is active that was entered at or before its stamp, so no
+ * reader can still be borrowing it.
+ *
+ * Retired items are reclaimed by the retiring thread right away if no guard
+ * blocks them, when its list grows, when epoch_reclaim() is called, or when
+ * the thread exits. A guard that was the oldest one blocking retired items
+ * reclaims them when it ends, also those of other threads, so the versions
+ * that a writer replaced are not kept alive after it goes idle. Items that are
+ * still blocked by a reader when a thread exits are handed over to the next
+ * thread that reclaims.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace immutable
+  {
+
+  class epoch_guard;
+
+  void epoch_reclaim();
+
+  namespace rrb_details
+    {
+
+    struct epoch_retired
+      {
+      void (*reclaim)(void*, uint64_t);
+      void* ptr;
+      uint64_t arg;
+      uint64_t epoch;
+      };
+
+    struct epoch_record
+      {
+      // The epoch in which the outermost guard of the owning thread was
+      // entered, or 0 if the thread holds no guard.
+      std::atomic<uint64_t> active;
+      std::atomic<bool> in_use;
+      uint32_t depth;
+      // Guards of other threads may reclaim from retired when they end.
+      std::mutex retired_mutex;
+      std::vector<epoch_retired> retired;
+      epoch_record* next;
+      };
+
+    struct epoch_domain
+      {
+      enum { reclaim_threshold = 64 };
+
+      std::atomic<uint64_t> epoch;
+      // The newest stamp of an item that was blocked by a guard when it was
+      // retired. Guards that were entered later never block anything.
+      std::atomic<uint64_t> blocked;
+      // Records are only ever added, and reused once their thread exited.
+      std::atomic<epoch_record*> records;
+      std::mutex orphans_mutex;
+      std::vector<epoch_retired> orphans;
+
+      epoch_domain() : epoch(1), blocked(0), records(nullptr) {}
+
+      epoch_domain(const epoch_domain&) = delete;
+      epoch_domain& operator = (const epoch_domain&) = delete;
+
+      // All threads have exited, so nothing can be borrowed anymore.
+      ~epoch_domain()
+        {
+        for (const epoch_retired& r : orphans)
+          r.reclaim(r.ptr, r.arg);
+        epoch_record* record = records.load();
+        while (record)
+          {
+          for (const epoch_retired& r : record->retired)
+            r.reclaim(r.ptr, r.arg);
+          epoch_record* next = record->next;
+          delete record;
+          record = next;
+          }
+        }
+      };
+
+    inline epoch_domain& global_epoch_domain()
+      {
+      static epoch_domain domain;
+      return domain;
+      }
+
+    // The smallest epoch in which a guard that is still active was entered.
+    inline uint64_t oldest_active_epoch(epoch_domain& domain)
+      {
+      uint64_t oldest = (uint64_t)-1;
+      for (epoch_record* record = domain.records.load(); record; record = record->next)
+        {
+        const uint64_t active = record->active.load();
+        if (active != 0 && active < oldest)
+          oldest = active;
+        }
+      return oldest;
+      }
+
+    // Moves the items of list whose stamp is older than every active guard to
+    // ready.
+    inline void take_reclaimable(std::vector<epoch_retired>& list, uint64_t oldest, std::vector<epoch_retired>& ready)
+      {
+      size_t kept = 0;
+      for (size_t i = 0; i < list.size(); ++i)
+        {
+        if (list[i].epoch < oldest)
+          ready.push_back(list[i]);
+        else
+          list[kept++] = list[i];
+        }
+      list.resize(kept);
+      }
+
+    // Reclaiming may retire new items, so no list may be locked here.
+    inline void reclaim_ready(const std::vector<epoch_retired>& ready)
+      {
+      for (const epoch_retired& r : ready)
+        r.reclaim(r.ptr, r.arg);
+      }
+
+    inline void take_orphans(epoch_domain& domain, uint64_t oldest, std::vector<epoch_retired>& ready)
+      {
+      std::unique_lock<std::mutex> lock(domain.orphans_mutex, std::try_to_lock);
+      if (lock.owns_lock())
+        take_reclaimable(domain.orphans, oldest, ready);
+      }
+
+    inline void reclaim_epoch_record(epoch_domain& domain, epoch_record* record)
+      {
+      const uint64_t oldest = oldest_active_epoch(domain);
+      std::vector<epoch_retired> ready;
+        {
+        std::lock_guard<std::mutex> lock(record->retired_mutex);
+        take_reclaimable(record->retired, oldest, ready);
+        }
+      take_orphans(domain, oldest, ready);
+      reclaim_ready(ready);
+      }
+
+    // Called when a guard that was entered in epoch entered has ended. If it
+    // was the oldest guard that blocked retired items, reclaims them for all
+    // threads.
+    inline void epoch_guard_ended(epoch_domain& domain, uint64_t entered)
+      {
+      if (entered > domain.blocked.load())
+        return;
+      const uint64_t oldest = oldest_active_epoch(domain);
+      if (oldest <= entered)
+        return;
+      std::vector<epoch_retired> ready;
+      for (epoch_record* record = domain.records.load(); record; record = record->next)
+        {
+        std::lock_guard<std::mutex> lock(record->retired_mutex);
+        take_reclaimable(record->retired, oldest, ready);
+        }
+      take_orphans(domain, oldest, ready);
+      reclaim_ready(ready);
+      }
+
+    inline epoch_record* acquire_epoch_record(epoch_domain& domain)
+      {
+      for (epoch_record* record = domain.records.load(); record; record = record->next)
+        {
+        bool expected = false;
+        if (!record->in_use.load() && record->in_use.compare_exchange_strong(expected, true))
+          return record;
+        }
+      epoch_record* record = new epoch_record();
+      record->active = 0;
+      record->in_use = true;
+      record->depth = 0;
+      record->next = domain.records.load();
+      while (!domain.records.compare_exchange_weak(record->next, record))
+        ;
+      return record;
+      }
+
+    struct epoch_thread
+      {
+      epoch_record* record;
+
+      epoch_thread() : record(acquire_epoch_record(global_epoch_domain())) {}
+
+      ~epoch_thread()
+        {
+        epoch_domain& domain = global_epoch_domain();
+        reclaim_epoch_record(domain, record);
+        std::lock_guard<std::mutex> lock(record->retired_mutex);
+        if (!record->retired.empty())
+          {
+          std::lock_guard<std::mutex> orphans_lock(domain.orphans_mutex);
+          domain.orphans.insert(domain.orphans.end(), record->retired.begin(), record->retired.end());
+          record->retired.clear();
+          }
+        record->in_use.store(false);
+        }
+      };
+
+    inline epoch_record* current_epoch_record()
+      {
+      // make sure that the domain outlives the thread-local records
+      global_epoch_domain();
+      static thread_local epoch_thread thread;
+      return thread.record;
+      }
+
+    // Calls reclaim(ptr, arg) once no reader can still borrow ptr. Items that
+    // are published to readers must be unreachable for new readers before
+    // they are retired.
+    inline void epoch_retire(void (*reclaim)(void*, uint64_t), void* ptr, uint64_t arg)
+      {
+      epoch_domain& domain = global_epoch_domain();
+      epoch_record* record = current_epoch_record();
+      epoch_retired r;
+      r.reclaim = reclaim;
+      r.ptr = ptr;
+      r.arg = arg;
+      r.epoch = domain.epoch.fetch_add(1);
+      size_t size;
+        {
+        std::lock_guard<std::mutex> lock(record->retired_mutex);
+        record->retired.push_back(r);
+        size = record->retired.size();
+        }
+      // Publish the stamp before looking for guards, so that a guard that
+      // ends meanwhile either sees it or is not seen here.
+      uint64_t blocked = domain.blocked.load();
+      while (blocked < r.epoch && !domain.blocked.compare_exchange_weak(blocked, r.epoch))
+        ;
+      if (size >= epoch_domain::reclaim_threshold || oldest_active_epoch(domain) > r.epoch)
+        reclaim_epoch_record(domain, record);
+      }
+
+    } // namespace rrb_details
+
+  // While an epoch_guard is alive, nothing that is retired after the guard was
+  // entered is reclaimed. Guards can be nested.
+  class epoch_guard
+    {
+    public:
+      epoch_guard() : _record(rrb_details::current_epoch_record())
+        {
+        if (_record->depth++ == 0)
+          _record->active.store(rrb_details::global_epoch_domain().epoch.load());
+        }
+
+      ~epoch_guard()
+        {
+        if (--_record->depth == 0)
+          {
+          const uint64_t entered = _record->active.load(std::memory_order_relaxed);
+          _record->active.store(0);
+          rrb_details::epoch_guard_ended(rrb_details::global_epoch_domain(), entered);
+          }
+        }
+
+      epoch_guard(const epoch_guard&) = delete;
+      epoch_guard& operator = (const epoch_guard&) = delete;
+
+    private:
+      rrb_details::epoch_record* _record;
+    };
+
+  // Reclaims everything that the calling thread retired and that is no longer
+  // borrowed by any reader.
+  inline void epoch_reclaim()
+    {
+    rrb_details::reclaim_epoch_record(rrb_details::global_epoch_domain(), rrb_details::current_epoch_record());
+    }
+
+  }
@@ -0,0 +1,118 @@
+
+/*
+ * Sequence hashing for rrb-trees.
+ *
+ * The hash of a sequence x_0, ..., x_{n-1} is
+ *
+ *   H = sum_i m(hash(x_i)) * B^(n-1-i)   (mod 2^64)
+ *
+ * where m is a bit mixer and B an odd constant. This hash only depends on the
+ * elements, not on the shape of the tree, because the hash of a concatenation
+ * can be computed from the hashes of its parts:
+ *
+ *   H(a ++ b) = H(a) * B^|b| + H(b)
+ *
+ * Every node lazily caches the hash of its subtree, so hashing a version that
+ * shares most of its nodes with an already hashed version only visits the
+ * nodes that are new.
+ */
+
+#pragma once
+
+#include "rrb.h"
+
+#include <functional>
+
+namespace immutable
+  {
+
+  template <typename T, bool atomic_ref_counting, int N>
+  uint64_t rrb_hash(const ref<rrb<T, atomic_ref_counting, N>>& in);
+
+  namespace rrb_details
+    {
+
+    enum : uint64_t { sequence_hash_base = 0x100000001b3ull };
+
+    inline uint64_t sequence_hash_mix(uint64_t h)
+      {
+      h ^= h >> 30;
+      h *= 0xbf58476d1ce4e5b9ull;
+      h ^= h >> 27;
+      h *= 0x94d049bb133111ebull;
+      h ^= h >> 31;
+      return h;
+      }
+
+    // sequence_hash_base ^ exponent (mod 2^64)
+    inline uint64_t sequence_hash_power(uint64_t exponent)
+      {
+      uint64_t result = 1;
+      uint64_t base = sequence_hash_base;
+      while (exponent)
+        {
+        if (exponent & 1)
+          result *= base;
+        base *= base;
+        exponent >>= 1;
+        }
+      return result;
+      }
+
+    template <typename T, bool atomic_ref_counting>
+    inline uint64_t leaf_node_hash(const leaf_node<T, atomic_ref_counting>* leaf)
+      {
+      uint64_t h = load_cached(leaf->hash);
+      if (h != 0)
+        return h;
+      std::hash<T> hasher;
+      for (uint32_t i = 0; i < leaf->len; ++i)
+        h = h * sequence_hash_base + sequence_hash_mix((uint64_t)hasher(leaf->child[i]));
+      store_cached(leaf->hash, h);
+      return h;
+      }
+
+    template <typename T, bool atomic_ref_counting, int N>
+    inline uint64_t subtree_hash(const tree_node<T, atomic_ref_counting>* node, uint32_t shift)
+      {
+      if (shift == 0)
+        return leaf_node_hash((const leaf_node<T, atomic_ref_counting>*)node);
+      uint64_t h = load_cached(node->hash);
+      if (h != 0)
+        return h;
+      const internal_node<T, atomic_ref_counting>* internal = (const internal_node<T, atomic_ref_counting>*)node;
+      const uint32_t child_shift = shift - bits<N>::rrb_bits;
+      for (uint32_t i = 0; i < internal->len; ++i)
+        {
+        rrb_index_type child_size;
+        if (internal->size_table.ptr != nullptr)
+          child_size = internal->size_table->size[i] - (i == 0 ? 0 : internal->size_table->size[i - 1]);
+        else if (i + 1 < internal->len)
+          child_size = (rrb_index_type)1 << shift;
+        else
+          {
+          ref<tree_node<T, atomic_ref_counting>> last = internal->child[i];
+          child_size = size_sub_trie<T, atomic_ref_counting, N>(last, child_shift);
+          }
+        const uint64_t child_hash = subtree_hash<T, atomic_ref_counting, N>((const tree_node<T, atomic_ref_counting>*)internal->child[i].ptr, child_shift);
+        h = h * sequence_hash_power(child_size) + child_hash;
+        }
+      store_cached(node->hash, h);
+      return h;
+      }
+
+    } // namespace rrb_details
+
+  template <typename T, bool atomic_ref_counting, int N>
+  inline uint64_t rrb_hash(const ref<rrb<T, atomic_ref_counting, N>>& in)
+    {
+    using namespace rrb_details;
+    uint64_t h = 0;
+    if (in->root.ptr != nullptr)
+      h = subtree_hash<T, atomic_ref_counting, N>(in->root.ptr, in->shift) * sequence_hash_power(in->tail_len);
+    if (in->tail_len > 0)
+      h += leaf_node_hash(in->tail.ptr);
+    return h;
+    }
+
+  }
@@ -0,0 +1,264 @@
+
+/*
+ * Hash-consing node store for the C++ port of the c-rrb library.
+ *
+ * Structural sharing between rrb-trees normally only arises when one tree is
+ * derived from another. A node_store makes it possible to share nodes between
+ * trees that were constructed independently, but that happen to contain equal
+ * content (e.g. the same file loaded twice). rrb_deduplicate walks a tree,
+ * hashes its leaves (and internal nodes), and replaces every node by an equal
+ * node that is already present in the store, if any.
+ *
+ * The store keeps references to its canonical nodes. Entries whose only
+ * remaining owner is the store itself are dropped by collect(), which is also
+ * triggered automatically when the store grows, so the store does not keep
+ * dead nodes alive indefinitely.
+ */
+
+#pragma once
+
+#include "rrb.h"
+#include "rrb_hash.h"
+
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace immutable
+  {
+
+  template <typename T, bool atomic_ref_counting = true, int N = 5>
+  class node_store;
+
+  template <typename T, bool atomic_ref_counting, int N>
+  ref<rrb<T, atomic_ref_counting, N>> rrb_deduplicate(const ref<rrb<T, atomic_ref_counting, N>>& in, node_store<T, atomic_ref_counting, N>& store);
+
+  namespace rrb_details
+    {
+
+    inline size_t hash_mix(size_t seed, size_t value)
+      {
+      return seed ^ (value + (size_t)0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+      }
+
+    template <typename T, bool atomic_ref_counting>
+    inline bool leaf_node_content_equal(const leaf_node<T, atomic_ref_counting>* left, const leaf_node<T, atomic_ref_counting>* right)
+      {
+      if (left->len != right->len)
+        return false;
+      for (uint32_t i = 0; i < left->len; ++i)
+        {
+        if (!(left->child[i] == right->child[i]))
+          return false;
+        }
+      return true;
+      }
+
+    // Internal nodes are compared by the identity of their children, so they
+    // should only be hashed once their children have been made canonical.
+    template <typename T, bool atomic_ref_counting>
+    inline size_t internal_node_content_hash(const internal_node<T, atomic_ref_counting>* node)
+      {
+      size_t seed = node->len;
+      for (uint32_t i = 0; i < node->len; ++i)
+        seed = hash_mix(seed, (size_t)node->child[i].ptr);
+      if (node->size_table.ptr != nullptr)
+        {
+        for (uint32_t i = 0; i < node->len; ++i)
+          seed = hash_mix(seed, node->size_table->size[i]);
+        }
+      return seed;
+      }
+
+    template <typename T, bool atomic_ref_counting>
+    inline bool internal_node_content_equal(const internal_node<T, atomic_ref_counting>* left, const internal_node<T, atomic_ref_counting>* right)
+      {
+      if (left->len != right->len)
+        return false;
+      if ((left->size_table.ptr == nullptr) != (right->size_table.ptr == nullptr))
+        return false;
+      for (uint32_t i = 0; i < left->len; ++i)
+        {
+        if (left->child[i].ptr != right->child[i].ptr)
+          return false;
+        }
+      if (left->size_table.ptr != nullptr)
+        return memcmp(left->size_table->size, right->size_table->size, left->len * sizeof(rrb_index_type)) == 0;
+      return true;
+      }
+
+    } // namespace rrb_details
+
+  template <typename T, bool atomic_ref_counting, int N>
+  class node_store
+    {
+    public:
+      node_store() : _live_after_collect(0), _dedup_internal_nodes(true) {}
+
+      node_store(const node_store&) = delete;
+      node_store& operator = (const node_store&) = delete;
+
+      // If false, only leaves are shared. Internal nodes are then only rebuilt
+      // when one of their children was replaced.
+      void set_deduplicate_internal_nodes(bool enabled)
+        {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _dedup_internal_nodes = enabled;
+        }
+
+      // Number of canonical nodes currently kept by the store.
+      size_t size() const
+        {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _canonical.size();
+        }
+
+      // Drops all canonical nodes that are no longer used outside of the store.
+      void collect()
+        {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _collect();
+        }
+
+      void clear()
+        {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _leaves.clear();
+        _internals.clear();
+        _canonical.clear();
+        _live_after_collect = 0;
+        }
+
+    private:
+      typedef rrb_details::leaf_node<T, atomic_ref_counting> leaf_type;
+      typedef rrb_details::internal_node<T, atomic_ref_counting> internal_type;
+      typedef rrb_details::tree_node<T, atomic_ref_counting> tree_type;
+
+      ref<tree_type> _deduplicate(const ref<tree_type>& node, uint32_t shift)
+        {
+        using namespace rrb_details;
+        if (node.ptr == nullptr || _canonical.find(node.ptr) != _canonical.end())
+          return node;
+        if (shift == 0)
+          {
+          ref<leaf_type> leaf = node;
+          return _canonical_leaf(leaf);
+          }
+        ref<internal_type> internal = node;
+        ref<internal_type> result = internal;
+        for (uint32_t i = 0; i < internal->len; ++i)
+          {
+          ref<tree_type> child = internal->child[i];
+          ref<tree_type> canonical_child = _deduplicate(child, shift - bits<N>::rrb_bits);
+          if (canonical_child.ptr != child.ptr)
+            {
+            if (result.ptr == internal.ptr)
+              result = internal_node_clone(internal.ptr);
+            result->child[i] = canonical_child;
+            }
+          }
+        if (!_dedup_internal_nodes)
+          return result;
+        return _canonical_internal(result);
+        }
+
+      ref<leaf_type> _canonical_leaf(const ref<leaf_type>& leaf)
+        {
+        using namespace rrb_details;
+        // leaves use their cached sequence hash, see rrb_hash.h
+        const size_t h = (size_t)leaf_node_hash(leaf.ptr);
+        auto range = _leaves.equal_range(h);
+        for (auto it = range.first; it != range.second; ++it)
+          {
+          if (leaf_node_content_equal(it->second.ptr, leaf.ptr))
+            return it->second;
+          }
+        _leaves.insert(std::make_pair(h, leaf));
+        _canonical.insert(leaf.ptr);
+        return leaf;
+        }
+
+      ref<internal_type> _canonical_internal(const ref<internal_type>& node)
+        {
+        using namespace rrb_details;
+        const size_t h = internal_node_content_hash(node.ptr);
+        auto range = _internals.equal_range(h);
+        for (auto it = range.first; it != range.second; ++it)
+          {
+          if (internal_node_content_equal(it->second.ptr, node.ptr))
+            return it->second;
+          }
+        _internals.insert(std::make_pair(h, node));
+        _canonical.insert(node.ptr);
+        return node;
+        }
+
+      template <typename Map>
+      bool _collect_unused(Map& m)
+        {
+        bool erased = false;
+        for (auto it = m.begin(); it != m.end();)
+          {
+          if (it->second.unique())
+            {
+            _canonical.erase(it->second.ptr);
+            it = m.erase(it);
+            erased = true;
+            }
+          else
+            ++it;
+          }
+        return erased;
+        }
+
+      void _collect()
+        {
+        // Dropping an internal node may release the last outside reference to
+        // one of its children, so repeat until nothing changes anymore.
+        bool erased = true;
+        while (erased)
+          {
+          erased = _collect_unused(_internals);
+          erased = _collect_unused(_leaves) || erased;
+          }
+        _live_after_collect = _canonical.size();
+        }
+
+      void _maybe_collect()
+        {
+        if (_canonical.size() > 1024 && _canonical.size() > 2 * _live_after_collect)
+          _collect();
+        }
+
+    private:
+      mutable std::mutex _mutex;
+      std::unordered_multimap<size_t, ref<leaf_type>> _leaves;
+      std::unordered_multimap<size_t, ref<internal_type>> _internals;
+      std::unordered_set<const void*> _canonical;
+      size_t _live_after_collect;
+      bool _dedup_internal_nodes;
+
+      template <typename T_2, bool atomic_ref_counting_2, int N_2>
+      friend ref<rrb<T_2, atomic_ref_counting_2, N_2>> rrb_deduplicate(const ref<rrb<T_2, atomic_ref_counting_2, N_2>>& in, node_store<T_2, atomic_ref_counting_2, N_2>& store);
+    };
+
+  template <typename T, bool atomic_ref_counting, int N>
+  inline ref<rrb<T, atomic_ref_counting, N>> rrb_deduplicate(const ref<rrb<T, atomic_ref_counting, N>>& in, node_store<T, atomic_ref_counting, N>& store)
+    {
+    using namespace rrb_details;
+    std::lock_guard<std::mutex> lock(store._mutex);
+    store._maybe_collect();
+    ref<tree_node<T, atomic_ref_counting>> root = store._deduplicate(in->root, in->shift);
+    ref<leaf_node<T, atomic_ref_counting>> tail = in->tail;
+    if (in->tail_len > 0)
+      tail = store._canonical_leaf(tail);
+    if (root.ptr == in->root.ptr && tail.ptr == in->tail.ptr)
+      return in;
+    ref<rrb<T, atomic_ref_counting, N>> new_rrb = rrb_head_clone(in.ptr);
+    new_rrb->root = root;
+    new_rrb->tail = tail;
+    return new_rrb;
+    }
+
+  }
@@ -0,0 +1,196 @@
+
+/*
+ * Rank and select on rrb-trees of 64-bit words, seen as bit strings.
+ *
+ * Bit i of the tree is bit i % 64 of word i / 64. Every node lazily caches
+ * the number of set bits in its subtree, so rank and select descend from the
+ * root to a single leaf and only look at the cached counts of the siblings
+ * that they skip, as the text queries in rrb_text.h do.
+ */
+
+#pragma once
+
+#include "rrb.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace immutable
+  {
+
+  template <bool atomic_ref_counting, int N>
+  rrb_index_type rrb_packed_ones(const ref<rrb<uint64_t, atomic_ref_counting, N>>& in);
+
+  template <bool atomic_ref_counting, int N>
+  rrb_index_type rrb_packed_rank(const ref<rrb<uint64_t, atomic_ref_counting, N>>& in, rrb_index_type bit);
+
+  template <bool atomic_ref_counting, int N>
+  rrb_index_type rrb_packed_select(const ref<rrb<uint64_t, atomic_ref_counting, N>>& in, bool value, rrb_index_type n);
+
+  namespace rrb_details
+    {
+
+    enum : uint64_t { bit_count_cached = (uint64_t)1 << 63 };
+
+    inline uint32_t word_popcount(uint64_t w)
+      {
+#if defined(_MSC_VER) && defined(_M_X64)
+      return (uint32_t)__popcnt64(w);
+#elif defined(__GNUC__)
+      return (uint32_t)__builtin_popcountll(w);
+#else
+      w = w - ((w >> 1) & 0x5555555555555555ull);
+      w = (w & 0x3333333333333333ull) + ((w >> 2) & 0x3333333333333333ull);
+      return (uint32_t)((((w + (w >> 4)) & 0x0f0f0f0f0f0f0f0full) * 0x0101010101010101ull) >> 56);
+#endif
+      }
+
+    // The position of the n-th set bit of w, counting from 0. w must have
+    // more than n set bits.
+    inline uint32_t word_select(uint64_t w, uint32_t n)
+      {
+      uint32_t pos = 0;
+      for (;; pos += 8, w >>= 8)
+        {
+        const uint32_t ones = word_popcount(w & 0xff);
+        if (n < ones)
+          break;
+        n -= ones;
+        }
+      for (;; ++pos, w >>= 1)
+        {
+        if ((w & 1) && n-- == 0)
+          return pos;
+        }
+      }
+
+    inline uint32_t count_ones(const uint64_t* first, const uint64_t* last)
+      {
+      uint32_t ones = 0;
+      for (; first != last; ++first)
+        ones += word_popcount(*first);
+      return ones;
+      }
+
+    struct ones_summary
+      {
+      typedef rrb_index_type value_type;
+
+      static rrb_index_type leaf(const uint64_t* first, const uint64_t* last)
+        {
+        return count_ones(first, last);
+        }
+
+      static void add(rrb_index_type& sum, rrb_index_type ones)
+        {
+        sum += ones;
+        }
+
+      static uint64_t pack(rrb_index_type ones)
+        {
+        return bit_count_cached | (uint64_t)ones;
+        }
+
+      static rrb_index_type unpack(uint64_t cached)
+        {
+        return (rrb_index_type)(cached & ~(uint64_t)bit_count_cached);
+        }
+      };
+
+    template <bool atomic_ref_counting, int N>
+    inline rrb_index_type subtree_ones(const tree_node<uint64_t, atomic_ref_counting>* node, uint32_t shift)
+      {
+      return subtree_summary<ones_summary, uint64_t, atomic_ref_counting, N>(node, shift);
+      }
+
+    } // namespace rrb_details
+
+  // The number of set bits.
+  template <bool atomic_ref_counting, int N>
+  inline rrb_index_type rrb_packed_ones(const ref<rrb<uint64_t, atomic_ref_counting, N>>& in)
+    {
+    using namespace rrb_details;
+    rrb_index_type ones = count_ones(in->tail->child, in->tail->child + in->tail_len);
+    if (in->root.ptr != nullptr)
+      ones += subtree_ones<atomic_ref_counting, N>(in->root.ptr, in->shift);
+    return ones;
+    }
+
+  // The number of set bits among the first `bit` bits, bit <= 64 * count.
+  template <bool atomic_ref_counting, int N>
+  inline rrb_index_type rrb_packed_rank(const ref<rrb<uint64_t, atomic_ref_counting, N>>& in, rrb_index_type bit)
+    {
+    using namespace rrb_details;
+    assert(bit / 64 <= in->cnt);
+    rrb_index_type word = bit / 64;
+    const uint64_t partial = bit % 64 == 0 ? 0 : ((uint64_t)1 << (bit % 64)) - 1;
+    rrb_index_type ones = 0;
+    const rrb_index_type tail_offset = in->cnt - in->tail_len;
+    if (tail_offset <= word)
+      {
+      if (in->root.ptr != nullptr)
+        ones = subtree_ones<atomic_ref_counting, N>(in->root.ptr, in->shift);
+      const uint64_t* words = in->tail->child + (word - tail_offset);
+      ones += count_ones(in->tail->child, words);
+      return partial == 0 ? ones : ones + word_popcount(*words & partial);
+      }
+    const leaf_node<uint64_t, atomic_ref_counting>* leaf = descend_to_index<uint64_t, atomic_ref_counting, N>(in->root.ptr, in->shift, word,
+      [&ones](const tree_node<uint64_t, atomic_ref_counting>* child, uint32_t child_shift)
+        {
+        ones += subtree_ones<atomic_ref_counting, N>(child, child_shift);
+        });
+    const uint64_t* words = leaf->child + word;
+    ones += count_ones(leaf->child, words);
+    return partial == 0 ? ones : ones + word_popcount(*words & partial);
+    }
+
+  // The position of the n-th bit equal to value, counting from 0, or
+  // 64 * count if there are not that many.
+  template <bool atomic_ref_counting, int N>
+  inline rrb_index_type rrb_packed_select(const ref<rrb<uint64_t, atomic_ref_counting, N>>& in, bool value, rrb_index_type n)
+    {
+    using namespace rrb_details;
+    rrb_index_type word = 0;
+    const uint64_t* words;
+    uint32_t len;
+    rrb_index_type root_matches = 0;
+    if (in->root.ptr != nullptr)
+      {
+      const rrb_index_type ones = subtree_ones<atomic_ref_counting, N>(in->root.ptr, in->shift);
+      root_matches = value ? ones : (in->cnt - in->tail_len) * 64 - ones;
+      }
+    if (n >= root_matches)
+      {
+      n -= root_matches;
+      word = in->cnt - in->tail_len;
+      words = in->tail->child;
+      len = in->tail_len;
+      }
+    else
+      {
+      const leaf_node<uint64_t, atomic_ref_counting>* leaf = descend_by_summary<uint64_t, atomic_ref_counting, N>(in->root.ptr, in->shift, word,
+        [&n, value](const tree_node<uint64_t, atomic_ref_counting>* child, uint32_t child_shift, rrb_index_type child_words)
+          {
+          const rrb_index_type ones = subtree_ones<atomic_ref_counting, N>(child, child_shift);
+          const rrb_index_type matches = value ? ones : child_words * 64 - ones;
+          if (n < matches)
+            return true;
+          n -= matches;
+          return false;
+          });
+      words = leaf->child;
+      len = leaf->len;
+      }
+    for (uint32_t i = 0; i < len; ++i)
+      {
+      const uint64_t w = value ? words[i] : ~words[i];
+      const uint32_t matches = word_popcount(w);
+      if (n < matches)
+        return (word + i) * 64 + word_select(w, (uint32_t)n);
+      n -= matches;
+      }
+    return in->cnt * 64;
+    }
+
+  }
@@ -0,0 +1,392 @@
+
+/*
+ * Numeric reductions over rrb-trees.
+ *
+ * The reductions process the contiguous element array of every leaf (see
+ * rrb_walk_leaves in rrb_search.h) and combine the results of the leaves.
+ * float, double and int32_t leaves are reduced with SSE2 kernels, other
+ * arithmetic types with scalar loops.
+ *
+ * rrb_reduce_leaves can split the work at the children of the root. Every
+ * thread reduces a contiguous range of children into its own accumulator,
+ * and the accumulators are combined in order, so the result only depends on
+ * the number of threads. Reading does not touch any reference count, so this
+ * also works for trees without atomic reference counting.
+ *
+ * Integral sums and dot products are accumulated in 64 bits. Floating point
+ * minima and maxima are unspecified when the vector holds NaNs.
+ */
+
+#pragma once
+
+#include "rrb.h"
+#include "rrb_search.h"
+
+#include <limits>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace immutable
+  {
+
+  template <typename T>
+  struct reduce_sum_type
+    {
+    typedef typename std::conditional<std::is_floating_point<T>::value, T,
+      typename std::conditional<std::is_signed<T>::value, int64_t, uint64_t>::type>::type type;
+    };
+
+  template <typename T, bool atomic_ref_counting, int N, typename Acc, typename LeafFn, typename Combine>
+  Acc rrb_reduce_leaves(const rrb<T, atomic_ref_counting, N>* in, const Acc& identity, LeafFn leaf_fn, Combine combine, uint32_t threads);
+
+  namespace rrb_details
+    {
+
+    template <typename T>
+    inline typename reduce_sum_type<T>::type leaf_sum(const T* p, uint32_t n)
+      {
+      typedef typename reduce_sum_type<T>::type sum_type;
+      sum_type s0 = 0, s1 = 0;
+      uint32_t i = 0;
+      for (; i + 2 <= n; i += 2)
+        {
+        s0 += (sum_type)p[i];
+        s1 += (sum_type)p[i + 1];
+        }
+      if (i < n)
+        s0 += (sum_type)p[i];
+      return s0 + s1;
+      }
+
+    template <typename T>
+    inline typename reduce_sum_type<T>::type leaf_dot(const T* p, const T* q, uint32_t n)
+      {
+      typedef typename reduce_sum_type<T>::type sum_type;
+      sum_type s = 0;
+      for (uint32_t i = 0; i < n; ++i)
+        s += (sum_type)p[i] * (sum_type)q[i];
+      return s;
+      }
+
+    template <typename T>
+    inline void leaf_min_max(const T* p, uint32_t n, T& lo, T& hi)
+      {
+      for (uint32_t i = 0; i < n; ++i)
+        {
+        if (p[i] < lo)
+          lo = p[i];
+        if (hi < p[i])
+          hi = p[i];
+        }
+      }
+
+#ifdef RRB_SSE2
+
+    inline float horizontal_sum(__m128 v)
+      {
+      v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+      v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+      return _mm_cvtss_f32(v);
+      }
+
+    inline double horizontal_sum(__m128d v)
+      {
+      return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+      }
+
+    inline float leaf_sum(const float* p, uint32_t n)
+      {
+      __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+      uint32_t i = 0;
+      for (; i + 8 <= n; i += 8)
+        {
+        s0 = _mm_add_ps(s0, _mm_loadu_ps(p + i));
+        s1 = _mm_add_ps(s1, _mm_loadu_ps(p + i + 4));
+        }
+      float s = horizontal_sum(_mm_add_ps(s0, s1));
+      for (; i < n; ++i)
+        s += p[i];
+      return s;
+      }
+
+    inline double leaf_sum(const double* p, uint32_t n)
+      {
+      __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+      uint32_t i = 0;
+      for (; i + 4 <= n; i += 4)
+        {
+        s0 = _mm_add_pd(s0, _mm_loadu_pd(p + i));
+        s1 = _mm_add_pd(s1, _mm_loadu_pd(p + i + 2));
+        }
+      double s = horizontal_sum(_mm_add_pd(s0, s1));
+      for (; i < n; ++i)
+        s += p[i];
+      return s;
+      }
+
+    // Sign-extends the 32-bit lanes to 64 bits before adding them.
+    inline int64_t leaf_sum(const int32_t* p, uint32_t n)
+      {
+      __m128i s = _mm_setzero_si128();
+      uint32_t i = 0;
+      for (; i + 4 <= n; i += 4)
+        {
+        const __m128i x = _mm_loadu_si128((const __m128i*)(p + i));
+        const __m128i sign = _mm_srai_epi32(x, 31);
+        s = _mm_add_epi64(s, _mm_unpacklo_epi32(x, sign));
+        s = _mm_add_epi64(s, _mm_unpackhi_epi32(x, sign));
+        }
+      int64_t lanes[2];
+      _mm_storeu_si128((__m128i*)lanes, s);
+      int64_t sum = lanes[0] + lanes[1];
+      for (; i < n; ++i)
+        sum += p[i];
+      return sum;
+      }
+
+    inline float leaf_dot(const float* p, const float* q, uint32_t n)
+      {
+      __m128 s = _mm_setzero_ps();
+      uint32_t i = 0;
+      for (; i + 4 <= n; i += 4)
+        s = _mm_add_ps(s, _mm_mul_ps(_mm_loadu_ps(p + i), _mm_loadu_ps(q + i)));
+      float sum = horizontal_sum(s);
+      for (; i < n; ++i)
+        sum += p[i] * q[i];
+      return sum;
+      }
+
+    inline double leaf_dot(const double* p, const double* q, uint32_t n)
+      {
+      __m128d s = _mm_setzero_pd();
+      uint32_t i = 0;
+      for (; i + 2 <= n; i += 2)
+        s = _mm_add_pd(s, _mm_mul_pd(_mm_loadu_pd(p + i), _mm_loadu_pd(q + i)));
+      double sum = horizontal_sum(s);
+      for (; i < n; ++i)
+        sum += p[i] * q[i];
+      return sum;
+      }
+
+    inline void leaf_min_max(const float* p, uint32_t n, float& lo, float& hi)
+      {
+      uint32_t i = 0;
+      if (n >= 4)
+        {
+        __m128 vlo = _mm_set1_ps(lo), vhi = _mm_set1_ps(hi);
+        for (; i + 4 <= n; i += 4)
+          {
+          const __m128 x = _mm_loadu_ps(p + i);
+          vlo = _mm_min_ps(vlo, x);
+          vhi = _mm_max_ps(vhi, x);
+          }
+        float lanes[4];
+        _mm_storeu_ps(lanes, vlo);
+        lo = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+        _mm_storeu_ps(lanes, vhi);
+        hi = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+        }
+      for (; i < n; ++i)
+        {
+        lo = std::min(lo, p[i]);
+        hi = std::max(hi, p[i]);
+        }
+      }
+
+    inline void leaf_min_max(const double* p, uint32_t n, double& lo, double& hi)
+      {
+      uint32_t i = 0;
+      if (n >= 2)
+        {
+        __m128d vlo = _mm_set1_pd(lo), vhi = _mm_set1_pd(hi);
+        for (; i + 2 <= n; i += 2)
+          {
+          const __m128d x = _mm_loadu_pd(p + i);
+          vlo = _mm_min_pd(vlo, x);
+          vhi = _mm_max_pd(vhi, x);
+          }
+        double lanes[2];
+        _mm_storeu_pd(lanes, vlo);
+        lo = std::min(lanes[0], lanes[1]);
+        _mm_storeu_pd(lanes, vhi);
+        hi = std::max(lanes[0], lanes[1]);
+        }
+      for (; i < n; ++i)
+        {
+        lo = std::min(lo, p[i]);
+        hi = std::max(hi, p[i]);
+        }
+      }
+
+    // SSE2 has no 32-bit min and max, so lanes are selected with a mask.
+    inline void leaf_min_max(const int32_t* p, uint32_t n, int32_t& lo, int32_t& hi)
+      {
+      uint32_t i = 0;
+      if (n >= 4)
+        {
+        __m128i vlo = _mm_set1_epi32(lo), vhi = _mm_set1_epi32(hi);
+        for (; i + 4 <= n; i += 4)
+          {
+          const __m128i x = _mm_loadu_si128((const __m128i*)(p + i));
+          const __m128i smaller = _mm_cmplt_epi32(x, vlo);
+          vlo = _mm_or_si128(_mm_and_si128(smaller, x), _mm_andnot_si128(smaller, vlo));
+          const __m128i larger = _mm_cmpgt_epi32(x, vhi);
+          vhi = _mm_or_si128(_mm_and_si128(larger, x), _mm_andnot_si128(larger, vhi));
+          }
+        int32_t lanes[4];
+        _mm_storeu_si128((__m128i*)lanes, vlo);
+        lo = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+        _mm_storeu_si128((__m128i*)lanes, vhi);
+        hi = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+        }
+      for (; i < n; ++i)
+        {
+        lo = std::min(lo, p[i]);
+        hi = std::max(hi, p[i]);
+        }
+      }
+
+#endif // RRB_SSE2
+
+    template <typename T>
+    struct min_max_acc
+      {
+      T lo;
+      T hi;
+      };
+
+    } // namespace rrb_details
+
+  // Reduces the leaves of in. leaf_fn(acc, elements, len, offset) adds a leaf
+  // to an accumulator, and combine(acc, other) adds the accumulator of the
+  // elements that follow acc's. The children of the root are split over up
+  // to `threads` threads (0 uses one thread per core).
+  template <typename T, bool atomic_ref_counting, int N, typename Acc, typename LeafFn, typename Combine>
+  inline Acc rrb_reduce_leaves(const rrb<T, atomic_ref_counting, N>* in, const Acc& identity, LeafFn leaf_fn, Combine combine, uint32_t threads)
+    {
+    using namespace rrb_details;
+    threads = thread_count(threads);
+    const internal_node<T, atomic_ref_counting>* root = (const internal_node<T, atomic_ref_counting>*)in->root.ptr;
+    // below this size, threads cost more than they gain
+    const rrb_index_type min_per_thread = 1 << 16;
+    if (in->shift == 0 || in->cnt / min_per_thread < 2)
+      threads = 1;
+    const uint32_t workers = root == nullptr || in->shift == 0 ? 1 : std::max<uint32_t>(1, std::min<uint32_t>(threads, root->len));
+    std::vector<Acc> results(workers + 1, identity);
+    auto reduce_children = [&](uint32_t worker)
+      {
+      Acc& acc = results[worker];
+      auto add_leaf = [&](const T* p, uint32_t len, rrb_index_type offset) -> bool
+        {
+        leaf_fn(acc, p, len, offset);
+        return true;
+        };
+      if (root == nullptr)
+        return;
+      if (in->shift == 0)
+        {
+        walk_leaves<T, atomic_ref_counting, N>(in->root.ptr, 0, 0, 0, add_leaf);
+        return;
+        }
+      const uint32_t first = (uint32_t)((uint64_t)root->len * worker / workers);
+      const uint32_t last = (uint32_t)((uint64_t)root->len * (worker + 1) / workers);
+      for (uint32_t i = first; i < last; ++i)
+        {
+        const rrb_index_type offset = root->size_table.ptr != nullptr ? (i == 0 ? 0 : root->size_table->size[i - 1]) : (rrb_index_type)i << in->shift;
+        walk_leaves<T, atomic_ref_counting, N>((const tree_node<T, atomic_ref_counting>*)root->child[i].ptr, in->shift - bits<N>::rrb_bits, 0, offset, add_leaf);
+        }
+      };
+    std::vector<std::thread> pool;
+    for (uint32_t w = 1; w < workers; ++w)
+      pool.emplace_back(reduce_children, w);
+    reduce_children(0);
+    for (auto& t : pool)
+      t.join();
+    leaf_fn(results[workers], (const T*)in->tail->child, in->tail_len, in->cnt - in->tail_len);
+    Acc result = results[0];
+    for (uint32_t w = 1; w <= workers; ++w)
+      combine(result, results[w]);
+    return result;
+    }
+
+  template <typename T, bool atomic_ref_counting, int N>
+  inline typename reduce_sum_type<T>::type rrb_sum(const rrb<T, atomic_ref_counting, N>* in, uint32_t threads)
+    {
+    typedef typename reduce_sum_type<T>::type sum_type;
+    return rrb_reduce_leaves(in, (sum_type)0,
+      [](sum_type& acc, const T* p, uint32_t len, rrb_index_type) { acc += rrb_details::leaf_sum(p, len); },
+      [](sum_type& acc, const sum_type& other) { acc += other; }, threads);
+    }
+
+  // The smallest and the largest element of a non-empty tree.
+  template <typename T, bool atomic_ref_counting, int N>
+  inline std::pair<T, T> rrb_min_max(const rrb<T, atomic_ref_counting, N>* in, uint32_t threads)
+    {
+    typedef rrb_details::min_max_acc<T> acc_type;
+    assert(in->cnt > 0);
+    const T first = rrb_nth(in, 0);
+    const acc_type identity = { first, first };
+    const acc_type result = rrb_reduce_leaves(in, identity,
+      [](acc_type& acc, const T* p, uint32_t len, rrb_index_type) { rrb_details::leaf_min_max(p, len, acc.lo, acc.hi); },
+      [](acc_type& acc, const acc_type& other)
+        {
+        if (other.lo < acc.lo)
+          acc.lo = other.lo;
+        if (acc.hi < other.hi)
+          acc.hi = other.hi;
+        }, threads);
+    return std::make_pair(result.lo, result.hi);
+    }
+
+  // The dot product of two trees of the same size. The leaves of both trees
+  // need not line up.
+  template <typename T, bool atomic_ref_counting, int N>
+  inline typename reduce_sum_type<T>::type rrb_dot(const rrb<T, atomic_ref_counting, N>* left, const rrb<T, atomic_ref_counting, N>* right, uint32_t threads)
+    {
+    typedef typename reduce_sum_type<T>::type sum_type;
+    assert(left->cnt == right->cnt);
+    return rrb_reduce_leaves(left, (sum_type)0,
+      [right](sum_type& acc, const T* p, uint32_t len, rrb_index_type offset)
+        {
+        uint32_t done = 0;
+        while (done < len)
+          {
+          const std::tuple<const T*, rrb_index_type, rrb_index_type> region = rrb_region_for(right, offset + done);
+          const uint32_t n = (uint32_t)std::min<rrb_index_type>(len - done, std::get<2>(region) - (offset + done));
+          acc += rrb_details::leaf_dot(p + done, std::get<0>(region) + (offset + done - std::get<1>(region)), n);
+          done += n;
+          }
+        },
+      [](sum_type& acc, const sum_type& other) { acc += other; }, threads);
+    }
+
+  // Counts the elements in each of `bins` bins of equal width that split
+  // [lo, hi). Elements outside of [lo, hi) are not counted, and without bins
+  // nothing is.
+  template <typename T, bool atomic_ref_counting, int N>
+  inline std::vector<rrb_index_type> rrb_histogram(const rrb<T, atomic_ref_counting, N>* in, T lo, T hi, uint32_t bins, uint32_t threads)
+    {
+    typedef std::vector<rrb_index_type> acc_type;
+    if (bins == 0)
+      return acc_type();
+    const double scale = hi > lo ? bins / ((double)hi - (double)lo) : 0.0;
+    return rrb_reduce_leaves(in, acc_type(bins, 0),
+      [lo, hi, bins, scale](acc_type& acc, const T* p, uint32_t len, rrb_index_type)
+        {
+        for (uint32_t i = 0; i < len; ++i)
+          {
+          if (!(p[i] >= lo && p[i] < hi))
+            continue;
+          const uint32_t bin = (uint32_t)(((double)p[i] - (double)lo) * scale);
+          ++acc[bin < bins ? bin : bins - 1];
+          }
+        },
+      [](acc_type& acc, const acc_type& other)
+        {
+        for (size_t b = 0; b < acc.size(); ++b)
+          acc[b] += other[b];
+        }, threads);
+    }
+
+  }
@@ -0,0 +1,687 @@
+
+/*
+ * Searching rrb-trees leaf by leaf.
+ *
+ * rrb_walk_leaves visits the element arrays of the leaves in order, so the
+ * searches below run on contiguous memory instead of going through an
+ * iterator per element. For integral elements of 1, 2 or 4 bytes, the leaf
+ * arrays are compared with SSE2 kernels, or AVX2 kernels when the compiler
+ * targets AVX2. Define RRB_NO_SIMD to use the scalar loops everywhere.
+ *
+ * rrb_search finds candidates in each leaf by their first element, and only
+ * verifies the candidates that straddle a leaf boundary by looking up the
+ * following leaves.
+ */
+
+#pragma once
+
+#include "rrb.h"
+#include "rrb_sort.h"
+
+#include <type_traits>
+
+#if !defined(RRB_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define RRB_SSE2
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#define RRB_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(RRB_SSE2) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace immutable
+  {
+
+  template <typename T, bool atomic_ref_counting, int N, typename Fn>
+  bool rrb_walk_leaves(const rrb<T, atomic_ref_counting, N>* in, rrb_index_type from, Fn& fn);
+
+  template <typename T, bool atomic_ref_counting, int N>
+  rrb_index_type rrb_find(const rrb<T, atomic_ref_counting, N>* in, const T& value, rrb_index_type from);
+
+  template <typename T, bool atomic_ref_counting, int N>
+  rrb_index_type rrb_count_value(const rrb<T, atomic_ref_counting, N>* in, const T& value);
+
+  template <typename T, bool atomic_ref_counting, int N>
+  rrb_index_type rrb_find_first_of(const rrb<T, atomic_ref_counting, N>* in, const T* values, size_t values_len, rrb_index_type from);
+
+  template <typename T, bool atomic_ref_counting, int N>
+  rrb_index_type rrb_search(const rrb<T, atomic_ref_counting, N>* in, const T* needle, size_t needle_len, rrb_index_type from);
+
+  template <typename T, bool atomic_ref_counting, int N, typename Pred>
+  rrb_index_type rrb_partition_point(const rrb<T, atomic_ref_counting, N>* in, Pred pred);
+
+  template <typename T, bool atomic_ref_counting, int N>
+  void rrb_gather(const rrb<T, atomic_ref_counting, N>* in, const rrb_index_type* indices, size_t count, T* out);
+
+  namespace rrb_details
+    {
+
+    // The integer type whose SIMD lanes compare like T, or void.
+    template <typename T>
+    struct simd_lane
+      {
+      typedef typename std::conditional<!std::is_integral<T>::value || std::is_same<T, bool>::value, void,
+        typename std::conditional<sizeof(T) == 1, int8_t,
+        typename std::conditional<sizeof(T) == 2, int16_t,
+        typename std::conditional<sizeof(T) == 4, int32_t, void>::type>::type>::type>::type type;
+      };
+
+#ifdef RRB_SSE2
+
+    inline uint32_t simd_ctz(uint32_t mask)
+      {
+#ifdef _MSC_VER
+      unsigned long index;
+      _BitScanForward(&index, mask);
+      return (uint32_t)index;
+#else
+      return (uint32_t)__builtin_ctz(mask);
+#endif
+      }
+
+    inline uint32_t simd_popcount(uint32_t mask)
+      {
+      mask = mask - ((mask >> 1) & 0x55555555);
+      mask = (mask & 0x33333333) + ((mask >> 2) & 0x33333333);
+      return (((mask + (mask >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+      }
+
+    template <typename L>
+    struct simd_ops;
+
+    template <>
+    struct simd_ops<int8_t>
+      {
+      static __m128i set1(int8_t v) { return _mm_set1_epi8(v); }
+      static __m128i eq(__m128i a, __m128i b) { return _mm_cmpeq_epi8(a, b); }
+#ifdef RRB_AVX2
+      static __m256i set1_256(int8_t v) { return _mm256_set1_epi8(v); }
+      static __m256i eq(__m256i a, __m256i b) { return _mm256_cmpeq_epi8(a, b); }
+#endif
+      };
+
+    template <>
+    struct simd_ops<int16_t>
+      {
+      static __m128i set1(int16_t v) { return _mm_set1_epi16(v); }
+      static __m128i eq(__m128i a, __m128i b) { return _mm_cmpeq_epi16(a, b); }
+#ifdef RRB_AVX2
+      static __m256i set1_256(int16_t v) { return _mm256_set1_epi16(v); }
+      static __m256i eq(__m256i a, __m256i b) { return _mm256_cmpeq_epi16(a, b); }
+#endif
+      };
+
+    template <>
+    struct simd_ops<int32_t>
+      {
+      static __m128i set1(int32_t v) { return _mm_set1_epi32(v); }
+      static __m128i eq(__m128i a, __m128i b) { return _mm_cmpeq_epi32(a, b); }
+#ifdef RRB_AVX2
+      static __m256i set1_256(int32_t v) { return _mm256_set1_epi32(v); }
+      static __m256i eq(__m256i a, __m256i b) { return _mm256_cmpeq_epi32(a, b); }
+#endif
+      };
+
+    // Returns the byte mask of the lanes of p[i, i + lanes) that equal value.
+    template <typename L>
+    inline uint32_t simd_match_16(const L* p, __m128i value)
+      {
+      return (uint32_t)_mm_movemask_epi8(simd_ops<L>::eq(_mm_loadu_si128((const __m128i*)p), value));
+      }
+
+#ifdef RRB_AVX2
+    template <typename L>
+    inline uint32_t simd_match_32(const L* p, __m256i value)
+      {
+      return (uint32_t)_mm256_movemask_epi8(simd_ops<L>::eq(_mm256_loadu_si256((const __m256i*)p), value));
+      }
+#endif
+
+    template <typename L>
+    inline size_t simd_find(const L* p, size_t n, L value)
+      {
+      size_t i = 0;
+#ifdef RRB_AVX2
+      const __m256i value_256 = simd_ops<L>::set1_256(value);
+      for (; i + 32 / sizeof(L) <= n; i += 32 / sizeof(L))
+        {
+        const uint32_t mask = simd_match_32(p + i, value_256);
+        if (mask != 0)
+          return i + simd_ctz(mask) / sizeof(L);
+        }
+#endif
+      const __m128i value_128 = simd_ops<L>::set1(value);
+      for (; i + 16 / sizeof(L) <= n; i += 16 / sizeof(L))
+        {
+        const uint32_t mask = simd_match_16(p + i, value_128);
+        if (mask != 0)
+          return i + simd_ctz(mask) / sizeof(L);
+        }
+      for (; i < n; ++i)
+        {
+        if (p[i] == value)
+          return i;
+        }
+      return n;
+      }
+
+    template <typename L>
+    inline size_t simd_count(const L* p, size_t n, L value)
+      {
+      size_t i = 0, count = 0;
+#ifdef RRB_AVX2
+      const __m256i value_256 = simd_ops<L>::set1_256(value);
+      for (; i + 32 / sizeof(L) <= n; i += 32 / sizeof(L))
+        count += simd_popcount(simd_match_32(p + i, value_256)) / sizeof(L);
+#endif
+      const __m128i value_128 = simd_ops<L>::set1(value);
+      for (; i + 16 / sizeof(L) <= n; i += 16 / sizeof(L))
+        count += simd_popcount(simd_match_16(p + i, value_128)) / sizeof(L);
+      for (; i < n; ++i)
+        count += p[i] == value;
+      return count;
+      }
+
+    enum { simd_max_values = 16 };
+
+    // values_len <= simd_max_values
+    template <typename L>
+    inline size_t simd_find_first_of(const L* p, size_t n, const L* values, size_t values_len)
+      {
+      size_t i = 0;
+      __m128i values_128[simd_max_values];
+      for (size_t v = 0; v < values_len; ++v)
+        values_128[v] = simd_ops<L>::set1(values[v]);
+      for (; i + 16 / sizeof(L) <= n; i += 16 / sizeof(L))
+        {
+        const __m128i block = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i match = _mm_setzero_si128();
+        for (size_t v = 0; v < values_len; ++v)
+          match = _mm_or_si128(match, simd_ops<L>::eq(block, values_128[v]));
+        const uint32_t mask = (uint32_t)_mm_movemask_epi8(match);
+        if (mask != 0)
+          return i + simd_ctz(mask) / sizeof(L);
+        }
+      for (; i < n; ++i)
+        {
+        for (size_t v = 0; v < values_len; ++v)
+          {
+          if (p[i] == values[v])
+            return i;
+          }
+        }
+      return n;
+      }
+
+#endif // RRB_SSE2
+
+    template <typename T>
+    inline size_t find_in_leaf(const T* p, size_t n, const T& value, void*)
+      {
+      for (size_t i = 0; i < n; ++i)
+        {
+        if (p[i] == value)
+          return i;
+        }
+      return n;
+      }
+
+    template <typename T>
+    inline size_t count_in_leaf(const T* p, size_t n, const T& value, void*)
+      {
+      size_t count = 0;
+      for (size_t i = 0; i < n; ++i)
+        count += p[i] == value;
+      return count;
+      }
+
+    template <typename T>
+    inline size_t find_first_of_in_leaf(const T* p, size_t n, const T* values, size_t values_len, void*)
+      {
+      for (size_t i = 0; i < n; ++i)
+        {
+        for (size_t v = 0; v < values_len; ++v)
+          {
+          if (p[i] == values[v])
+            return i;
+          }
+        }
+      return n;
+      }
+
+#ifdef RRB_SSE2
+    template <typename T, typename L>
+    inline size_t find_in_leaf(const T* p, size_t n, const T& value, L*)
+      {
+      return simd_find((const L*)p, n, (L)value);
+      }
+
+    template <typename T, typename L>
+    inline size_t count_in_leaf(const T* p, size_t n, const T& value, L*)
+      {
+      return simd_count((const L*)p, n, (L)value);
+      }
+
+    template <typename T, typename L>
+    inline size_t find_first_of_in_leaf(const T* p, size_t n, const T* values, size_t values_len, L*)
+      {
+      if (values_len > simd_max_values)
+        return find_first_of_in_leaf(p, n, values, values_len, (void*)nullptr);
+      L lanes[simd_max_values];
+      for (size_t v = 0; v < values_len; ++v)
+        lanes[v] = (L)values[v];
+      return simd_find_first_of((const L*)p, n, lanes, values_len);
+      }
+#endif
+
+    // Selects the overloads above for T. Without SSE2, the pointer converts
+    // to void* and selects the scalar loops.
+    template <typename T>
+    inline typename simd_lane<T>::type* leaf_kernel()
+      {
+      return nullptr;
+      }
+
+    // Calls fn(elements, len, offset) for the leaves of node that hold
+    // elements at or after `from`, in order, until fn returns false. offset is
+    // the index of the first element of node in the tree.
+    template <typename T, bool atomic_ref_counting, int N, typename Fn>
+    inline bool walk_leaves(const tree_node<T, atomic_ref_counting>* node, uint32_t shift, rrb_index_type from, rrb_index_type offset, Fn& fn)
+      {
+      if (shift == 0)
+        {
+        const leaf_node<T, atomic_ref_counting>* leaf = (const leaf_node<T, atomic_ref_counting>*)node;
+        const uint32_t skip = from > offset ? (uint32_t)(from - offset) : 0;
+        return fn((const T*)leaf->child + skip, leaf->len - skip, offset + skip);
+        }
+      const internal_node<T, atomic_ref_counting>* internal = (const internal_node<T, atomic_ref_counting>*)node;
+      uint32_t i = 0;
+      rrb_index_type child_offset = offset;
+      if (from > offset)
+        {
+        rrb_index_type relative = from - offset;
+        if (internal->size_table.ptr == nullptr)
+          {
+          i = (uint32_t)(relative >> shift);
+          child_offset = offset + ((rrb_index_type)i << shift);
+          }
+        else
+          {
+          i = sized_pos(internal, &relative, shift);
+          child_offset = from - relative;
+          }
+        }
+      for (; i < internal->len; ++i)
+        {
+#ifdef RRB_PREFETCH
+        if (i + 1 < internal->len)
+          prefetch(internal->child[i + 1].ptr);
+#endif
+        if (!walk_leaves<T, atomic_ref_counting, N>((const tree_node<T, atomic_ref_counting>*)internal->child[i].ptr, shift - bits<N>::rrb_bits, from, child_offset, fn))
+          return false;
+        if (internal->size_table.ptr == nullptr)
+          child_offset += (rrb_index_type)1 << shift;
+        else
+          child_offset = offset + internal->size_table->size[i];
+        }
+      return true;
+      }
+
+    // Whether the elements at pos equal needle. The first `available` of them
+    // are at p.
+    template <typename T, bool atomic_ref_counting, int N>
+    inline bool matches_at(const rrb<T, atomic_ref_counting, N>* in, rrb_index_type pos, const T* p, size_t available, const T* needle, size_t needle_len)
+      {
+      const size_t here = std::min(available, needle_len);
+      if (!std::equal(needle, needle + here, p))
+        return false;
+      size_t matched = here;
+      while (matched < needle_len)
+        {
+        const std::tuple<const T*, rrb_index_type, rrb_index_type> region = rrb_region_for(in, pos + (rrb_index_type)matched);
+        const T* elements = std::get<0>(region) + (pos + matched - std::get<1>(region));
+        const size_t len = std::min<size_t>(needle_len - matched, (size_t)(std::get<2>(region) - (pos + matched)));
+        if (!std::equal(needle + matched, needle + matched + len, elements))
+          return false;
+        matched += len;
+        }
+      return true;
+      }
+
+    template <typename T, bool atomic_ref_counting, int N>
+    inline const T& first_element(const tree_node<T, atomic_ref_counting>* node, uint32_t shift)
+      {
+      for (; shift > 0; shift -= bits<N>::rrb_bits)
+        node = (const tree_node<T, atomic_ref_counting>*)((const internal_node<T, atomic_ref_counting>*)node)->child[0].ptr;
+      return ((const leaf_node<T, atomic_ref_counting>*)node)->child[0];
+      }
+
+    // A request to gather the element at `index` into out[position]. Sorted
+    // indices are their own requests, others are packed into 64 bits when
+    // both halves fit, and are pairs otherwise.
+    struct sorted_gather
+      {
+      rrb_index_type index(const rrb_index_type& r) const { return r; }
+      size_t position(const rrb_index_type& r) const { return (size_t)(&r - first); }
+
+      const rrb_index_type* first;
+      };
+
+    struct packed_gather
+      {
+      rrb_index_type index(uint64_t r) const { return (rrb_index_type)(r >> 32); }
+      size_t position(uint64_t r) const { return (size_t)(r & 0xffffffff); }
+      };
+
+    struct pair_gather
+      {
+      rrb_index_type index(const std::pair<rrb_index_type, size_t>& r) const { return r.first; }
+      size_t position(const std::pair<rrb_index_type, size_t>& r) const { return r.second; }
+      };
+
+    // The child of internal that holds element `index`, and the offset of
+    // its first element.
+    template <typename T, bool atomic_ref_counting>
+    inline uint32_t gather_child(const internal_node<T, atomic_ref_counting>* internal, uint32_t shift, rrb_index_type offset, rrb_index_type index, rrb_index_type& child_offset)
+      {
+      rrb_index_type relative = index - offset;
+      if (internal->size_table.ptr == nullptr)
+        {
+        const uint32_t i = (uint32_t)(relative >> shift);
+        child_offset = offset + ((rrb_index_type)i << shift);
+        return i;
+        }
+      const uint32_t i = sized_pos(internal, &relative, shift);
+      child_offset = index - relative;
+      return i;
+      }
+
+    // Gathers the requests in [first, last), which are sorted by index and
+    // all fall in node. Every child that holds requested elements is visited
+    // once, and the next one is prefetched before descending into this one.
+    template <typename T, bool atomic_ref_counting, int N, typename Request, typename Gather>
+    inline void gather_node(const tree_node<T, atomic_ref_counting>* node, uint32_t shift, rrb_index_type offset, const Request* first, const Request* last, const Gather& g, T* out)
+      {
+      if (shift == 0)
+        {
+        const T* elements = ((const leaf_node<T, atomic_ref_counting>*)node)->child;
+        for (; first != last; ++first)
+          out[g.position(*first)] = elements[g.index(*first) - offset];
+        return;
+        }
+      const internal_node<T, atomic_ref_counting>* internal = (const internal_node<T, atomic_ref_counting>*)node;
+      rrb_index_type child_offset;
+      uint32_t i = gather_child(internal, shift, offset, g.index(*first), child_offset);
+      for (;;)
+        {
+        const rrb_index_type child_end = internal->size_table.ptr != nullptr ? offset + internal->size_table->size[i] : child_offset + ((rrb_index_type)1 << shift);
+        // gallop, so that large groups near the root take logarithmic time
+        size_t step = 1;
+        while (step < (size_t)(last - first) && g.index(first[step]) < child_end)
+          step *= 2;
+        const Request* group_end = std::partition_point(first + step / 2, first + std::min(step, (size_t)(last - first)), [&](const Request& r) { return g.index(r) < child_end; });
+        rrb_index_type next_offset = 0;
+        uint32_t next = 0;
+        if (group_end != last)
+          {
+          next = gather_child(internal, shift, offset, g.index(*group_end), next_offset);
+          prefetch(internal->child[next].ptr);
+          }
+        gather_node<T, atomic_ref_counting, N>((const tree_node<T, atomic_ref_counting>*)internal->child[i].ptr, shift - bits<N>::rrb_bits, child_offset, first, group_end, g, out);
+        if (group_end == last)
+          return;
+        first = group_end;
+        i = next;
+        child_offset = next_offset;
+        }
+      }
+
+    template <typename T, bool atomic_ref_counting, int N, typename Request, typename Gather>
+    inline void gather_sorted(const rrb<T, atomic_ref_counting, N>* in, const Request* first, const Request* last, const Gather& g, T* out)
+      {
+      const rrb_index_type tail_offset = in->cnt - in->tail_len;
+      const Request* in_tail = first;
+      while (in_tail != last && g.index(*in_tail) < tail_offset)
+        ++in_tail;
+      if (in_tail != first)
+        gather_node<T, atomic_ref_counting, N>(in->root.ptr, in->shift, 0, first, in_tail, g, out);
+      for (; in_tail != last; ++in_tail)
+        out[g.position(*in_tail)] = in->tail->child[g.index(*in_tail) - tail_offset];
+      }
+
+#ifdef RRB_PREFETCH
+    // Gathers unsorted indices without sorting them, by descending for
+    // `lanes` of them at the same time, one level per round. The nodes of the
+    // next round are prefetched, so the cache misses of the lanes overlap.
+    template <typename T, bool atomic_ref_counting, int N>
+    inline void gather_interleaved(const rrb<T, atomic_ref_counting, N>* in, const rrb_index_type* indices, size_t count, T* out)
+      {
+      enum { lanes = 16 };
+      const rrb_index_type tail_offset = in->cnt - in->tail_len;
+      for (size_t first = 0; first < count; first += lanes)
+        {
+        const uint32_t n = (uint32_t)std::min<size_t>(lanes, count - first);
+        const tree_node<T, atomic_ref_counting>* nodes[lanes];
+        rrb_index_type index[lanes];
+        for (uint32_t l = 0; l < n; ++l)
+          {
+          index[l] = indices[first + l];
+          nodes[l] = index[l] < tail_offset ? in->root.ptr : nullptr;
+          }
+        for (uint32_t shift = in->shift; shift > 0; shift -= bits<N>::rrb_bits)
+          {
+          for (uint32_t l = 0; l < n; ++l)
+            {
+            if (nodes[l] == nullptr)
+              continue;
+            const internal_node<T, atomic_ref_counting>* internal = (const internal_node<T, atomic_ref_counting>*)nodes[l];
+            const uint32_t i = internal->size_table.ptr == nullptr ? (uint32_t)(index[l] >> shift) & bits<N>::rrb_mask : sized_pos(internal, &index[l], shift);
+            nodes[l] = (const tree_node<T, atomic_ref_counting>*)internal->child[i].ptr;
+            // only the address of the child is known without waiting for it
+            prefetch(nodes[l]);
+            }
+          }
+        for (uint32_t l = 0; l < n; ++l)
+          {
+          if (nodes[l] != nullptr)
+            out[first + l] = ((const leaf_node<T, atomic_ref_counting>*)nodes[l])->child[index[l] & bits<N>::rrb_mask];
+          else
+            out[first + l] = in->tail->child[index[l] - tail_offset];
+          }
+        }
+      }
+#endif
+
+    } // namespace rrb_details
+
+  // Visits the leaves from the one holding element `from` on, see walk_leaves.
+  // Returns false if fn stopped the walk.
+  template <typename T, bool atomic_ref_counting, int N, typename Fn>
+  inline bool rrb_walk_leaves(const rrb<T, atomic_ref_counting, N>* in, rrb_index_type from, Fn& fn)
+    {
+    using namespace rrb_details;
+    const rrb_index_type tail_offset = in->cnt - in->tail_len;
+    if (from < tail_offset && !walk_leaves<T, atomic_ref_counting, N>(in->root.ptr, in->shift, from, 0, fn))
+      return false;
+    if (from >= in->cnt)
+      return true;
+    const uint32_t skip = from > tail_offset ? (uint32_t)(from - tail_offset) : 0;
+    return fn((const T*)in->tail->child + skip, in->tail_len - skip, tail_offset + skip);
+    }
+
+  // The index of the first element at or after `from` that equals value, or
+  // the element count if there is none.
+  template <typename T, bool atomic_ref_counting, int N>
+  inline rrb_index_type rrb_find(const rrb<T, atomic_ref_counting, N>* in, const T& value, rrb_index_type from)
+    {
+    using namespace rrb_details;
+    rrb_index_type result = in->cnt;
+    auto find = [&](const T* p, uint32_t len, rrb_index_type offset) -> bool
+      {
+      const size_t i = find_in_leaf(p, len, value, leaf_kernel<T>());
+      if (i == len)
+        return true;
+      result = offset + (rrb_index_type)i;
+      return false;
+      };
+    rrb_walk_leaves(in, from, find);
+    return result;
+    }
+
+  template <typename T, bool atomic_ref_counting, int N>
+  inline rrb_index_type rrb_count_value(const rrb<T, atomic_ref_counting, N>* in, const T& value)
+    {
+    using namespace rrb_details;
+    rrb_index_type count = 0;
+    auto count_leaf = [&](const T* p, uint32_t len, rrb_index_type) -> bool
+      {
+      count += (rrb_index_type)count_in_leaf(p, len, value, leaf_kernel<T>());
+      return true;
+      };
+    rrb_walk_leaves(in, 0, count_leaf);
+    return count;
+    }
+
+  // The index of the first element at or after `from` that equals one of
+  // values, or the element count if there is none.
+  template <typename T, bool atomic_ref_counting, int N>
+  inline rrb_index_type rrb_find_first_of(const rrb<T, atomic_ref_counting, N>* in, const T* values, size_t values_len, rrb_index_type from)
+    {
+    using namespace rrb_details;
+    rrb_index_type result = in->cnt;
+    auto find = [&](const T* p, uint32_t len, rrb_index_type offset) -> bool
+      {
+      const size_t i = find_first_of_in_leaf(p, len, values, values_len, leaf_kernel<T>());
+      if (i == len)
+        return true;
+      result = offset + (rrb_index_type)i;
+      return false;
+      };
+    rrb_walk_leaves(in, from, find);
+    return result;
+    }
+
+  // The index of the first occurrence of needle at or after `from`, or the
+  // element count if there is none.
+  template <typename T, bool atomic_ref_counting, int N>
+  inline rrb_index_type rrb_search(const rrb<T, atomic_ref_counting, N>* in, const T* needle, size_t needle_len, rrb_index_type from)
+    {
+    using namespace rrb_details;
+    if (from > in->cnt || needle_len > in->cnt - from)
+      return in->cnt;
+    if (needle_len == 0)
+      return from;
+    const rrb_index_type last_start = in->cnt - (rrb_index_type)needle_len;
+    rrb_index_type result = in->cnt;
+    auto search = [&](const T* p, uint32_t len, rrb_index_type offset) -> bool
+      {
+      for (uint32_t j = 0; j < len;)
+        {
+        j += (uint32_t)find_in_leaf(p + j, len - j, needle[0], leaf_kernel<T>());
+        if (j == len || offset + j > last_start)
+          return offset + j <= last_start;
+        if (matches_at(in, offset + j, p + j, len - j, needle, needle_len))
+          {
+          result = offset + j;
+          return false;
+          }
+        ++j;
+        }
+      return true;
+      };
+    rrb_walk_leaves(in, from, search);
+    return result;
+    }
+
+  // The index of the first element for which pred is false, for trees whose
+  // elements are partitioned by pred (all elements for which it is true come
+  // first), as std::partition_point. Instead of looking up O(log n) elements
+  // by index, it descends the tree once. In every node it binary searches the
+  // children by their first elements, which it reaches along the leftmost
+  // path of the child, and it ends with a binary search in one leaf.
+  template <typename T, bool atomic_ref_counting, int N, typename Pred>
+  inline rrb_index_type rrb_partition_point(const rrb<T, atomic_ref_counting, N>* in, Pred pred)
+    {
+    using namespace rrb_details;
+    const rrb_index_type tail_offset = in->cnt - in->tail_len;
+    const T* tail = in->tail->child;
+    if (in->root.ptr == nullptr || (in->tail_len > 0 && pred(tail[0])))
+      return tail_offset + (rrb_index_type)(std::partition_point(tail, tail + in->tail_len, pred) - tail);
+    const tree_node<T, atomic_ref_counting>* node = in->root.ptr;
+    rrb_index_type offset = 0;
+    for (uint32_t shift = in->shift; shift > 0; shift -= bits<N>::rrb_bits)
+      {
+      const internal_node<T, atomic_ref_counting>* internal = (const internal_node<T, atomic_ref_counting>*)node;
+      // the number of children whose first element satisfies pred
+      uint32_t lo = 0, hi = internal->len;
+      while (lo < hi)
+        {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        if (pred(first_element<T, atomic_ref_counting, N>((const tree_node<T, atomic_ref_counting>*)internal->child[mid].ptr, shift - bits<N>::rrb_bits)))
+          lo = mid + 1;
+        else
+          hi = mid;
+        }
+      // the partition point is in the last of those children, or at its end
+      const uint32_t i = lo == 0 ? 0 : lo - 1;
+      if (i > 0)
+        offset += internal->size_table.ptr != nullptr ? internal->size_table->size[i - 1] : (rrb_index_type)i << shift;
+      node = (const tree_node<T, atomic_ref_counting>*)internal->child[i].ptr;
+      }
+    const leaf_node<T, atomic_ref_counting>* leaf = (const leaf_node<T, atomic_ref_counting>*)node;
+    return offset + (rrb_index_type)(std::partition_point(leaf->child, leaf->child + leaf->len, pred) - leaf->child);
+    }
+
+  // Writes the elements at indices[0 .. count) to out[0 .. count), in the
+  // order of the indices. Instead of descending from the root for every
+  // index, it sorts the indices (with a radix sort, see rrb_sort.h) and
+  // descends once, visiting every node that holds requested elements once.
+  // Sorted indices are used as they are. With RRB_PREFETCH, unsorted indices
+  // are not sorted but gathered with interleaved descents instead.
+  template <typename T, bool atomic_ref_counting, int N>
+  inline void rrb_gather(const rrb<T, atomic_ref_counting, N>* in, const rrb_index_type* indices, size_t count, T* out)
+    {
+    using namespace rrb_details;
+    assert(std::all_of(indices, indices + count, [&](rrb_index_type index) { return index < in->cnt; }));
+    if (std::is_sorted(indices, indices + count))
+      {
+      sorted_gather g;
+      g.first = indices;
+      gather_sorted(in, indices, indices + count, g, out);
+      }
+#ifdef RRB_PREFETCH
+    // sorting would read the leaves in order, but write the output at random
+    else
+      gather_interleaved(in, indices, count, out);
+#else
+    // with fewer indices than leaves, sorting hardly shares any paths
+    else if (count < (size_t)(in->cnt >> N))
+      {
+      for (size_t i = 0; i < count; ++i)
+        out[i] = rrb_nth(in, indices[i]);
+      }
+    else if (sizeof(rrb_index_type) <= 4 && (uint64_t)count <= 0xffffffff)
+      {
+      std::vector<uint64_t> requests(count);
+      for (size_t i = 0; i < count; ++i)
+        requests[i] = ((uint64_t)indices[i] << 32) | i;
+      // the positions are in order already
+      radix_sort(requests, 4);
+      gather_sorted(in, requests.data(), requests.data() + count, packed_gather(), out);
+      }
+    else
+      {
+      std::vector<std::pair<rrb_index_type, size_t>> requests(count);
+      for (size_t i = 0; i < count; ++i)
+        requests[i] = std::make_pair(indices[i], i);
+      std::sort(requests.begin(), requests.end(), [](const std::pair<rrb_index_type, size_t>& a, const std::pair<rrb_index_type, size_t>& b) { return a.first < b.first; });
+      gather_sorted(in, requests.data(), requests.data() + count, pair_gather(), out);
+      }
+#endif
+    }
+
+  }
@@ -0,0 +1,187 @@
+
+/*
+ * Sorting helpers for vector::sorted and vector::stable_sorted.
+ *
+ * The elements are sorted in a flat buffer, from which the sorted vector is
+ * built bottom-up (see rrb_build.h). Comparison sorts split the buffer into
+ * one chunk per thread, sort the chunks concurrently and merge them pairwise
+ * in place, again concurrently. Since std::inplace_merge prefers the left
+ * range on ties, merging stably sorted chunks gives a stable sort.
+ *
+ * Integral elements that are sorted with std::less use an LSD radix sort
+ * instead, which is stable as well. Passes over bytes that are equal for all
+ * keys are skipped, so small keys in wide types only cost a few passes. With
+ * several threads, every thread counts the keys of its own chunk, and then
+ * scatters them to the slots that the counts of the chunks before it leave
+ * free in each bucket.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace immutable
+  {
+
+  namespace rrb_details
+    {
+
+    template <typename T, typename Compare>
+    struct use_radix_sort
+      {
+      enum
+        {
+        value = std::is_integral<T>::value && !std::is_same<T, bool>::value && std::is_same<Compare, std::less<T>>::value
+        };
+      };
+
+    // Maps signed keys to unsigned keys with the same order.
+    template <typename T>
+    inline typename std::make_unsigned<T>::type radix_key(T value)
+      {
+      typedef typename std::make_unsigned<T>::type key_type;
+      const key_type sign = std::is_signed<T>::value ? (key_type)((key_type)1 << (sizeof(T) * 8 - 1)) : 0;
+      return (key_type)value ^ sign;
+      }
+
+    // Calls fn(c) for every chunk c, each on its own thread.
+    template <typename Fn>
+    inline void run_chunks(size_t chunks, Fn fn)
+      {
+      std::vector<std::thread> pool;
+      for (size_t c = 1; c < chunks; ++c)
+        pool.emplace_back(fn, c);
+      fn(0);
+      for (auto& t : pool)
+        t.join();
+      }
+
+    // Sorts by the bytes from first_byte on, so keys whose low bytes are
+    // already in order (or do not matter) skip those passes.
+    template <typename T>
+    inline void radix_sort(std::vector<T>& values, uint32_t first_byte = 0, uint32_t threads = 1)
+      {
+      const size_t n = values.size();
+      if (n == 0)
+        return;
+      // below this size per chunk, threads cost more than they gain
+      const size_t min_chunk = 1 << 16;
+      const size_t chunks = std::max<size_t>(1, std::min<size_t>(threads, n / min_chunk));
+      std::vector<size_t> bounds(chunks + 1);
+      for (size_t c = 0; c <= chunks; ++c)
+        bounds[c] = n * c / chunks;
+      // the keys are integral, so the buffer needs no initialization
+      std::unique_ptr<T[]> buffer(new T[n]);
+      T* from = values.data();
+      T* to = buffer.get();
+      // the counts of chunk c, and then its first slot in every bucket
+      std::vector<size_t> offsets(chunks * 256);
+      for (uint32_t pass = first_byte; pass < sizeof(T); ++pass)
+        {
+        const uint32_t shift = pass * 8;
+        run_chunks(chunks, [&](size_t c)
+          {
+          size_t counts[256] = {};
+          const T* source = from;
+          for (size_t i = bounds[c], last = bounds[c + 1]; i < last; ++i)
+            ++counts[(radix_key(source[i]) >> shift) & 0xff];
+          std::copy(counts, counts + 256, offsets.data() + c * 256);
+          });
+        const uint32_t first_bucket = (radix_key(from[0]) >> shift) & 0xff;
+        size_t first_bucket_count = 0;
+        for (size_t c = 0; c < chunks; ++c)
+          first_bucket_count += offsets[c * 256 + first_bucket];
+        if (first_bucket_count == n)
+          continue;
+        size_t sum = 0;
+        for (uint32_t b = 0; b < 256; ++b)
+          {
+          for (size_t c = 0; c < chunks; ++c)
+            {
+            const size_t count = offsets[c * 256 + b];
+            offsets[c * 256 + b] = sum;
+            sum += count;
+            }
+          }
+        run_chunks(chunks, [&](size_t c)
+          {
+          size_t slots[256];
+          std::copy(offsets.data() + c * 256, offsets.data() + (c + 1) * 256, slots);
+          const T* source = from;
+          T* target = to;
+          for (size_t i = bounds[c], last = bounds[c + 1]; i < last; ++i)
+            target[slots[(radix_key(source[i]) >> shift) & 0xff]++] = source[i];
+          });
+        std::swap(from, to);
+        }
+      if (from != values.data())
+        std::copy(from, from + n, values.data());
+      }
+
+    template <typename T, typename Compare>
+    inline void parallel_sort(std::vector<T>& values, Compare cmp, bool stable, uint32_t threads)
+      {
+      const size_t n = values.size();
+      // below this size per chunk, threads cost more than they gain
+      const size_t min_chunk = 1 << 14;
+      size_t chunks = std::max<size_t>(1, std::min<size_t>(threads, n / min_chunk));
+      std::vector<size_t> bounds(chunks + 1);
+      for (size_t c = 0; c <= chunks; ++c)
+        bounds[c] = n * c / chunks;
+      run_chunks(chunks, [&](size_t c)
+        {
+        if (stable)
+          std::stable_sort(values.begin() + bounds[c], values.begin() + bounds[c + 1], cmp);
+        else
+          std::sort(values.begin() + bounds[c], values.begin() + bounds[c + 1], cmp);
+        });
+
+      // merging in place only needs T to be movable, not default constructible
+      while (chunks > 1)
+        {
+        const size_t merged_chunks = (chunks + 1) / 2;
+        run_chunks(merged_chunks, [&](size_t c)
+          {
+          const size_t first = bounds[2 * c];
+          const size_t middle = bounds[std::min(2 * c + 1, chunks)];
+          const size_t last = bounds[std::min(2 * c + 2, chunks)];
+          std::inplace_merge(values.begin() + first, values.begin() + middle, values.begin() + last, cmp);
+          });
+        for (size_t c = 0; c <= merged_chunks; ++c)
+          bounds[c] = bounds[std::min(2 * c, chunks)];
+        chunks = merged_chunks;
+        }
+      }
+
+    template <typename T, typename Compare>
+    inline void sort_values(std::vector<T>& values, Compare cmp, bool stable, uint32_t threads, std::true_type)
+      {
+      (void)cmp;
+      (void)stable;
+      if (values.size() < 256)
+        std::sort(values.begin(), values.end());
+      else
+        radix_sort(values, 0, threads);
+      }
+
+    template <typename T, typename Compare>
+    inline void sort_values(std::vector<T>& values, Compare cmp, bool stable, uint32_t threads, std::false_type)
+      {
+      parallel_sort(values, cmp, stable, threads);
+      }
+
+    template <typename T, typename Compare>
+    inline void sort_values(std::vector<T>& values, Compare cmp, bool stable, uint32_t threads)
+      {
+      sort_values(values, cmp, stable, threads, std::integral_constant<bool, use_radix_sort<T, Compare>::value>());
+      }
+
+    } // namespace rrb_details
+
+  }
@@ -0,0 +1,185 @@
+
+/*
+ * Line and code point queries on rrb-trees of UTF-8 text.
+ *
+ * Every node lazily caches the number of newlines and the number of UTF-8
+ * code points in its subtree, packed into one 64-bit word. The queries below
+ * descend from the root to a single leaf and only look at the cached counts
+ * of the siblings that they skip, so they take O(log n) time on trees whose
+ * counts were computed before. Editing a tree only creates new nodes along
+ * the edited paths, so the counts of all other nodes remain cached.
+ *
+ * A code point is counted at every byte that is not a continuation byte
+ * (10xxxxxx), so invalid sequences are counted byte by byte.
+ */
+
+#pragma once
+
+#include "rrb.h"
+
+namespace immutable
+  {
+
+  struct text_counts
+    {
+    rrb_index_type newlines;
+    rrb_index_type code_points;
+    };
+
+  template <bool atomic_ref_counting, int N>
+  text_counts rrb_text_counts(const ref<rrb<char, atomic_ref_counting, N>>& in);
+
+  template <bool atomic_ref_counting, int N>
+  text_counts rrb_text_prefix_counts(const ref<rrb<char, atomic_ref_counting, N>>& in, rrb_index_type offset);
+
+  template <bool atomic_ref_counting, int N>
+  rrb_index_type rrb_text_newline(const ref<rrb<char, atomic_ref_counting, N>>& in, rrb_index_type newline);
+
+  namespace rrb_details
+    {
+
+    enum : uint64_t { text_counts_cached = (uint64_t)1 << 63 };
+
+    inline void add_text_counts(text_counts& sum, const text_counts& c)
+      {
+      sum.newlines += c.newlines;
+      sum.code_points += c.code_points;
+      }
+
+    inline text_counts count_text(const char* first, const char* last)
+      {
+      text_counts c = { 0, 0 };
+      for (; first != last; ++first)
+        {
+        c.newlines += *first == '\n';
+        c.code_points += ((unsigned char)*first & 0xc0) != 0x80;
+        }
+      return c;
+      }
+
+    // Counts that do not fit into 31 + 32 bits are not cached, which can only
+    // happen near the root of trees with 64-bit indices.
+    inline uint64_t pack_text_counts(const text_counts& c)
+      {
+      if ((uint64_t)c.newlines >= ((uint64_t)1 << 31) || (uint64_t)c.code_points >= ((uint64_t)1 << 32))
+        return 0;
+      return text_counts_cached | ((uint64_t)c.newlines << 32) | (uint64_t)c.code_points;
+      }
+
+    inline text_counts unpack_text_counts(uint64_t packed)
+      {
+      text_counts c;
+      c.newlines = (rrb_index_type)((packed & ~(uint64_t)text_counts_cached) >> 32);
+      c.code_points = (rrb_index_type)(packed & 0xffffffffull);
+      return c;
+      }
+
+    struct text_summary
+      {
+      typedef text_counts value_type;
+
+      static text_counts leaf(const char* first, const char* last)
+        {
+        return count_text(first, last);
+        }
+
+      static void add(text_counts& sum, const text_counts& c)
+        {
+        add_text_counts(sum, c);
+        }
+
+      static uint64_t pack(const text_counts& c)
+        {
+        return pack_text_counts(c);
+        }
+
+      static text_counts unpack(uint64_t packed)
+        {
+        return unpack_text_counts(packed);
+        }
+      };
+
+    template <bool atomic_ref_counting, int N>
+    inline text_counts subtree_text_counts(const tree_node<char, atomic_ref_counting>* node, uint32_t shift)
+      {
+      return subtree_summary<text_summary, char, atomic_ref_counting, N>(node, shift);
+      }
+
+    } // namespace rrb_details
+
+  // The counts of the whole text.
+  template <bool atomic_ref_counting, int N>
+  inline text_counts rrb_text_counts(const ref<rrb<char, atomic_ref_counting, N>>& in)
+    {
+    using namespace rrb_details;
+    text_counts c = count_text(in->tail->child, in->tail->child + in->tail_len);
+    if (in->root.ptr != nullptr)
+      add_text_counts(c, subtree_text_counts<atomic_ref_counting, N>(in->root.ptr, in->shift));
+    return c;
+    }
+
+  // The counts of the first `offset` bytes, offset <= count.
+  template <bool atomic_ref_counting, int N>
+  inline text_counts rrb_text_prefix_counts(const ref<rrb<char, atomic_ref_counting, N>>& in, rrb_index_type offset)
+    {
+    using namespace rrb_details;
+    assert(offset <= in->cnt);
+    text_counts c = { 0, 0 };
+    const rrb_index_type tail_offset = in->cnt - in->tail_len;
+    if (tail_offset <= offset)
+      {
+      if (in->root.ptr != nullptr)
+        c = subtree_text_counts<atomic_ref_counting, N>(in->root.ptr, in->shift);
+      add_text_counts(c, count_text(in->tail->child, in->tail->child + (offset - tail_offset)));
+      return c;
+      }
+    const leaf_node<char, atomic_ref_counting>* leaf = descend_to_index<char, atomic_ref_counting, N>(in->root.ptr, in->shift, offset,
+      [&c](const tree_node<char, atomic_ref_counting>* child, uint32_t child_shift)
+        {
+        add_text_counts(c, subtree_text_counts<atomic_ref_counting, N>(child, child_shift));
+        });
+    add_text_counts(c, count_text(leaf->child, leaf->child + offset));
+    return c;
+    }
+
+  // The offset of the newline-th newline, counting from 1, or the element
+  // count if the text has fewer newlines.
+  template <bool atomic_ref_counting, int N>
+  inline rrb_index_type rrb_text_newline(const ref<rrb<char, atomic_ref_counting, N>>& in, rrb_index_type newline)
+    {
+    using namespace rrb_details;
+    assert(newline > 0);
+    rrb_index_type offset = 0;
+    const char* first;
+    uint32_t len;
+    const text_counts root_counts = in->root.ptr == nullptr ? text_counts{ 0, 0 } : subtree_text_counts<atomic_ref_counting, N>(in->root.ptr, in->shift);
+    if (newline > root_counts.newlines)
+      {
+      newline -= root_counts.newlines;
+      offset = in->cnt - in->tail_len;
+      first = in->tail->child;
+      len = in->tail_len;
+      }
+    else
+      {
+      const leaf_node<char, atomic_ref_counting>* leaf = descend_by_summary<char, atomic_ref_counting, N>(in->root.ptr, in->shift, offset,
+        [&newline](const tree_node<char, atomic_ref_counting>* child, uint32_t child_shift, rrb_index_type)
+          {
+          const rrb_index_type newlines = subtree_text_counts<atomic_ref_counting, N>(child, child_shift).newlines;
+          if (newline <= newlines)
+            return true;
+          newline -= newlines;
+          return false;
+          });
+      first = leaf->child;
+      len = leaf->len;
+      }
+    for (uint32_t i = 0; i < len; ++i)
+      {
+      if (first[i] == '\n' && --newline == 0)
+        return offset + i;
+      }
+    return in->cnt;
+    }
+
+  }
@@ -43,31 +43,69 @@ namespace immutable
   ref<rrb<T, atomic_ref_counting, N>> transient_to_rrb(const ref<transient_rrb<T, atomic_ref_counting, N>>& trrb);
 
   template <typename T, bool atomic_ref_counting, int N>
-  ref<transient_rrb<T, atomic_ref_counting, N>> transient_rrb_update(const ref<transient_rrb<T, atomic_ref_counting, N>>& trrb, uint32_t index, T element);
+  ref<transient_rrb<T, atomic_ref_counting, N>> transient_rrb_update(const ref<transient_rrb<T, atomic_ref_counting, N>>& trrb, rrb_index_type index, T element);
 
   template <typename T, bool atomic_ref_counting, int N>
   ref<transient_rrb<T, atomic_ref_counting, N>> transient_rrb_push(ref<transient_rrb<T, atomic_ref_counting, N>>& trrb, T element);
 
   template <typename T, bool atomic_ref_counting, int N>
-  const T& transient_rrb_nth(const ref<transient_rrb<T, atomic_ref_counting, N>>& trrb, uint32_t index);
+  const T& transient_rrb_nth(const ref<transient_rrb<T, atomic_ref_counting, N>>& trrb, rrb_index_type index);
 
   template <typename T, bool atomic_ref_counting, int N>
   const T& transient_rrb_peek(const ref<transient_rrb<T, atomic_ref_counting, N>>& trrb);
 
   template <typename T, bool atomic_ref_counting, int N>
-  uint32_t transient_rrb_count(const ref<transient_rrb<T, atomic_ref_counting, N>>& trrb);
+  rrb_index_type transient_rrb_count(const ref<transient_rrb<T, atomic_ref_counting, N>>& trrb);
 
   template <typename T, bool atomic_ref_counting, int N>
   ref<transient_rrb<T, atomic_ref_counting, N>> transient_rrb_pop(ref<transient_rrb<T, atomic_ref_counting, N>>& trrb);
 
+  template <typename T, int N>
+  struct transient_rrb_part;
+
+  template <typename T, int N>
+  std::vector<transient_rrb_part<T, N>> transient_rrb_split(const ref<transient_rrb<T, true, N>>& trrb, uint32_t parts);
+
+  template <typename T, int N>
+  void transient_rrb_join(const ref<transient_rrb<T, true, N>>& trrb, std::vector<transient_rrb_part<T, N>>& parts);
+
+  template <typename T, bool atomic_ref_counting, int N>
+  ref<rrb<T, atomic_ref_counting, N>> rrb_concat_all(const ref<rrb<T, atomic_ref_counting, N>>* first, const ref<rrb<T, atomic_ref_counting, N>>* last, uint32_t threads = 1);
+
   namespace rrb_details
     {
 
-    static std::atomic<guid_type> g_guid{ 1 };
+    enum : guid_type { guid_block_size = 1 << 16 };
 
+    // The next block of guids that a thread can hand out. Guid 0 marks nodes
+    // that belong to no transient, so the first block starts at 1.
+    inline std::atomic<guid_type>& next_guid_block()
+      {
+      static std::atomic<guid_type> next{ 1 };
+      return next;
+      }
+
+    // Every thread takes guids from its own block, so creating transients on
+    // many threads does not contend on one shared counter.
     inline guid_type rrb_guid_create()
       {
-      return g_guid.fetch_add(1, std::memory_order_relaxed);
+      static thread_local guid_type next = 0;
+      static thread_local guid_type end = 0;
+      if (next == end)
+        {
+        next = next_guid_block().fetch_add(guid_block_size, std::memory_order_relaxed);
+        end = next + guid_block_size;
+        }
+      return next++;
+      }
+
+    // see destroy(const rrb<T, atomic_ref_counting, N>*)
+    template <typename T, bool atomic_ref_counting, int N>
+    RRB_NOINLINE inline void destroy(const transient_rrb<T, atomic_ref_counting, N>* p_node)
+      {
+      release(p_node->tail.ptr);
+      release<T>(p_node->root.ptr);
+      free((void*)p_node);
       }
 
     template <typename T, int N>
@@ -76,11 +114,7 @@ namespace immutable
       if (p_node)
         {
         if (1 == p_node->_ref_count.fetch_sub(1, std::memory_order_acq_rel))
-          {
-          release(p_node->tail.ptr);
-          release<T>(p_node->root.ptr);
-          free((void*)p_node);
-          }
+          destroy(p_node);
         }
       }
 
@@ -90,11 +124,7 @@ namespace immutable
       if (p_node)
         {
         if (1 == p_node->_ref_count--)
-          {
-          release(p_node->tail.ptr);
-          release<T>(p_node->root.ptr);
-          free((void*)p_node);
-          }
+          destroy(p_node);
         }
       }
 
@@ -115,8 +145,8 @@ namespace immutable
     template <int N, bool atomic_ref_counting>
     inline rrb_size_table<atomic_ref_counting>* transient_size_table_create()
       {
-      rrb_size_table<atomic_ref_counting>* table = (rrb_size_table<atomic_ref_counting>*)malloc(sizeof(rrb_size_table<atomic_ref_counting>) + bits<N>::rrb_branching * sizeof(uint32_t));
-      table->size = (uint32_t*)((char*)table + sizeof(rrb_size_table<atomic_ref_counting>));
+      rrb_size_table<atomic_ref_counting>* table = (rrb_size_table<atomic_ref_counting>*)malloc(sizeof(rrb_size_table<atomic_ref_counting>) + bits<N>::rrb_branching * sizeof(rrb_index_type));
+      table->size = (rrb_index_type*)((char*)table + sizeof(rrb_size_table<atomic_ref_counting>));
       return table;
       }
 
@@ -125,6 +155,7 @@ namespace immutable
       {
       transient_rrb<T, atomic_ref_counting, N>* trrb = (transient_rrb<T, atomic_ref_counting, N>*)malloc(sizeof(transient_rrb<T, atomic_ref_counting, N>));
       memcpy(trrb, original, sizeof(rrb<T, atomic_ref_counting, N>));
+      trrb->flags = 0;
       trrb->root.inc();
       trrb->tail.inc();
       trrb->owner = std::this_thread::get_id();
@@ -138,6 +169,7 @@ namespace immutable
       leaf->len = 0;
       leaf->type = LEAF_NODE;
       leaf->child = (T*)((char*)leaf + sizeof(leaf_node<T, atomic_ref_counting>));
+      reset_caches(leaf);
       return leaf;
       }
 
@@ -150,6 +182,7 @@ namespace immutable
       node->size_table.ptr = nullptr;
       node->len = 0;
       memset(node->child, 0, bits<N>::rrb_branching * sizeof(ref<internal_node<T, atomic_ref_counting>>)); // init pointers to zero      
+      reset_caches(node);
       return node;
       }
 
@@ -177,15 +210,16 @@ namespace immutable
       for (uint32_t i = 0; i < original->len; ++i)
         clone->child[i] = original->child[i]; // don't memcpy, but use copy constructor
       clone->guid = guid;
+      reset_caches(clone);
       return clone;
       }
 
     template <int N, bool atomic_ref_counting>
     inline rrb_size_table<atomic_ref_counting>* transient_size_table_clone(const rrb_size_table<atomic_ref_counting>* original, uint32_t len, guid_type guid)
       {
-      rrb_size_table<atomic_ref_counting>* clone = (rrb_size_table<atomic_ref_counting>*)malloc(sizeof(rrb_size_table<atomic_ref_counting>) + bits<N>::rrb_branching * sizeof(uint32_t));
-      clone->size = (uint32_t*)((char*)clone + sizeof(rrb_size_table<atomic_ref_counting>));
-      memcpy(clone->size, original->size, sizeof(uint32_t) * len);
+      rrb_size_table<atomic_ref_counting>* clone = (rrb_size_table<atomic_ref_counting>*)malloc(sizeof(rrb_size_table<atomic_ref_counting>) + bits<N>::rrb_branching * sizeof(rrb_index_type));
+      clone->size = (rrb_index_type*)((char*)clone + sizeof(rrb_size_table<atomic_ref_counting>));
+      memcpy(clone->size, original->size, sizeof(rrb_index_type) * len);
       clone->guid = guid;
       return clone;
       }
@@ -259,7 +293,7 @@ namespace immutable
       guid_type guid = trrb->guid;
       ref<internal_node<T, atomic_ref_counting>> current = trrb->root;
       ref<internal_node<T, atomic_ref_counting>>* to_set = (ref<internal_node<T, atomic_ref_counting>>*)&trrb->root;
-      uint32_t index = trrb->cnt - 2;
+      rrb_index_type index = trrb->cnt - 2;
       uint32_t shift = trrb->shift;
 
       // mutate all non-leaf nodes first. Happens when shift > RRB_BRANCHING
@@ -278,8 +312,9 @@ namespace immutable
 
         if (current->size_table.ptr != nullptr)
           {
-          // Ensure size table is editable too
-          ensure_size_table_editable<T, atomic_ref_counting, N>(current->size_table, current->len, guid);
+          // Ensure size table is editable too. If we just widened the node, the
+          // original table only has len - 1 valid entries.
+          ensure_size_table_editable<T, atomic_ref_counting, N>(current->size_table, i == k ? current->len - 1 : current->len, guid);
           if (i != k)
             {
             // Tail will always be 32 long, otherwise we insert a single element only
@@ -294,7 +329,7 @@ namespace immutable
         uint32_t child_index;
         if (current->size_table.ptr == nullptr)
           {
-          child_index = (index >> shift) & bits<N>::rrb_mask;
+          child_index = (uint32_t)(index >> shift) & bits<N>::rrb_mask;
           }
         else {
           // no need for sized_pos here, luckily.
@@ -384,12 +419,13 @@ namespace immutable
   template <typename T, bool atomic_ref_counting=true, int N = 5>
   struct transient_rrb
     {
-    uint32_t cnt;
+    rrb_index_type cnt;
     uint32_t shift;
     uint32_t tail_len;
     ref<rrb_details::leaf_node<T, atomic_ref_counting>> tail;
     ref<rrb_details::tree_node<T, atomic_ref_counting>> root;
     mutable std::atomic<uint32_t> _ref_count;
+    uint32_t flags;
     rrb_details::guid_type guid;
     std::thread::id owner;
     };
@@ -397,12 +433,13 @@ namespace immutable
   template <typename T, int N>
   struct transient_rrb<T, false, N>
     {
-    uint32_t cnt;
+    rrb_index_type cnt;
     uint32_t shift;
     uint32_t tail_len;
     ref<rrb_details::leaf_node<T, false>> tail;
     ref<rrb_details::tree_node<T, false>> root;
     mutable uint32_t _ref_count;
+    uint32_t flags;
     rrb_details::guid_type guid;
     std::thread::id owner;
     };
@@ -432,13 +469,13 @@ namespace immutable
   // nodes if it's safe to do so (replacing clone calls with ensure_editable
   // calls)
   template <typename T, bool atomic_ref_counting, int N>
-  inline ref<transient_rrb<T, atomic_ref_counting, N>> transient_rrb_update(const ref<transient_rrb<T, atomic_ref_counting, N>>& trrb, uint32_t index, T element)
+  inline ref<transient_rrb<T, atomic_ref_counting, N>> transient_rrb_update(const ref<transient_rrb<T, atomic_ref_counting, N>>& trrb, rrb_index_type index, T element)
     {
     using namespace rrb_details;
     assert(index < trrb->cnt);
     check_transience(trrb);
     guid_type guid = trrb->guid;
-    const uint32_t tail_offset = trrb->cnt - trrb->tail_len;
+    const rrb_index_type tail_offset = trrb->cnt - trrb->tail_len;
     if (tail_offset <= index)
       {
       trrb->tail->child[index - tail_offset] = std::move(element);
@@ -454,7 +491,7 @@ namespace immutable
       uint32_t child_index;
       if (current->size_table.ptr == nullptr)
         {
-        child_index = (index >> shift) & bits<N>::rrb_mask;
+        child_index = (uint32_t)(index >> shift) & bits<N>::rrb_mask;
         }
       else
         {
@@ -515,7 +552,7 @@ namespace immutable
     // TODO: Can find last rightmost jump in constant time for pvec subvecs:
     // use the fact that (index & large_mask) == 1 << (RRB_BITS * H) - 1 -> 0 etc.
 
-    uint32_t index = trrb->cnt - 2;
+    rrb_index_type index = trrb->cnt - 2;
 
     uint32_t nodes_to_mutate = 0;
     uint32_t nodes_visited = 0;
@@ -542,10 +579,10 @@ namespace immutable
           nodes_visited++; // this could possibly be done earlier in the code.
           goto mutable_count_end;
           }
-        child_index = (index >> shift) & bits<N>::rrb_mask;
+        child_index = (uint32_t)(index >> shift) & bits<N>::rrb_mask;
         // index filtering is not necessary when the check above is performed at
         // most once.
-        index &= ~(bits<N>::rrb_mask << shift);
+        index &= ~((rrb_index_type)bits<N>::rrb_mask << shift);
         }
       else
         {
@@ -646,7 +683,7 @@ namespace immutable
     }
 
   template <typename T, bool atomic_ref_counting, int N>
-  inline const T& transient_rrb_nth(const ref<transient_rrb<T, atomic_ref_counting, N>>& trrb, uint32_t index)
+  inline const T& transient_rrb_nth(const ref<transient_rrb<T, atomic_ref_counting, N>>& trrb, rrb_index_type index)
     {
     using namespace rrb_details;
     check_transience(trrb);
@@ -662,7 +699,7 @@ namespace immutable
     }
 
   template <typename T, bool atomic_ref_counting, int N>
-  inline uint32_t transient_rrb_count(const ref<transient_rrb<T, atomic_ref_counting, N>>& trrb)
+  inline rrb_index_type transient_rrb_count(const ref<transient_rrb<T, atomic_ref_counting, N>>& trrb)
     {
     using namespace rrb_details;
     check_transience(trrb);
@@ -698,4 +735,267 @@ namespace immutable
       return trrb;
       }
     }
+  
+  // Concatenates all rrb-trees in [first, last). Consecutive small trees are
+  // pushed into one transient, so that they end up in dense leaves instead of
+  // being concatenated one by one. The remaining pieces are concatenated
+  // pairwise, in a balanced way, which keeps the intermediate trees shallow.
+  // The pairs of each round are concatenated on up to `threads` threads (0
+  // uses one thread per core).
+  template <typename T, bool atomic_ref_counting, int N>
+  inline ref<rrb<T, atomic_ref_counting, N>> rrb_concat_all(const ref<rrb<T, atomic_ref_counting, N>>* first, const ref<rrb<T, atomic_ref_counting, N>>* last, uint32_t threads)
+    {
+    using namespace rrb_details;
+    threads = thread_count(threads);
+    // Pushing a tree of this size element by element costs about as much as
+    // the leaf rebalancing that concat_sub_tree might need for it.
+    const uint32_t small_size = bits<N>::rrb_branching * bits<N>::rrb_branching;
+    std::vector<ref<rrb<T, atomic_ref_counting, N>>> pieces;
+    pieces.reserve(last - first);
+    ref<transient_rrb<T, atomic_ref_counting, N>> run(nullptr);
+    for (; first != last; ++first)
+      {
+      const ref<rrb<T, atomic_ref_counting, N>>& piece = *first;
+      if (piece->cnt == 0)
+        continue;
+      if (piece->cnt > small_size)
+        {
+        if (run.ptr != nullptr)
+          {
+          pieces.push_back(transient_to_rrb(run));
+          run = nullptr;
+          }
+        pieces.push_back(piece);
+        continue;
+        }
+      if (run.ptr == nullptr)
+        {
+        run = rrb_to_transient(piece);
+        continue;
+        }
+      for (rrb_index_type i = 0; i < piece->cnt;)
+        {
+        std::tuple<const T*, rrb_index_type, rrb_index_type> region = rrb_region_for(piece, i);
+        const T* elements = std::get<0>(region) + (i - std::get<1>(region));
+        const rrb_index_type region_end = std::get<2>(region);
+        for (; i < region_end; ++i, ++elements)
+          transient_rrb_push(run, *elements);
+        }
+      }
+    if (run.ptr != nullptr)
+      pieces.push_back(transient_to_rrb(run));
+    if (pieces.empty())
+      return rrb_create<T, atomic_ref_counting, N>();
+    // The concatenations of one round are independent, but pieces may share
+    // nodes, so they can only run concurrently with atomic reference counts.
+    if (!atomic_ref_counting)
+      threads = 1;
+    while (pieces.size() > 1)
+      {
+      const size_t pairs = pieces.size() / 2;
+      std::vector<ref<rrb<T, atomic_ref_counting, N>>> results(pairs);
+      auto concat_pairs = [&](size_t first_pair, size_t last_pair)
+        {
+        for (size_t p = first_pair; p < last_pair; ++p)
+          results[p] = rrb_concat(pieces[2 * p], pieces[2 * p + 1]);
+        };
+      const size_t workers = std::max<size_t>(1, std::min<size_t>(threads, pairs));
+      std::vector<std::thread> pool;
+      for (size_t w = 1; w < workers; ++w)
+        pool.emplace_back(concat_pairs, pairs * w / workers, pairs * (w + 1) / workers);
+      concat_pairs(0, pairs / workers);
+      for (auto& t : pool)
+        t.join();
+      if (pieces.size() & 1)
+        results.push_back(pieces.back());
+      pieces.swap(results);
+      }
+    return pieces.front();
+    }
+
+
+  /**
+   * A part of a split transient. It shares the guid of the transient that it
+   * was split from, but may only access the elements in [begin, end). These
+   * lie in subtrees that no other part touches, and the part has its own copy
+   * of the nodes above them, so different threads can update different parts
+   * at the same time. The transient takes the owner of a part over on its
+   * first update.
+   */
+  template <typename T, int N>
+  struct transient_rrb_part
+    {
+    ref<transient_rrb<T, true, N>> trrb;
+    rrb_index_type begin;
+    rrb_index_type end;
+    // the shift of the nodes whose children were divided over the parts
+    uint32_t split_shift;
+    };
+
+  namespace rrb_details
+    {
+
+    // The first index of child i of node, relative to the first index of node.
+    template <typename T, int N>
+    inline rrb_index_type child_offset(const internal_node<T, true>* node, uint32_t i, uint32_t shift)
+      {
+      if (i == 0)
+        return 0;
+      return node->size_table.ptr != nullptr ? node->size_table->size[i - 1] : (rrb_index_type)i << shift;
+      }
+
+    // Appends the first indices of the children of the nodes at split_shift
+    // below node, which starts at offset.
+    template <typename T, int N>
+    inline void split_subtree_starts(const internal_node<T, true>* node, uint32_t shift, uint32_t split_shift, rrb_index_type offset, std::vector<rrb_index_type>& starts)
+      {
+      for (uint32_t i = 0; i < node->len; ++i)
+        {
+        const rrb_index_type start = offset + child_offset<T, N>(node, i, shift);
+        if (shift == split_shift)
+          starts.push_back(start);
+        else
+          split_subtree_starts<T, N>((const internal_node<T, true>*)node->child[i].ptr, shift - bits<N>::rrb_bits, split_shift, start, starts);
+        }
+      }
+
+    // Replaces the nodes above split_shift that overlap [begin, end) by
+    // copies, so that updates in [begin, end) only write to these copies and
+    // to the subtrees below them. node covers [offset, node_end).
+    template <typename T, int N>
+    inline void copy_part_path(ref<internal_node<T, true>>& node, uint32_t shift, uint32_t split_shift, rrb_index_type offset, rrb_index_type node_end, rrb_index_type begin, rrb_index_type end, guid_type guid)
+      {
+      node = transient_internal_node_clone<T, true, N>(node.ptr, guid);
+      if (shift == split_shift)
+        return;
+      for (uint32_t i = 0; i < node->len; ++i)
+        {
+        const rrb_index_type child_begin = offset + child_offset<T, N>(node.ptr, i, shift);
+        const rrb_index_type child_end = i + 1 < node->len ? offset + child_offset<T, N>(node.ptr, i + 1, shift) : node_end;
+        if (child_begin < end && begin < child_end)
+          copy_part_path<T, N>(node->child[i], shift - bits<N>::rrb_bits, split_shift, child_begin, child_end, begin, end, guid);
+        }
+      }
+
+    // Moves the subtrees in [begin, end) that part has updated into target.
+    template <typename T, int N>
+    inline void join_part_path(ref<internal_node<T, true>>& target, const internal_node<T, true>* part, uint32_t shift, uint32_t split_shift, rrb_index_type offset, rrb_index_type node_end, rrb_index_type begin, rrb_index_type end, guid_type guid)
+      {
+      ensure_internal_editable<T, true, N>(target, guid);
+      for (uint32_t i = 0; i < target->len; ++i)
+        {
+        const rrb_index_type child_begin = offset + child_offset<T, N>(target.ptr, i, shift);
+        const rrb_index_type child_end = i + 1 < target->len ? offset + child_offset<T, N>(target.ptr, i + 1, shift) : node_end;
+        if (child_end <= begin || end <= child_begin)
+          continue;
+        if (shift == split_shift)
+          target->child[i] = part->child[i];
+        else
+          join_part_path<T, N>(target->child[i], part->child[i].ptr, shift - bits<N>::rrb_bits, split_shift, child_begin, child_end, begin, end, guid);
+        }
+      }
+
+    } // namespace rrb_details
+
+  // Splits trrb into at most `parts` parts. The parts are cut between the
+  // subtrees of the highest level that has at least `parts` of them, or
+  // between leaves if no level has that many. The last part also holds the
+  // tail. trrb cannot be used until the parts are joined again. Only trees
+  // with atomic reference counting can be split, because parts may clone
+  // nodes that they share with other parts.
+  template <typename T, int N>
+  inline std::vector<transient_rrb_part<T, N>> transient_rrb_split(const ref<transient_rrb<T, true, N>>& trrb, uint32_t parts)
+    {
+    using namespace rrb_details;
+    check_transience(trrb);
+    const rrb_index_type tail_offset = trrb->cnt - trrb->tail_len;
+    std::vector<rrb_index_type> bounds(1, 0);
+    uint32_t split_shift = trrb->shift;
+    if (trrb->shift > 0)
+      {
+      const internal_node<T, true>* root = (const internal_node<T, true>*)trrb->root.ptr;
+      std::vector<rrb_index_type> starts;
+      for (;; split_shift -= bits<N>::rrb_bits)
+        {
+        starts.clear();
+        split_subtree_starts<T, N>(root, trrb->shift, split_shift, 0, starts);
+        if (starts.size() >= parts || split_shift == bits<N>::rrb_bits)
+          break;
+        }
+      parts = std::max<uint32_t>(1, std::min<uint32_t>(parts, (uint32_t)starts.size()));
+      for (uint32_t p = 1; p < parts; ++p)
+        bounds.push_back(starts[(size_t)starts.size() * p / parts]);
+      }
+    bounds.push_back(trrb->cnt);
+    std::vector<transient_rrb_part<T, N>> result(bounds.size() - 1);
+    for (size_t p = 0; p + 1 < bounds.size(); ++p)
+      {
+      result[p].trrb = transient_rrb_head_create((const rrb<T, true, N>*)trrb.ptr);
+      result[p].trrb->guid = trrb->guid;
+      result[p].trrb->owner = std::thread::id();
+      result[p].begin = bounds[p];
+      result[p].end = bounds[p + 1];
+      result[p].split_shift = split_shift;
+      if (trrb->shift > 0 && bounds[p] < tail_offset)
+        {
+        ref<internal_node<T, true>> root = result[p].trrb->root;
+        copy_part_path<T, N>(root, trrb->shift, split_shift, 0, tail_offset, bounds[p], std::min(bounds[p + 1], tail_offset), trrb->guid);
+        result[p].trrb->root = root;
+        }
+      }
+    trrb->owner = std::thread::id();
+    return result;
+    }
+
+  namespace rrb_details
+    {
+
+    template <typename T, int N>
+    inline const ref<transient_rrb<T, true, N>>& adopt_transient_part(const transient_rrb_part<T, N>& part, rrb_index_type index)
+      {
+      if (index < part.begin || index >= part.end)
+        throw std::out_of_range("index outside of the transient part");
+      if (part.trrb->owner == std::thread::id())
+        part.trrb->owner = std::this_thread::get_id();
+      return part.trrb;
+      }
+
+    } // namespace rrb_details
+
+  template <typename T, int N>
+  inline const T& transient_rrb_part_nth(const transient_rrb_part<T, N>& part, rrb_index_type index)
+    {
+    return transient_rrb_nth(rrb_details::adopt_transient_part(part, index), index);
+    }
+
+  template <typename T, int N>
+  inline void transient_rrb_part_update(transient_rrb_part<T, N>& part, rrb_index_type index, T element)
+    {
+    transient_rrb_update(rrb_details::adopt_transient_part(part, index), index, std::move(element));
+    }
+
+  // Joins the parts that trrb was split into. All threads must be done with
+  // the parts, which are emptied.
+  template <typename T, int N>
+  inline void transient_rrb_join(const ref<transient_rrb<T, true, N>>& trrb, std::vector<transient_rrb_part<T, N>>& parts)
+    {
+    using namespace rrb_details;
+    const rrb_index_type tail_offset = trrb->cnt - trrb->tail_len;
+    for (transient_rrb_part<T, N>& part : parts)
+      {
+      // parts never replace the tail, they only edit it
+      assert(part.trrb->tail.ptr == trrb->tail.ptr);
+      if (trrb->shift > 0 && part.begin < tail_offset)
+        {
+        ref<internal_node<T, true>> root = trrb->root;
+        join_part_path<T, N>(root, (const internal_node<T, true>*)part.trrb->root.ptr, trrb->shift, part.split_shift, 0, tail_offset, part.begin, std::min(part.end, tail_offset), trrb->guid);
+        trrb->root = root;
+        }
+      part.trrb->guid = 0;
+      part.trrb = nullptr;
+      }
+    parts.clear();
+    trrb->owner = std::this_thread::get_id();
+    }
+
   }
@@ -0,0 +1,286 @@
+
+/*
+ * Persistent ordered sets and maps on top of the immutable vector.
+ *
+ * A sorted_vector keeps its elements sorted by Compare, without duplicates.
+ * Lookups descend the tree once (see rrb_partition_point in rrb_search.h)
+ * instead of binary searching with O(log n) calls of operator[], each of
+ * which descends the tree again. Insertions and removals find their position
+ * the same way, and then insert or erase that one element.
+ *
+ * merge takes the union of two sets. When one set is much smaller than the
+ * other, the runs of the larger set between the elements of the smaller one
+ * are taken over as slices, so merging k elements into n takes
+ * O(k log n) time instead of O(n).
+ *
+ * A sorted_map keeps key-value pairs sorted by their keys in the same way.
+ */
+
+#pragma once
+
+#include "vector.h"
+
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace immutable
+  {
+
+  template <typename T, typename Compare = std::less<T>, bool atomic_ref_counting = true, int N = 5>
+  class sorted_vector
+    {
+    public:
+      using vector_type = vector<T, atomic_ref_counting, N>;
+      using value_type = T;
+      using size_type = rrb_index_type;
+      using iterator = typename vector_type::iterator;
+      using const_iterator = iterator;
+
+      explicit sorted_vector(Compare cmp = Compare()) : _cmp(cmp)
+        {
+        }
+
+      // sorts the elements and drops the duplicates
+      template <typename Iterator, typename = typename std::iterator_traits<Iterator>::iterator_category>
+      sorted_vector(Iterator first, Iterator last, Compare cmp = Compare()) : _cmp(cmp)
+        {
+        std::vector<T> elements(first, last);
+        std::sort(elements.begin(), elements.end(), _cmp);
+        elements.erase(std::unique(elements.begin(), elements.end(), [&](const T& a, const T& b) { return !_cmp(a, b) && !_cmp(b, a); }), elements.end());
+        _values = vector_type(elements.begin(), elements.end());
+        }
+
+      sorted_vector(std::initializer_list<T> values, Compare cmp = Compare()) : sorted_vector(values.begin(), values.end(), cmp)
+        {
+        }
+
+      iterator begin() const
+        {
+        return _values.begin();
+        }
+
+      iterator end() const
+        {
+        return _values.end();
+        }
+
+      bool empty() const
+        {
+        return _values.empty();
+        }
+
+      size_type size() const
+        {
+        return _values.size();
+        }
+
+      const T& operator [] (size_type index) const
+        {
+        return _values[index];
+        }
+
+      // the index of the first element that is not less than value
+      size_type lower_bound(const T& value) const
+        {
+        return rrb_partition_point(_values.raw().ptr, [&](const T& element) { return _cmp(element, value); });
+        }
+
+      // the index of the first element that is greater than value
+      size_type upper_bound(const T& value) const
+        {
+        return rrb_partition_point(_values.raw().ptr, [&](const T& element) { return !_cmp(value, element); });
+        }
+
+      // the index of value, or size() if it is not in the set
+      size_type find(const T& value) const
+        {
+        const size_type index = lower_bound(value);
+        return index < size() && !_cmp(value, _values[index]) ? index : size();
+        }
+
+      bool contains(const T& value) const
+        {
+        return find(value) != size();
+        }
+
+      sorted_vector insert(const T& value) const
+        {
+        const size_type index = lower_bound(value);
+        if (index < size() && !_cmp(value, _values[index]))
+          return *this;
+        return sorted_vector(_values.insert(index, value), _cmp);
+        }
+
+      sorted_vector erase(const T& value) const
+        {
+        const size_type index = find(value);
+        if (index == size())
+          return *this;
+        return sorted_vector(_values.erase(index), _cmp);
+        }
+
+      // the union of both sets
+      sorted_vector merge(const sorted_vector& other) const
+        {
+        const sorted_vector& large = size() >= other.size() ? *this : other;
+        const sorted_vector& small = size() >= other.size() ? other : *this;
+        if (small.empty())
+          return large;
+        // bits in the size, an estimate of log2 of the cost of one insertion
+        uint32_t log_size = 1;
+        while ((large.size() >> log_size) != 0)
+          ++log_size;
+        if ((uint64_t)small.size() * log_size * 4 < large.size())
+          return large._merge_runs(small);
+        std::vector<T> merged;
+        merged.reserve((size_t)size() + other.size());
+        std::set_union(begin(), end(), other.begin(), other.end(), std::back_inserter(merged), _cmp);
+        return sorted_vector(vector_type(merged.begin(), merged.end()), _cmp);
+        }
+
+      bool operator == (const sorted_vector& other) const
+        {
+        return _values == other._values;
+        }
+
+      bool operator != (const sorted_vector& other) const
+        {
+        return _values != other._values;
+        }
+
+      const vector_type& values() const
+        {
+        return _values;
+        }
+
+    private:
+      sorted_vector(const vector_type& values, Compare cmp) : _values(values), _cmp(cmp)
+        {
+        }
+
+      // Merges a set that is much smaller, by concatenating the runs of this
+      // set between its elements.
+      sorted_vector _merge_runs(const sorted_vector& small) const
+        {
+        vector_type result;
+        size_type from = 0;
+        for (const T& value : small)
+          {
+          const size_type index = rrb_partition_point(_values.raw().ptr, [&](const T& element) { return _cmp(element, value); });
+          if (index > from)
+            result = result + _values.slice(from, index);
+          from = index;
+          if (index < size() && !_cmp(value, _values[index]))
+            continue;
+          result = result.push_back(value);
+          }
+        if (from < size())
+          result = result + _values.slice(from, size());
+        return sorted_vector(result, _cmp);
+        }
+
+    private:
+      vector_type _values;
+      Compare _cmp;
+    };
+
+  template <typename Key, typename Value, typename Compare = std::less<Key>, bool atomic_ref_counting = true, int N = 5>
+  class sorted_map
+    {
+    public:
+      using value_type = std::pair<Key, Value>;
+      using vector_type = vector<value_type, atomic_ref_counting, N>;
+      using size_type = rrb_index_type;
+      using iterator = typename vector_type::iterator;
+      using const_iterator = iterator;
+
+      explicit sorted_map(Compare cmp = Compare()) : _cmp(cmp)
+        {
+        }
+
+      iterator begin() const
+        {
+        return _pairs.begin();
+        }
+
+      iterator end() const
+        {
+        return _pairs.end();
+        }
+
+      bool empty() const
+        {
+        return _pairs.empty();
+        }
+
+      size_type size() const
+        {
+        return _pairs.size();
+        }
+
+      // the index of the first pair whose key is not less than key
+      size_type lower_bound(const Key& key) const
+        {
+        return rrb_partition_point(_pairs.raw().ptr, [&](const value_type& p) { return _cmp(p.first, key); });
+        }
+
+      // The value of key, or nullptr if the map has no such key. The pointer is
+      // valid as long as the map is alive.
+      const Value* find(const Key& key) const
+        {
+        const size_type index = lower_bound(key);
+        if (index == size())
+          return nullptr;
+        const value_type& p = _pairs[index];
+        return _cmp(key, p.first) ? nullptr : &p.second;
+        }
+
+      const Value& at(const Key& key) const
+        {
+        const Value* value = find(key);
+        if (value == nullptr)
+          throw std::out_of_range("invalid sorted_map key");
+        return *value;
+        }
+
+      bool contains(const Key& key) const
+        {
+        return find(key) != nullptr;
+        }
+
+      // inserts the pair, or replaces the value of key if the map has it
+      sorted_map set(const Key& key, const Value& value) const
+        {
+        const size_type index = lower_bound(key);
+        if (index < size() && !_cmp(key, _pairs[index].first))
+          return sorted_map(_pairs.set(index, value_type(key, value)), _cmp);
+        return sorted_map(_pairs.insert(index, value_type(key, value)), _cmp);
+        }
+
+      sorted_map erase(const Key& key) const
+        {
+        const size_type index = lower_bound(key);
+        if (index == size() || _cmp(key, _pairs[index].first))
+          return *this;
+        return sorted_map(_pairs.erase(index), _cmp);
+        }
+
+      const vector_type& pairs() const
+        {
+        return _pairs;
+        }
+
+    private:
+      sorted_map(const vector_type& pairs, Compare cmp) : _pairs(pairs), _cmp(cmp)
+        {
+        }
+
+    private:
+      vector_type _pairs;
+      Compare _cmp;
+    };
+
+  }
@@ -0,0 +1,200 @@
+
+/*
+ * Immutable UTF-8 text, for editor buffers and large logs.
+ *
+ * A text is a vector of bytes whose nodes also cache their newline and code
+ * point counts (see rrb_text.h), so finding the start of a line or the line
+ * and column of an offset takes O(log n) time instead of a scan. The default
+ * branching factor of 2^6 gives leaves of 64 bytes, one cache line.
+ *
+ * Lines are separated by '\n' and numbered from 0. Columns count code points
+ * from the start of the line. Offsets count bytes.
+ */
+
+#pragma once
+
+#include "vector.h"
+#include "rrb_text.h"
+
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+namespace immutable
+  {
+
+  template <bool atomic_ref_counting = true, int N = 6>
+  class text
+    {
+    public:
+      using vector_type = vector<char, atomic_ref_counting, N>;
+      using value_type = char;
+      using size_type = rrb_index_type;
+      using iterator = typename vector_type::iterator;
+      using const_iterator = iterator;
+
+      static const size_type npos = (size_type)-1;
+
+      text() = default;
+
+      explicit text(const vector_type& bytes) : _bytes(bytes)
+        {
+        }
+
+      text(const char* s, size_type len) : _bytes(s, s + len)
+        {
+        }
+
+      text(const std::string& s) : _bytes(s.begin(), s.end())
+        {
+        }
+
+      iterator begin() const
+        {
+        return _bytes.begin();
+        }
+
+      iterator end() const
+        {
+        return _bytes.end();
+        }
+
+      bool empty() const
+        {
+        return _bytes.empty();
+        }
+
+      size_type size() const
+        {
+        return _bytes.size();
+        }
+
+      char operator [] (size_type offset) const
+        {
+        return _bytes[offset];
+        }
+
+      // the number of lines, which is one more than the number of newlines
+      size_type lines() const
+        {
+        return rrb_text_counts(_bytes.raw()).newlines + 1;
+        }
+
+      size_type code_points() const
+        {
+        return rrb_text_counts(_bytes.raw()).code_points;
+        }
+
+      // the offset of the first byte of a line
+      size_type line_start(size_type line) const
+        {
+        if (line == 0)
+          return 0;
+        const size_type newline = rrb_text_newline(_bytes.raw(), line);
+        if (newline == size())
+          throw std::out_of_range("invalid text line");
+        return newline + 1;
+        }
+
+      // the offset of the newline that ends a line, or size() for the last line
+      size_type line_end(size_type line) const
+        {
+        if (line >= lines())
+          throw std::out_of_range("invalid text line");
+        return rrb_text_newline(_bytes.raw(), line + 1);
+        }
+
+      // the line and the column of the byte at offset, offset <= size()
+      std::pair<size_type, size_type> offset_to_line_col(size_type offset) const
+        {
+        if (offset > size())
+          throw std::out_of_range("invalid text offset");
+        const text_counts before = rrb_text_prefix_counts(_bytes.raw(), offset);
+        const size_type start = line_start(before.newlines);
+        const text_counts before_line = rrb_text_prefix_counts(_bytes.raw(), start);
+        return std::make_pair(before.newlines, before.code_points - before_line.code_points);
+        }
+
+      // the offset of the first c at or after pos, or npos
+      size_type find(char c, size_type pos = 0) const
+        {
+        const size_type offset = _bytes.find(c, pos);
+        return offset < size() ? offset : npos;
+        }
+
+      size_type find(const std::string& s, size_type pos = 0) const
+        {
+        const size_type offset = _bytes.search(s.begin(), s.end(), pos);
+        return offset < size() || (s.empty() && pos == size()) ? offset : npos;
+        }
+
+      size_type find_first_of(const std::string& chars, size_type pos = 0) const
+        {
+        const size_type offset = _bytes.find_first_of(chars.begin(), chars.end(), pos);
+        return offset < size() ? offset : npos;
+        }
+
+      text substr(size_type pos, size_type count = npos) const
+        {
+        if (pos > size())
+          throw std::out_of_range("invalid text offset");
+        return text(_bytes.slice(pos, count < size() - pos ? pos + count : size()));
+        }
+
+      text insert(size_type pos, const text& t) const
+        {
+        if (pos > size())
+          throw std::out_of_range("invalid text offset");
+        return text(_bytes.insert(pos, t._bytes));
+        }
+
+      text insert(size_type pos, const char* s, size_type len) const
+        {
+        return insert(pos, text(s, len));
+        }
+
+      text insert(size_type pos, const std::string& s) const
+        {
+        return insert(pos, text(s));
+        }
+
+      text erase(size_type pos, size_type count = npos) const
+        {
+        if (pos > size())
+          throw std::out_of_range("invalid text offset");
+        return text(_bytes.erase(pos, count < size() - pos ? pos + count : size()));
+        }
+
+      text operator + (const text& t) const
+        {
+        return text(_bytes + t._bytes);
+        }
+
+      bool operator == (const text& other) const
+        {
+        return _bytes == other._bytes;
+        }
+
+      bool operator != (const text& other) const
+        {
+        return _bytes != other._bytes;
+        }
+
+      std::string str() const
+        {
+        return std::string(_bytes.begin(), _bytes.end());
+        }
+
+      const vector_type& bytes() const
+        {
+        return _bytes;
+        }
+
+    private:
+      vector_type _bytes;
+    };
+
+  template <bool atomic_ref_counting, int N>
+  const typename text<atomic_ref_counting, N>::size_type text<atomic_ref_counting, N>::npos;
+
+  }
@@ -2,7 +2,17 @@
 
 #include "rrb.h"
 #include "rrb_transient.h"
-
+#include "rrb_node_store.h"
+#include "rrb_hash.h"
+#include "rrb_build.h"
+#include "rrb_sort.h"
+#include "rrb_search.h"
+#include "rrb_reduce.h"
+
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <stdexcept>
 #include <tuple>
 
 namespace immutable
@@ -14,6 +24,12 @@ namespace immutable
   template <typename T, bool atomic_ref_counting, int N>
   class transient_vector;
 
+  template <typename T, bool atomic_ref_counting, int N>
+  class vector_view;
+
+  template <typename T, bool atomic_ref_counting, int N>
+  class slice_view;
+
   template <typename T, bool atomic_ref_counting, int N>
   class vector_iterator
     {
@@ -21,7 +37,7 @@ namespace immutable
       typedef vector_iterator<T, atomic_ref_counting, N> self_type;
       typedef std::random_access_iterator_tag iterator_category;
       typedef T value_type;
-      typedef uint32_t size_type;
+      typedef rrb_index_type size_type;
       typedef const T* pointer;
       typedef const T* const_pointer;
       typedef const T& reference;
@@ -106,7 +122,7 @@ namespace immutable
 
       difference_type operator - (const self_type& c) const
         {
-        return _index - c._index;
+        return (difference_type)_index - (difference_type)c._index;
         }
 
       bool operator == (const self_type &other) const
@@ -145,6 +161,141 @@ namespace immutable
       mutable region_type _cursor;
     };
 
+  // Iterates over a vector that is kept alive by someone else, e.g. by an
+  // epoch_guard. It only holds raw pointers, so creating and copying it does
+  // not touch any reference count.
+  template <typename T, bool atomic_ref_counting, int N>
+  class borrowed_iterator
+    {
+    public:
+      typedef borrowed_iterator<T, atomic_ref_counting, N> self_type;
+      typedef std::random_access_iterator_tag iterator_category;
+      typedef T value_type;
+      typedef rrb_index_type size_type;
+      typedef const T* pointer;
+      typedef const T* const_pointer;
+      typedef const T& reference;
+      typedef const T& const_reference;
+      typedef std::ptrdiff_t difference_type;
+
+      typedef std::tuple<pointer, size_type, size_type> region_type;
+
+      borrowed_iterator() = default;
+
+      borrowed_iterator(const rrb<T, atomic_ref_counting, N>* impl, size_type index) : _impl(impl), _index(index), _cursor{ nullptr, (size_type)-1, (size_type)-1 } {}
+
+      reference operator* () const
+        {
+        if (_index < std::get<1>(_cursor) || _index >= std::get<2>(_cursor))
+          {
+          _cursor = rrb_region_for(_impl, _index);
+          }
+        return std::get<0>(_cursor)[_index - std::get<1>(_cursor)];
+        }
+
+      pointer operator ->() const
+        {
+        return &(this->operator*());
+        }
+
+      reference operator [] (difference_type n) const
+        {
+        return *(*this + n);
+        }
+
+      self_type operator++(int)
+        {
+        self_type tmp(*this);
+        ++(*this);
+        return tmp;
+        }
+
+      self_type operator--(int)
+        {
+        self_type tmp(*this);
+        --(*this);
+        return tmp;
+        }
+
+      self_type& operator++()
+        {
+        ++_index;
+        return *this;
+        }
+
+      self_type& operator--()
+        {
+        --_index;
+        return *this;
+        }
+
+      self_type operator + (difference_type n) const
+        {
+        self_type tmp(*this);
+        tmp._index += (size_type)n;
+        return tmp;
+        }
+
+      self_type& operator+= (difference_type n)
+        {
+        _index += (size_type)n;
+        return *this;
+        }
+
+      self_type operator- (difference_type n) const
+        {
+        self_type tmp(*this);
+        tmp._index -= (size_type)n;
+        return tmp;
+        }
+
+      self_type& operator-= (difference_type n)
+        {
+        _index -= (size_type)n;
+        return *this;
+        }
+
+      difference_type operator - (const self_type& c) const
+        {
+        return (difference_type)_index - (difference_type)c._index;
+        }
+
+      bool operator == (const self_type &other) const
+        {
+        return (_index == other._index) && (_impl == other._impl);
+        }
+
+      bool operator != (const self_type& other) const
+        {
+        return !(*this == other);
+        }
+
+      bool operator > (const self_type &other) const
+        {
+        return _index > other._index;
+        }
+
+      bool operator >= (const self_type &other) const
+        {
+        return _index >= other._index;
+        }
+
+      bool operator < (const self_type &other) const
+        {
+        return _index < other._index;
+        }
+
+      bool operator <= (const self_type &other) const
+        {
+        return _index <= other._index;
+        }
+
+    private:
+      const rrb<T, atomic_ref_counting, N>* _impl;
+      size_type _index;
+      mutable region_type _cursor;
+    };
+
   template <typename T, bool atomic_ref_counting = true, int N = 5>
   class vector
     {
@@ -152,14 +303,30 @@ namespace immutable
       using value_type = T;
       using reference = const T&;
       using const_reference = const T&;
-      using size_type = uint32_t;
+      using size_type = rrb_index_type;
       using iterator = vector_iterator<T, atomic_ref_counting, N>;
       using const_iterator = iterator;
       using reverse_iterator = std::reverse_iterator<iterator>;
       using transient_type = transient_vector<T, atomic_ref_counting, N>;
+      using view_type = vector_view<T, atomic_ref_counting, N>;
+      using slice_view_type = slice_view<T, atomic_ref_counting, N>;
 
       vector() = default;
 
+      template <typename Iterator, typename = typename std::iterator_traits<Iterator>::iterator_category>
+      vector(Iterator first, Iterator last)
+        {
+        _assign(first, last, typename std::iterator_traits<Iterator>::iterator_category());
+        }
+
+      // Builds the vector from a large random access range on several threads.
+      // threads == 0 uses one thread per core.
+      template <typename Iterator>
+      static vector parallel_build(Iterator first, Iterator last, uint32_t threads = 0)
+        {
+        return rrb_build_parallel<T, atomic_ref_counting, N>(first, (rrb_index_type)(last - first), threads);
+        }
+
       iterator begin() const
         {
         return iterator(_impl);
@@ -265,15 +432,121 @@ namespace immutable
         return rrb_slice(_impl, from, to);
         }
 
+      // Writes the elements at indices[0 .. count) to out, in the order of
+      // the indices, with one descent of the tree for all of them (see
+      // rrb_gather in rrb_search.h).
+      void gather(const size_type* indices, size_t count, T* out) const
+        {
+        rrb_gather(_impl.ptr, indices, count, out);
+        }
+
+      // The elements are assigned to a value-initialized result, so T must be
+      // default constructible, as for the leaves of the tree.
+      std::vector<T> gather(const std::vector<size_type>& indices) const
+        {
+        std::vector<T> out(indices.size());
+        rrb_gather(_impl.ptr, indices.data(), indices.size(), out.data());
+        return out;
+        }
+
+      // returns a view on the slice from "from" to "to", which reads this
+      // vector without building a new tree, see slice_view
+      slice_view_type lazy_slice(size_type from, size_type to) const
+        {
+        return slice_view_type(*this, from, to);
+        }
+
+      // The searches below scan the leaves directly, with SIMD kernels for
+      // small integral types (see rrb_search.h). They return the index of the
+      // first match at or after pos, or size() if there is none.
+      size_type find(const_reference value, size_type pos = 0) const
+        {
+        return rrb_find(_impl.ptr, value, pos);
+        }
+
+      size_type find_first_of(std::initializer_list<T> values, size_type pos = 0) const
+        {
+        return rrb_find_first_of(_impl.ptr, values.begin(), values.size(), pos);
+        }
+
+      template <typename Iterator, typename = typename std::iterator_traits<Iterator>::iterator_category>
+      size_type find_first_of(Iterator first, Iterator last, size_type pos = 0) const
+        {
+        const std::vector<T> values(first, last);
+        return rrb_find_first_of(_impl.ptr, values.data(), values.size(), pos);
+        }
+
+      // finds the subsequence needle
+      size_type search(const vector& needle, size_type pos = 0) const
+        {
+        return search(needle.begin(), needle.end(), pos);
+        }
+
+      template <typename Iterator, typename = typename std::iterator_traits<Iterator>::iterator_category>
+      size_type search(Iterator first, Iterator last, size_type pos = 0) const
+        {
+        const std::vector<T> needle(first, last);
+        return rrb_search(_impl.ptr, needle.data(), needle.size(), pos);
+        }
+
+      size_type count(const_reference value) const
+        {
+        return rrb_count_value(_impl.ptr, value);
+        }
+
+      // The reductions below are for arithmetic T. They reduce the leaves
+      // with SIMD kernels (see rrb_reduce.h), splitting the children of the
+      // root over up to `threads` threads (0 uses one thread per core).
+      // Integral sums and dot products are 64 bit.
+      typename reduce_sum_type<T>::type sum(uint32_t threads = 1) const
+        {
+        return rrb_sum(_impl.ptr, threads);
+        }
+
+      T minimum(uint32_t threads = 1) const
+        {
+        return minmax(threads).first;
+        }
+
+      T maximum(uint32_t threads = 1) const
+        {
+        return minmax(threads).second;
+        }
+
+      std::pair<T, T> minmax(uint32_t threads = 1) const
+        {
+        if (empty())
+          throw std::out_of_range("minimum or maximum of an empty vector<T>");
+        return rrb_min_max(_impl.ptr, threads);
+        }
+
+      typename reduce_sum_type<T>::type dot(const vector& other, uint32_t threads = 1) const
+        {
+        if (size() != other.size())
+          throw std::invalid_argument("dot product of vector<T>s of different sizes");
+        return rrb_dot(_impl.ptr, other._impl.ptr, threads);
+        }
+
+      // counts the elements in each of `bins` bins of equal width that split
+      // [lo, hi), elements outside of [lo, hi) are not counted
+      std::vector<size_type> histogram(T lo, T hi, uint32_t bins, uint32_t threads = 1) const
+        {
+        if (bins == 0)
+          throw std::invalid_argument("histogram of a vector<T> without bins");
+        return rrb_histogram(_impl.ptr, lo, hi, bins, threads);
+        }
+
       bool operator == (const vector& other) const
         {
         if (size() != other.size())
           return false;
         if (size() == 0)
           return true;
-        auto it = begin();
-        auto it2 = other.begin();
-        auto it_end = end();
+        const view_type this_view = view();
+        const view_type other_view = other.view();
+        auto it = this_view.begin();
+        auto it2 = other_view.begin();
+        auto it_end = this_view.end();
         for (; it != it_end; ++it, ++it2)
           {
           if (*it != *it2)
@@ -292,6 +565,58 @@ namespace immutable
         return transient_type(_impl);
         }
 
+      // returns an equal vector with a dense tree without size tables, which
+      // is rebuilt on up to `threads` threads (0 uses one thread per core).
+      // All nodes are copied, so the result shares none of them with this
+      // vector or with other versions.
+      vector compact(uint32_t threads = 0) const
+        {
+        const view_type v = view();
+        return rrb_build_parallel<T, atomic_ref_counting, N>(v.begin(), size(), threads);
+        }
+
+      // returns a sorted copy of the vector
+      vector sorted() const
+        {
+        return _sorted(std::less<T>(), false, 0);
+        }
+
+      // returns a copy sorted by cmp, using up to `threads` threads (0 uses
+      // one thread per core)
+      template <typename Compare>
+      vector sorted(Compare cmp, uint32_t threads = 0) const
+        {
+        return _sorted(cmp, false, threads);
+        }
+
+      // as sorted, but keeps equal elements in their original order
+      vector stable_sorted() const
+        {
+        return _sorted(std::less<T>(), true, 0);
+        }
+
+      template <typename Compare>
+      vector stable_sorted(Compare cmp, uint32_t threads = 0) const
+        {
+        return _sorted(cmp, true, threads);
+        }
+
+      // returns an equal vector whose nodes are shared with equal nodes of
+      // other vectors that were deduplicated through the same store
+      vector deduplicate(node_store<T, atomic_ref_counting, N>& store) const
+        {
+        return rrb_deduplicate(_impl, store);
+        }
+
+      // returns a view that iterates without reference counting, which is
+      // only valid as long as this vector is alive
+      view_type view() const &
+        {
+        return view_type(*this);
+        }
+
+      view_type view() const && = delete;
+
       ref<rrb<T, atomic_ref_counting, N>> raw() const
         {
         return _impl;
@@ -307,6 +632,31 @@ namespace immutable
         _impl = transient_to_rrb(impl);
         }
 
+      template <typename Compare>
+      vector _sorted(Compare cmp, bool stable, uint32_t threads) const
+        {
+        threads = rrb_details::thread_count(threads);
+        const view_type v = view();
+        std::vector<T> values(v.begin(), v.end());
+        rrb_details::sort_values(values, cmp, stable, threads);
+        return rrb_build_parallel<T, atomic_ref_counting, N>(std::make_move_iterator(values.begin()), size(), threads);
+        }
+
+      template <typename Iterator>
+      void _assign(Iterator first, Iterator last, std::random_access_iterator_tag)
+        {
+        _impl = rrb_build<T, atomic_ref_counting, N>(first, (rrb_index_type)(last - first));
+        }
+
+      template <typename Iterator>
+      void _assign(Iterator first, Iterator last, std::input_iterator_tag)
+        {
+        transient_type tv = transient();
+        for (; first != last; ++first)
+          tv.push_back(*first);
+        _impl = tv.persistent()._impl;
+        }
+
     private:
       ref<rrb<T, atomic_ref_counting, N>> _impl = rrb_create<T, atomic_ref_counting, N>();
 
@@ -315,6 +665,274 @@ namespace immutable
 
       template <typename T_2, bool atomic_ref_counting_2, int N_2>
       friend vector<T_2, atomic_ref_counting_2, N_2> operator + (const vector<T_2, atomic_ref_counting_2, N_2>& left, const vector<T_2, atomic_ref_counting_2, N_2>& right);
+
+      template <typename Iterator>
+      friend typename std::iterator_traits<Iterator>::value_type concat_all(Iterator first, Iterator last, uint32_t threads);
+
+      template <typename T_2, int N_2>
+      friend class atomic_vector;
+
+      template <typename T_2, bool atomic_ref_counting_2, int N_2>
+      friend class vector_view;
+    };
+
+  // A view on a vector that does not own a reference. Creating, copying and
+  // iterating a view never touches a reference count, so it only stays valid
+  // while the vector (or the epoch_guard that it was borrowed under) is alive.
+  template <typename T, bool atomic_ref_counting = true, int N = 5>
+  class vector_view
+    {
+    public:
+      using value_type = T;
+      using reference = const T&;
+      using const_reference = const T&;
+      using size_type = rrb_index_type;
+      using iterator = borrowed_iterator<T, atomic_ref_counting, N>;
+      using const_iterator = iterator;
+      using reverse_iterator = std::reverse_iterator<iterator>;
+      using vector_type = vector<T, atomic_ref_counting, N>;
+
+      explicit vector_view(const vector_type& v) : _impl(v._impl.ptr)
+        {
+        }
+
+      // a view on a temporary would dangle right away
+      vector_view(vector_type&&) = delete;
+
+      iterator begin() const
+        {
+        return iterator(_impl, 0);
+        }
+
+      iterator end() const
+        {
+        return iterator(_impl, _impl->cnt);
+        }
+
+      reverse_iterator rbegin() const
+        {
+        return reverse_iterator{ end() };
+        }
+
+      reverse_iterator rend() const
+        {
+        return reverse_iterator{ begin() };
+        }
+
+      bool empty() const
+        {
+        return _impl->cnt == 0;
+        }
+
+      size_type size() const
+        {
+        return _impl->cnt;
+        }
+
+      const_reference back() const
+        {
+        return _impl->tail->child[_impl->tail_len - 1];
+        }
+
+      const_reference front() const
+        {
+        return rrb_nth(_impl, 0);
+        }
+
+      const_reference operator [] (size_type index) const
+        {
+        return rrb_nth(_impl, index);
+        }
+
+      const_reference at(size_type index) const
+        {
+        if (index >= size())
+          throw std::out_of_range("invalid vector<T> index");
+        return rrb_nth(_impl, index);
+        }
+
+      // takes a reference, so the result stays valid after the viewed vector
+      // is gone
+      vector_type to_vector() const
+        {
+        ref<rrb<T, atomic_ref_counting, N>> r;
+        r.ptr = const_cast<rrb<T, atomic_ref_counting, N>*>(_impl);
+        r.inc();
+        return vector_type(r);
+        }
+
+    private:
+      explicit vector_view(const rrb<T, atomic_ref_counting, N>* impl) : _impl(impl)
+        {
+        }
+
+    private:
+      const rrb<T, atomic_ref_counting, N>* _impl;
+
+      template <typename T_2, int N_2>
+      friend class atomic_vector;
+    };
+
+  // A slice of a vector that is not built until it is needed. Slicing a
+  // vector builds new boundary paths, which is wasted work for a slice that
+  // is only read. A slice_view keeps the vector alive and reads its elements
+  // at an offset instead. Slicing a view gives another view, and to_vector()
+  // or any edit builds the slice as a vector.
+  template <typename T, bool atomic_ref_counting = true, int N = 5>
+  class slice_view
+    {
+    public:
+      using value_type = T;
+      using reference = const T&;
+      using const_reference = const T&;
+      using size_type = rrb_index_type;
+      using iterator = vector_iterator<T, atomic_ref_counting, N>;
+      using const_iterator = iterator;
+      using reverse_iterator = std::reverse_iterator<iterator>;
+      using vector_type = vector<T, atomic_ref_counting, N>;
+
+      slice_view() : _from(0), _to(0)
+        {
+        }
+
+      slice_view(const vector_type& v) : _source(v), _from(0), _to(v.size())
+        {
+        }
+
+      slice_view(const vector_type& v, size_type from, size_type to) : _source(v), _from(from), _to(to)
+        {
+        assert(from <= to && to <= v.size());
+        }
+
+      iterator begin() const
+        {
+        return _source.begin() + _from;
+        }
+
+      iterator end() const
+        {
+        return _source.begin() + _to;
+        }
+
+      reverse_iterator rbegin() const
+        {
+        return reverse_iterator{ end() };
+        }
+
+      reverse_iterator rend() const
+        {
+        return reverse_iterator{ begin() };
+        }
+
+      bool empty() const
+        {
+        return _from == _to;
+        }
+
+      size_type size() const
+        {
+        return _to - _from;
+        }
+
+      const_reference back() const
+        {
+        return _source[_to - 1];
+        }
+
+      const_reference front() const
+        {
+        return _source[_from];
+        }
+
+      const_reference operator [] (size_type index) const
+        {
+        return _source[_from + index];
+        }
+
+      const_reference at(size_type index) const
+        {
+        if (index >= size())
+          throw std::out_of_range("invalid vector<T> index");
+        return _source[_from + index];
+        }
+
+      slice_view drop(size_type elems) const
+        {
+        return slice_view(_source, _from + elems, _to);
+        }
+
+      slice_view take(size_type elems) const
+        {
+        return slice_view(_source, _from, _from + elems);
+        }
+
+      slice_view slice(size_type from, size_type to) const
+        {
+        return slice_view(_source, _from + from, _from + to);
+        }
+
+      // builds the slice, or returns the vector itself if the view covers it
+      vector_type to_vector() const
+        {
+        if (_from == 0 && _to == _source.size())
+          return _source;
+        return _source.slice(_from, _to);
+        }
+
+      vector_type push_back(value_type value) const
+        {
+        return to_vector().push_back(value);
+        }
+
+      vector_type pop_back() const
+        {
+        return take(size() - 1).to_vector();
+        }
+
+      vector_type set(size_type index, value_type value) const
+        {
+        return to_vector().set(index, value);
+        }
+
+      vector_type erase(size_type pos) const
+        {
+        return take(pos).to_vector() + drop(pos + 1).to_vector();
+        }
+
+      vector_type insert(size_type pos, value_type value) const
+        {
+        return take(pos).to_vector().push_back(value) + drop(pos).to_vector();
+        }
+
+      bool operator == (const slice_view& other) const
+        {
+        if (size() != other.size())
+          return false;
+        if (_source.raw().ptr == other._source.raw().ptr && _from == other._from)
+          return true;
+        return std::equal(begin(), end(), other.begin());
+        }
+
+      bool operator != (const slice_view& other) const
+        {
+        return !(*this == other);
+        }
+
+      // the vector that the view reads
+      const vector_type& source() const
+        {
+        return _source;
+        }
+
+      // the index in source() of the first element of the view
+      size_type offset() const
+        {
+        return _from;
+        }
+
+    private:
+      vector_type _source;
+      size_type _from, _to;
     };
 
   template <typename T, bool atomic_ref_counting, int N>
@@ -323,6 +941,61 @@ namespace immutable
     return rrb_concat(left._impl, right._impl);
     }
 
+  // Concatenates all vectors in the range [first, last) at once, which is
+  // much cheaper than folding them together with operator +. With atomic
+  // reference counting, up to `threads` threads are used (0 uses one thread
+  // per core).
+  template <typename Iterator>
+  typename std::iterator_traits<Iterator>::value_type concat_all(Iterator first, Iterator last, uint32_t threads = 1)
+    {
+    typedef typename std::iterator_traits<Iterator>::value_type vector_type;
+    std::vector<decltype(vector_type()._impl)> pieces;
+    for (; first != last; ++first)
+      pieces.push_back(first->_impl);
+    if (pieces.empty())
+      return vector_type();
+    return rrb_concat_all(pieces.data(), pieces.data() + pieces.size(), threads);
+    }
+
+
+  // One of the parts that a transient_vector was split into. A part can only
+  // access the elements in [begin_index(), end_index()), so different threads
+  // can update different parts at the same time. Each part must only be used
+  // by one thread.
+  template <typename T, int N = 5>
+  class transient_vector_part
+    {
+    public:
+      using value_type = T;
+      using const_reference = const T&;
+      using size_type = rrb_index_type;
+
+      size_type begin_index() const
+        {
+        return _part.begin;
+        }
+
+      size_type end_index() const
+        {
+        return _part.end;
+        }
+
+      const_reference operator [] (size_type index) const
+        {
+        return transient_rrb_part_nth(_part, index);
+        }
+
+      void set(size_type index, value_type value)
+        {
+        transient_rrb_part_update(_part, index, value);
+        }
+
+    private:
+      transient_rrb_part<T, N> _part;
+
+      template <typename T_2, bool atomic_ref_counting_2, int N_2>
+      friend class transient_vector;
+    };
 
   template <typename T, bool atomic_ref_counting = true, int N = 5>
   class transient_vector
@@ -331,7 +1004,7 @@ namespace immutable
       using value_type = T;
       using reference = const T&;
       using const_reference = const T&;
-      using size_type = uint32_t;
+      using size_type = rrb_index_type;
       using iterator = vector_iterator<T, atomic_ref_counting, N>;
       using const_iterator = iterator;
       using reverse_iterator = std::reverse_iterator<iterator>;
@@ -406,6 +1079,28 @@ namespace immutable
         transient_rrb_update(_impl, index, value);
         }
 
+      // Splits the transient into at most `parts` parts over disjoint index
+      // ranges, which can be updated concurrently by different threads. The
+      // transient can only be used again after the parts are joined.
+      std::vector<transient_vector_part<T, N>> split(size_type parts)
+        {
+        static_assert(atomic_ref_counting, "only transients with atomic reference counting can be split");
+        std::vector<transient_rrb_part<T, N>> rrb_parts = transient_rrb_split(_impl, parts);
+        std::vector<transient_vector_part<T, N>> result(rrb_parts.size());
+        for (size_t i = 0; i < rrb_parts.size(); ++i)
+          result[i]._part = rrb_parts[i];
+        return result;
+        }
+
+      void join(std::vector<transient_vector_part<T, N>>& parts)
+        {
+        std::vector<transient_rrb_part<T, N>> rrb_parts(parts.size());
+        for (size_t i = 0; i < parts.size(); ++i)
+          rrb_parts[i] = parts[i]._part;
+        parts.clear();
+        transient_rrb_join(_impl, rrb_parts);
+        }
+
       persistent_type persistent() const
         {
         return persistent_type(_impl);
@@ -428,4 +1123,21 @@ namespace immutable
       friend class vector;
     };
 
-  }
\ No newline at end of file
+  }
+
+namespace std
+  {
+
+  // The hash only depends on the elements of the vector. Subtree hashes are
+  // cached in the tree nodes, so hashing a vector that shares nodes with a
+  // previously hashed vector only visits the nodes that are not shared.
+  template <typename T, bool atomic_ref_counting, int N>
+  struct hash<immutable::vector<T, atomic_ref_counting, N>>
+    {
+    size_t operator()(const immutable::vector<T, atomic_ref_counting, N>& v) const
+      {
+      return (size_t)immutable::rrb_hash(v.raw());
+      }
+    };
+
+  }
@@ -2,8 +2,21 @@
 #include "test_assert.h"
 #include <iostream>
 #include <immutable/vector.h>
+#include <immutable/atomic_vector.h>
+#include <immutable/text.h>
+#include <immutable/packed_vector.h>
+#include <immutable/compressed_vector.h>
+#include <immutable/history.h>
+#include <immutable/sorted_vector.h>
 #include <immutable/rrb_debug.h>
 #include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <list>
+#include <set>
+#include <type_traits>
 
 namespace
   {
@@ -1038,6 +1051,1213 @@ namespace
 
     }
     
+  template <bool atomic_ref_counting, int N>
+  void test_deduplicate(uint32_t sz = 5000)
+    {
+    immutable::node_store<int, atomic_ref_counting, N> store;
+    immutable::vector<int, atomic_ref_counting, N> v1, v2;
+    for (uint32_t i = 0; i < sz; ++i)
+      {
+      v1 = v1.push_back((int)(i % 100));
+      v2 = v2.push_back((int)(i % 100));
+      }
+    TEST_ASSERT(v1.raw()->root.ptr != v2.raw()->root.ptr);
+
+    auto d1 = v1.deduplicate(store);
+    auto d2 = v2.deduplicate(store);
+    TEST_ASSERT(immutable::validate_rrb(d1.raw()));
+    TEST_ASSERT(immutable::validate_rrb(d2.raw()));
+    TEST_ASSERT(d1 == v1);
+    TEST_ASSERT(d2 == v2);
+    TEST_ASSERT(d1.raw()->root.ptr == d2.raw()->root.ptr);
+    TEST_ASSERT(d1.raw()->tail.ptr == d2.raw()->tail.ptr);
+
+    auto d3 = d2.deduplicate(store);
+    TEST_ASSERT(d3.raw().ptr == d2.raw().ptr);
+
+    // a modified version only introduces new nodes along the changed path
+    auto v3 = v1.set(sz / 2, -1).deduplicate(store);
+    TEST_EQ(-1, v3[sz / 2]);
+    TEST_ASSERT(immutable::validate_rrb(v3.raw()));
+
+    TEST_ASSERT(store.size() > 0);
+    v1 = v2 = d1 = d2 = d3 = v3 = immutable::vector<int, atomic_ref_counting, N>();
+    store.collect();
+    TEST_EQ(0, store.size());
+    }
+
+  template <bool atomic_ref_counting, int N>
+  void test_hash(uint32_t sz = 3000)
+    {
+    typedef immutable::vector<int, atomic_ref_counting, N> vector_type;
+    std::hash<vector_type> hasher;
+    vector_type pushed, concatenated, piece;
+    for (uint32_t i = 0; i < sz; ++i)
+      {
+      pushed = pushed.push_back((int)i);
+      piece = piece.push_back((int)i);
+      if (piece.size() == 37)
+        {
+        concatenated = concatenated + piece;
+        piece = vector_type();
+        }
+      }
+    concatenated = concatenated + piece;
+    TEST_ASSERT(pushed == concatenated);
+    TEST_EQ(hasher(pushed), hasher(concatenated));
+    TEST_EQ(hasher(vector_type()), hasher(pushed.take(0)));
+
+    // a modified version hashes like a vector built from scratch with the same content
+    auto modified = pushed.set(sz / 3, -1);
+    TEST_ASSERT(hasher(modified) != hasher(pushed));
+    vector_type fresh;
+    for (uint32_t i = 0; i < sz; ++i)
+      fresh = fresh.push_back(i == sz / 3 ? -1 : (int)i);
+    TEST_EQ(hasher(fresh), hasher(modified));
+    TEST_EQ(hasher(pushed.drop(100)), hasher(concatenated.drop(100)));
+    TEST_EQ(hasher(pushed.take(sz - 5)), hasher(concatenated.pop_back().pop_back().pop_back().pop_back().pop_back()));
+    }
+
+  template <bool atomic_ref_counting, int N>
+  void test_concat_all()
+    {
+    typedef immutable::vector<int, atomic_ref_counting, N> vector_type;
+    std::vector<vector_type> pieces;
+    vector_type expected;
+    int value = 0;
+    for (uint32_t i = 0; i < 500; ++i)
+      {
+      // mix empty, small and large pieces
+      uint32_t piece_size = (i % 7 == 0) ? 0 : (i % 50 == 3 ? 3000 : (i * 13) % 90);
+      vector_type piece;
+      for (uint32_t j = 0; j < piece_size; ++j)
+        {
+        piece = piece.push_back(value);
+        expected = expected.push_back(value);
+        ++value;
+        }
+      pieces.push_back(piece);
+      }
+    auto result = immutable::concat_all(pieces.begin(), pieces.end());
+    TEST_ASSERT(immutable::validate_rrb(result.raw()));
+    TEST_EQ(expected.size(), result.size());
+    TEST_ASSERT(result == expected);
+    for (const auto& piece : pieces)
+      TEST_ASSERT(immutable::validate_rrb(piece.raw()));
+
+    TEST_ASSERT(immutable::concat_all(pieces.begin(), pieces.begin()).empty());
+    TEST_ASSERT(immutable::concat_all(pieces.begin() + 1, pieces.begin() + 2) == pieces[1]);
+
+    // the same piece several times shares its nodes between the pairs
+    pieces.insert(pieces.end(), 40, pieces[3]);
+    auto parallel = immutable::concat_all(pieces.begin(), pieces.end(), 3);
+    TEST_ASSERT(immutable::validate_rrb(parallel.raw()));
+    TEST_ASSERT(parallel == immutable::concat_all(pieces.begin(), pieces.end()));
+    // 0 uses one thread per core, as everywhere else
+    TEST_ASSERT(parallel == immutable::concat_all(pieces.begin(), pieces.end(), 0));
+
+    // the relaxed tree of result becomes dense
+    auto compacted = result.compact(3);
+    TEST_ASSERT(compacted == expected);
+    TEST_ASSERT(immutable::validate_rrb(compacted.raw()));
+    TEST_EQ(expected.raw()->shift, compacted.raw()->shift);
+    TEST_EQ(expected.raw()->tail_len, compacted.raw()->tail_len);
+    }
+
+  template <bool atomic_ref_counting, int N>
+  void test_small_vector()
+    {
+    typedef immutable::vector<std::string, atomic_ref_counting, N> vector_type;
+    vector_type empty1, empty2;
+    if (atomic_ref_counting)
+      {
+      TEST_ASSERT(empty1.raw().ptr == empty2.raw().ptr);
+      // every thread has its own empty head, which outlives the thread
+      vector_type other;
+      std::thread t([&]() { other = vector_type(); });
+      t.join();
+      TEST_ASSERT(other.raw().ptr != empty1.raw().ptr);
+      TEST_ASSERT(other.empty());
+      TEST_ASSERT(other.push_back("x")[0] == "x");
+      }
+
+    vector_type v;
+    for (int i = 0; i < 8; ++i)
+      {
+      v = v.push_back(std::to_string(i));
+      // head and tail of a vector without tree live in one allocation
+      TEST_ASSERT((v.raw()->flags & immutable::rrb_details::EMBEDDED_TAIL) != 0);
+      TEST_ASSERT((const char*)v.raw().ptr == (const char*)v.raw()->tail.ptr + sizeof(*v.raw()->tail.ptr));
+      }
+    auto w = v.set(3, "three").pop_back();
+    TEST_EQ(7, w.size());
+    TEST_ASSERT(w[3] == "three");
+    TEST_ASSERT(v[3] == "3");
+    TEST_ASSERT(v.drop(5).size() == 3);
+    TEST_ASSERT(v.drop(5)[0] == "5");
+    // with a full tail on the left, the embedded tail of v is shared by the
+    // result and must outlive the head of v
+    const uint32_t big_size = 3 * (1 << N);
+    auto big = vector_type();
+    for (uint32_t i = 0; i < big_size; ++i)
+      big = big.push_back("x");
+    auto joined = big + v;
+    TEST_ASSERT(joined.raw()->tail.ptr == v.raw()->tail.ptr);
+    v = w = vector_type();
+    TEST_EQ(big_size + 8, joined.size());
+    TEST_ASSERT(joined[big_size + 7] == "7");
+    TEST_ASSERT(immutable::validate_rrb(joined.raw()));
+    }
+
+  template <bool atomic_ref_counting, int N>
+  void test_vector_view()
+    {
+    typedef immutable::vector<int, atomic_ref_counting, N> vector_type;
+    vector_type v;
+    const int size = 3 * (1 << (2 * N)) + 7;
+    for (int i = 0; i < size; ++i)
+      v = v.push_back(i);
+    v = v.drop(5) + v.take(5);
+    const uint32_t count = v.raw()->_ref_count;
+    typedef typename vector_type::view_type view_type;
+    // views are only made explicitly, and never of temporaries
+    static_assert(!std::is_convertible<const vector_type&, view_type>::value, "implicit view");
+    static_assert(!std::is_constructible<view_type, vector_type&&>::value, "view of a temporary");
+    view_type view = v.view();
+    TEST_EQ(size, view.size());
+    int expected = 5;
+    for (int value : view)
+      {
+      TEST_EQ(expected, value);
+      expected = (expected + 1) % size;
+      }
+    TEST_EQ(4, view.back());
+    TEST_EQ(5, view.front());
+    TEST_EQ(size - 1, view[size - 6]);
+    TEST_ASSERT(std::is_sorted(view.begin(), view.end() - 5));
+    auto it = std::lower_bound(view.begin(), view.end() - 5, 1000);
+    TEST_EQ(1000, *it);
+    TEST_EQ(995, it - view.begin());
+    TEST_EQ(4, *view.rbegin());
+    TEST_EQ(size, (int)std::distance(view.rbegin(), view.rend()));
+    // neither the view nor its iterators took a reference
+    TEST_EQ(count, (uint32_t)v.raw()->_ref_count);
+    vector_type copy = view.to_vector();
+    TEST_ASSERT(copy.raw().ptr == v.raw().ptr);
+    TEST_ASSERT(copy == v);
+    }
+
+  template <bool atomic_ref_counting, int N>
+  void test_build()
+    {
+    typedef immutable::vector<std::string, atomic_ref_counting, N> vector_type;
+    const uint32_t b = 1 << N;
+    const uint32_t sizes[] = { 0, 1, b, b + 1, 2 * b, b * b, b * b + b + 1, 3 * b * b + 17, 40 * b * b + 5 };
+    for (uint32_t size : sizes)
+      {
+      std::vector<std::string> input;
+      vector_type pushed;
+      for (uint32_t i = 0; i < size; ++i)
+        {
+        input.push_back(std::to_string(i));
+        pushed = pushed.push_back(input.back());
+        }
+      vector_type built(input.begin(), input.end());
+      vector_type parallel = vector_type::parallel_build(input.begin(), input.end(), 3);
+      const std::list<std::string> list(input.begin(), input.end());
+      vector_type from_list(list.begin(), list.end());
+      for (const vector_type* v : { &built, &parallel, &from_list })
+        {
+        TEST_ASSERT(*v == pushed);
+        TEST_EQ(pushed.raw()->shift, (*v).raw()->shift);
+        TEST_EQ(pushed.raw()->tail_len, (*v).raw()->tail_len);
+        TEST_ASSERT(immutable::validate_rrb((*v).raw()));
+        }
+      if (pushed.raw()->root.ptr != nullptr)
+        TEST_EQ(pushed.raw()->root->len, parallel.raw()->root->len);
+      }
+    }
+
+  template <bool atomic_ref_counting, int N>
+  void test_sorted()
+    {
+    typedef immutable::vector<int, atomic_ref_counting, N> vector_type;
+    for (int size : { 0, 1, 100, 100003 })
+      {
+      std::vector<int> values;
+      for (int i = 0; i < size; ++i)
+        values.push_back((int)(((int64_t)i * 7919) % 100003) - 50000);
+      vector_type v(values.begin(), values.end());
+
+      std::vector<int> expected(values);
+      std::sort(expected.begin(), expected.end());
+      vector_type sorted = v.sorted();
+      TEST_ASSERT(sorted == vector_type(expected.begin(), expected.end()));
+      TEST_ASSERT(immutable::validate_rrb(sorted.raw()));
+      TEST_ASSERT(v.stable_sorted() == sorted);
+
+      std::sort(expected.begin(), expected.end(), std::greater<int>());
+      TEST_ASSERT(v.sorted(std::greater<int>(), 3) == vector_type(expected.begin(), expected.end()));
+
+      // equal keys keep their order
+      auto by_thousands = [](int a, int b) { return a / 1000 < b / 1000; };
+      expected = values;
+      std::stable_sort(expected.begin(), expected.end(), by_thousands);
+      TEST_ASSERT(v.stable_sorted(by_thousands, 3) == vector_type(expected.begin(), expected.end()));
+      }
+
+    // the radix sort splits large inputs over the threads
+    std::vector<int> values;
+    for (int i = 0; i < 300007; ++i)
+      values.push_back((int)(((int64_t)i * 104729) % 300007) - 150000);
+    vector_type v(values.begin(), values.end());
+    std::sort(values.begin(), values.end());
+    TEST_ASSERT(v.sorted(std::less<int>(), 4) == vector_type(values.begin(), values.end()));
+    }
+
+  template <bool atomic_ref_counting, int N>
+  void test_text()
+    {
+    typedef immutable::text<atomic_ref_counting, N> text_type;
+    // lines of varying length with two and three byte code points
+    std::string s;
+    for (int i = 0; i < 3000; ++i)
+      {
+      for (int j = 0; j < i % 37; ++j)
+        s += (j % 5 == 0) ? "\xc3\xa9" : (j % 7 == 0) ? "\xe2\x82\xac" : "x";
+      s += '\n';
+      }
+    const text_type dense(s);
+    // concatenation gives nodes with size tables
+    const text_type relaxed = dense.substr(13, 40000) + dense.substr(3) + text_type("tail\xc3\xa9");
+    const std::string relaxed_str = s.substr(13, 40000) + s.substr(3) + "tail\xc3\xa9";
+    TEST_ASSERT(relaxed.str() == relaxed_str);
+    const std::pair<const text_type*, const std::string*> cases[] = { { &dense, &s }, { &relaxed, &relaxed_str } };
+    for (const auto& c : cases)
+      {
+      const text_type& t = *c.first;
+      const std::string& str = *c.second;
+      TEST_EQ(std::count(str.begin(), str.end(), '\n') + 1, t.lines());
+      size_t code_points = 0;
+      for (char ch : str)
+        code_points += ((unsigned char)ch & 0xc0) != 0x80;
+      TEST_EQ(code_points, t.code_points());
+      size_t line = 0, column = 0, start = 0;
+      for (size_t offset = 0; offset <= str.size(); ++offset)
+        {
+        if (offset == start)
+          TEST_EQ(start, t.line_start((typename text_type::size_type)line));
+        if (offset % 97 == 0 || offset == str.size())
+          {
+          const auto line_col = t.offset_to_line_col((typename text_type::size_type)offset);
+          TEST_EQ(line, line_col.first);
+          TEST_EQ(column, line_col.second);
+          }
+        if (offset == str.size())
+          break;
+        if (str[offset] == '\n')
+          {
+          TEST_EQ(offset, t.line_end((typename text_type::size_type)line));
+          ++line;
+          column = 0;
+          start = offset + 1;
+          }
+        else if (((unsigned char)str[offset] & 0xc0) != 0x80)
+          ++column;
+        }
+      TEST_EQ(str.size(), t.line_end((typename text_type::size_type)line));
+      }
+    bool thrown = false;
+    try
+      {
+      dense.line_start(dense.lines());
+      }
+    catch (std::out_of_range&)
+      {
+      thrown = true;
+      }
+    TEST_ASSERT(thrown);
+
+    text_type edited = dense.insert(1000, "first\nsecond\n").erase(50, 10);
+    std::string edited_str = s;
+    edited_str.insert(1000, "first\nsecond\n");
+    edited_str.erase(50, 10);
+    TEST_ASSERT(edited.str() == edited_str);
+    TEST_EQ(std::count(edited_str.begin(), edited_str.end(), '\n') + 1, edited.lines());
+    const size_t second = edited_str.find("second");
+    TEST_EQ(second, edited.line_start(edited.offset_to_line_col((typename text_type::size_type)second).first));
+    TEST_ASSERT(edited.substr(0, 0).empty());
+    TEST_ASSERT(edited.substr(7) == text_type(edited_str.substr(7)));
+    }
+
+  template <typename T, bool atomic_ref_counting, int N>
+  void test_search_type()
+    {
+    typedef immutable::vector<T, atomic_ref_counting, N> vector_type;
+    std::vector<T> values;
+    for (int i = 0; i < 20000; ++i)
+      values.push_back((T)((i * 7919) % 61));
+    const vector_type dense(values.begin(), values.end());
+    // concatenation gives nodes with size tables and leaves that are not full
+    const vector_type relaxed = dense.drop(13) + dense.take(7001) + dense.drop(12345);
+    std::vector<T> relaxed_values(values.begin() + 13, values.end());
+    relaxed_values.insert(relaxed_values.end(), values.begin(), values.begin() + 7001);
+    relaxed_values.insert(relaxed_values.end(), values.begin() + 12345, values.end());
+    const std::pair<const vector_type*, const std::vector<T>*> cases[] = { { &dense, &values }, { &relaxed, &relaxed_values } };
+    for (const auto& c : cases)
+      {
+      const vector_type& v = *c.first;
+      const std::vector<T>& expected = *c.second;
+      for (int value : { 0, 17, 60, 61 })
+        {
+        TEST_EQ((size_t)std::count(expected.begin(), expected.end(), (T)value), (size_t)v.count((T)value));
+        for (size_t pos : { (size_t)0, (size_t)31, (size_t)1000, expected.size() - 5, expected.size(), expected.size() + 1 })
+          {
+          const size_t start = std::min(pos, expected.size());
+          TEST_EQ((size_t)(std::find(expected.begin() + start, expected.end(), (T)value) - expected.begin()), (size_t)v.find((T)value, (uint32_t)pos));
+          }
+        }
+      const T set[] = { (T)59, (T)60, (T)58 };
+      TEST_EQ((size_t)(std::find_first_of(expected.begin() + 100, expected.end(), set, set + 3) - expected.begin()), (size_t)v.find_first_of(set, set + 3, 100));
+      TEST_EQ((size_t)(std::find_first_of(expected.begin(), expected.end(), set, set + 1) - expected.begin()), (size_t)v.find_first_of({ (T)59 }));
+      // needles that start at every offset of a few leaves, so that some of
+      // them straddle leaf boundaries
+      for (size_t start = 5000; start < 5000 + 3 * (1 << N); ++start)
+        {
+        for (size_t len : { 1, 2, 7, 100 })
+          {
+          const vector_type needle = v.slice((uint32_t)start, (uint32_t)(start + len));
+          const size_t found = (size_t)(std::search(expected.begin(), expected.end(), expected.begin() + start, expected.begin() + start + len) - expected.begin());
+          TEST_EQ(found, (size_t)v.search(needle));
+          TEST_EQ(start, (size_t)v.search(needle, (uint32_t)start));
+          }
+        }
+      const T missing[] = { (T)1, (T)1 };
+      TEST_EQ(expected.size(), (size_t)v.search(missing, missing + 2));
+      TEST_EQ((size_t)7, (size_t)v.search(missing, missing, 7));
+      }
+    }
+
+  template <bool atomic_ref_counting, int N>
+  void test_search()
+    {
+    test_search_type<char, atomic_ref_counting, N>();
+    test_search_type<uint16_t, atomic_ref_counting, N>();
+    test_search_type<int, atomic_ref_counting, N>();
+    test_search_type<double, atomic_ref_counting, N>();
+    immutable::text<atomic_ref_counting, N> t(std::string("one\ntwo\nthree"));
+    TEST_EQ(4, t.find("two"));
+    TEST_EQ(t.npos, t.find("four"));
+    TEST_EQ(3, t.find('\n'));
+    TEST_EQ(7, t.find('\n', 4));
+    TEST_EQ(6, t.find_first_of("oe", 5));
+    }
+
+  template <typename T, bool atomic_ref_counting, int N>
+  void test_reduce_type()
+    {
+    typedef immutable::vector<T, atomic_ref_counting, N> vector_type;
+    typedef typename immutable::reduce_sum_type<T>::type sum_type;
+    // small values, so that float sums are exact in any order
+    std::vector<T> values, weights;
+    for (int i = 0; i < 200000; ++i)
+      {
+      values.push_back((T)((i * 7919) % 61 - 30));
+      weights.push_back((T)(i % 3));
+      }
+    const vector_type dense(values.begin(), values.end());
+    const vector_type dense_weights(weights.begin(), weights.end());
+    // concatenation gives nodes with size tables and leaves that are not full
+    const vector_type relaxed = dense.take(70001) + dense.drop(70001);
+    const vector_type relaxed_weights = dense_weights.take(3) + dense_weights.drop(3);
+    sum_type sum = 0, dot = 0;
+    for (size_t i = 0; i < values.size(); ++i)
+      {
+      sum += (sum_type)values[i];
+      dot += (sum_type)values[i] * (sum_type)weights[i];
+      }
+    std::vector<uint32_t> histogram(7, 0);
+    for (T value : values)
+      {
+      if (value >= (T)-20 && value < (T)15)
+        ++histogram[(size_t)(value + 20) / 5];
+      }
+    for (const vector_type* v : { &dense, &relaxed })
+      {
+      for (uint32_t threads : { 1, 3, 0 })
+        {
+        TEST_ASSERT(sum == v->sum(threads));
+        TEST_ASSERT((T)-30 == v->minimum(threads));
+        TEST_ASSERT((T)30 == v->maximum(threads));
+        TEST_ASSERT(dot == v->dot(dense_weights, threads));
+        TEST_ASSERT(dot == v->dot(relaxed_weights, threads));
+        const std::vector<immutable::rrb_index_type> h = v->histogram((T)-20, (T)15, 7, threads);
+        TEST_ASSERT(h.size() == histogram.size());
+        for (size_t b = 0; b < h.size(); ++b)
+          TEST_EQ(histogram[b], (uint32_t)h[b]);
+        }
+      }
+    const vector_type small = dense.take(5);
+    TEST_ASSERT(small.sum() == (sum_type)values[0] + (sum_type)values[1] + (sum_type)values[2] + (sum_type)values[3] + (sum_type)values[4]);
+    TEST_ASSERT(*std::min_element(values.begin(), values.begin() + 5) == small.minimum());
+    TEST_ASSERT(vector_type().sum() == 0);
+    bool thrown = false;
+    try
+      {
+      vector_type().maximum();
+      }
+    catch (std::out_of_range&)
+      {
+      thrown = true;
+      }
+    TEST_ASSERT(thrown);
+    thrown = false;
+    try
+      {
+      dense.histogram((T)-20, (T)15, 0);
+      }
+    catch (std::invalid_argument&)
+      {
+      thrown = true;
+      }
+    TEST_ASSERT(thrown);
+    TEST_ASSERT(immutable::rrb_histogram(dense.raw().ptr, (T)-20, (T)15, 0, 1).empty());
+    }
+
+  template <uint32_t Bits, bool atomic_ref_counting, int N>
+  void test_packed_bits()
+    {
+    typedef immutable::packed_vector<Bits, atomic_ref_counting, N> packed_type;
+    typedef typename packed_type::value_type value_type;
+    const uint32_t values_per_field = 1u << Bits;
+    std::vector<value_type> values;
+    for (uint32_t i = 0; i < 20011; ++i)
+      values.push_back((value_type)(((i * 7919) >> 3) % values_per_field));
+    packed_type p(values.begin(), values.end());
+    TEST_EQ((uint32_t)values.size(), (uint32_t)p.size());
+    for (size_t i = 0; i < values.size(); i += 7)
+      TEST_ASSERT(values[i] == p[(uint32_t)i]);
+    for (uint32_t value = 0; value < values_per_field; ++value)
+      {
+      TEST_EQ((uint32_t)std::count(values.begin(), values.end(), (value_type)value), (uint32_t)p.count((value_type)value));
+      for (size_t pos : { (size_t)0, (size_t)1, (size_t)63, (size_t)64, (size_t)4097, values.size() - 1, values.size() })
+        TEST_EQ((uint32_t)std::count(values.begin(), values.begin() + pos, (value_type)value), (uint32_t)p.rank((value_type)value, (uint32_t)pos));
+      // select inverts rank
+      uint32_t n = 0;
+      for (size_t i = 0; i < values.size(); ++i)
+        {
+        if (values[i] != (value_type)value)
+          continue;
+        if (n % 97 == 0 || n < 70)
+          TEST_EQ((uint32_t)i, (uint32_t)p.select((value_type)value, n));
+        ++n;
+        }
+      TEST_EQ((uint32_t)p.size(), (uint32_t)p.select((value_type)value, n));
+      }
+    // edits keep the fields after the last element zero
+    packed_type edited = p;
+    std::vector<value_type> edited_values = values;
+    for (uint32_t i = 0; i < 300; ++i)
+      {
+      edited = edited.pop_back();
+      edited_values.pop_back();
+      }
+    edited = edited.set(5, (value_type)(values_per_field - 1)).push_back((value_type)1).push_back((value_type)0);
+    edited_values[5] = (value_type)(values_per_field - 1);
+    edited_values.push_back((value_type)1);
+    edited_values.push_back((value_type)0);
+    TEST_ASSERT(edited == packed_type(edited_values.begin(), edited_values.end()));
+    TEST_ASSERT(edited != p);
+    TEST_EQ((uint32_t)std::count(edited_values.begin(), edited_values.end(), (value_type)0), (uint32_t)edited.count((value_type)0));
+    const packed_type filled((uint32_t)1000, (value_type)1);
+    TEST_EQ(1000, (uint32_t)filled.count((value_type)1));
+    TEST_EQ(0, (uint32_t)filled.count((value_type)0));
+    TEST_EQ(1000, (uint32_t)filled.select((value_type)0, 0));
+    TEST_EQ(0, (uint32_t)packed_type().count((value_type)0));
+    }
+
+  template <bool atomic_ref_counting, int N>
+  void test_packed()
+    {
+    // only the nodes of text and packed words pay for the summary word
+    static_assert(sizeof(immutable::rrb_details::leaf_node<int, atomic_ref_counting>) + sizeof(uint64_t) == sizeof(immutable::rrb_details::leaf_node<uint64_t, atomic_ref_counting>), "summary word");
+    static_assert(sizeof(immutable::rrb_details::internal_node<int, atomic_ref_counting>) + sizeof(uint64_t) == sizeof(immutable::rrb_details::internal_node<char, atomic_ref_counting>), "summary word");
+    test_packed_bits<1, atomic_ref_counting, N>();
+    test_packed_bits<2, atomic_ref_counting, N>();
+    test_packed_bits<4, atomic_ref_counting, N>();
+    test_packed_bits<8, atomic_ref_counting, N>();
+    immutable::bit_vector<atomic_ref_counting, N> flags = { true, false, false, true, true };
+    TEST_EQ(3, (uint32_t)flags.count(true));
+    TEST_EQ(3, (uint32_t)flags.select(true, 1));
+    TEST_EQ(2, (uint32_t)flags.rank(false, 4));
+    // a tree of a few levels, with every third bit set
+    std::vector<bool> bits;
+    for (uint32_t i = 0; i < 2000003; ++i)
+      bits.push_back(i % 3 == 0);
+    const immutable::bit_vector<atomic_ref_counting, N> large(bits.begin(), bits.end());
+    TEST_EQ(666668, (uint32_t)large.count(true));
+    for (uint32_t pos : { 0, 1, 65536, 1000000, 1999999, 2000003 })
+      {
+      TEST_EQ((pos + 2) / 3, (uint32_t)large.rank(true, pos));
+      TEST_EQ(pos - (pos + 2) / 3, (uint32_t)large.rank(false, pos));
+      }
+    for (uint32_t n : { 0, 1, 100000, 666667 })
+      {
+      TEST_EQ(n * 3, (uint32_t)large.select(true, n));
+      TEST_EQ(n / 2 * 3 + 1 + n % 2, (uint32_t)large.select(false, n));
+      }
+    TEST_EQ(2000003, (uint32_t)large.select(true, 666668));
+    }
+
+  template <typename T, bool atomic_ref_counting, int N>
+  void test_compressed_type(const std::vector<T>& values)
+    {
+    typedef immutable::vector<T, atomic_ref_counting, N> vector_type;
+    typedef immutable::compressed_vector<T, atomic_ref_counting, N> compressed_type;
+    const vector_type dense(values.begin(), values.end());
+    // concatenation gives nodes with size tables and leaves that are not full
+    const vector_type relaxed = dense.drop(33) + dense.take(33);
+    for (const vector_type* v : { &dense, &relaxed })
+      {
+      const compressed_type c = immutable::compress(*v);
+      TEST_EQ(v->size(), c.size());
+      TEST_ASSERT(c.decompress() == *v);
+      TEST_ASSERT(std::equal(v->begin(), v->end(), c.begin()));
+      // backwards, so that every access misses the cache
+      for (uint32_t i = v->size(); i > 0; i -= std::min<uint32_t>(i, 997))
+        TEST_ASSERT((*v)[i - 1] == c[i - 1]);
+      for (uint32_t i = 0; i < v->size(); i += 997)
+        TEST_ASSERT((*v)[i] == c.at(i));
+      const auto region = c.region_for(v->size() / 2);
+      TEST_ASSERT(std::get<1>(region) <= v->size() / 2 && v->size() / 2 < std::get<2>(region));
+      TEST_ASSERT(std::get<0>(region)[v->size() / 2 - std::get<1>(region)] == (*v)[v->size() / 2]);
+      TEST_ASSERT(c.compressed_bytes() < v->size() * sizeof(T));
+      }
+    }
+
+  template <bool atomic_ref_counting, int N>
+  void test_compressed()
+    {
+    typedef immutable::vector<int, atomic_ref_counting, N> vector_type;
+    typedef immutable::compressed_vector<int, atomic_ref_counting, N> compressed_type;
+    std::vector<int> ints;
+    std::vector<double> doubles;
+    std::vector<char> chars;
+    for (int i = 0; i < 100000; ++i)
+      {
+      ints.push_back(i * 3 + (i * 7919) % 5 - 1000);
+      doubles.push_back((double)((i / 7) % 10) * 0.5);
+      chars.push_back("the quick brown fox\n"[(i * 3) % 20]);
+      }
+    test_compressed_type<int, atomic_ref_counting, N>(ints);
+    test_compressed_type<double, atomic_ref_counting, N>(doubles);
+    test_compressed_type<char, atomic_ref_counting, N>(chars);
+    const std::vector<int64_t> extremes = { INT64_MIN, INT64_MAX, 0, -1, INT64_MIN, 1 };
+    const immutable::vector<int64_t, atomic_ref_counting, N> extreme_vector(extremes.begin(), extremes.end());
+    TEST_ASSERT(immutable::compress(extreme_vector).decompress() == extreme_vector);
+    TEST_ASSERT(immutable::compress(vector_type()).empty());
+    TEST_ASSERT(immutable::compress(vector_type()).decompress().empty());
+    bool thrown = false;
+    try
+      {
+      immutable::compress(vector_type()).at(0);
+      }
+    catch (std::out_of_range&)
+      {
+      thrown = true;
+      }
+    TEST_ASSERT(thrown);
+
+    // versions compressed through a store share the blocks of their shared nodes
+    immutable::compression_store<int, atomic_ref_counting, N> store;
+    vector_type version(ints.begin(), ints.end());
+    const compressed_type first = immutable::compress(version, store);
+    const size_t nodes = store.size();
+    TEST_ASSERT(nodes > 0);
+    std::vector<compressed_type> history;
+    for (int edit = 0; edit < 10; ++edit)
+      {
+      version = version.set(edit * 9000, -edit);
+      ints[edit * 9000] = -edit;
+      history.push_back(immutable::compress(version, store));
+      }
+    // every edit adds one path of new nodes
+    TEST_ASSERT(store.size() <= nodes + 10 * 4);
+    TEST_ASSERT(history.back().decompress() == version);
+    TEST_ASSERT(std::equal(ints.begin(), ints.end(), history.back().begin()));
+    TEST_EQ(-1000, first[0]);
+    TEST_EQ(0, history.back()[0]);
+    version = vector_type();
+    store.collect();
+    TEST_EQ(0, (uint32_t)store.size());
+    TEST_ASSERT(std::equal(ints.begin(), ints.end(), history.back().begin()));
+    }
+
+  template <bool atomic_ref_counting, int N>
+  void test_history()
+    {
+    typedef immutable::vector<int, atomic_ref_counting, N> vector_type;
+    typedef immutable::history<int, atomic_ref_counting, N> history_type;
+    std::vector<int> values;
+    for (int i = 0; i < 20000; ++i)
+      values.push_back(i);
+    vector_type v(values.begin(), values.end());
+    size_t single = 0;
+      {
+      history_type h;
+      h.record(v);
+      single = h.memory_usage();
+      TEST_ASSERT(single >= values.size() * sizeof(int));
+      TEST_EQ(single, h.unique_bytes(0));
+      }
+    // versions that share most of their nodes
+    history_type h;
+    std::vector<vector_type> expected;
+    for (int edit = 0; edit < 20; ++edit)
+      {
+      TEST_EQ((uint64_t)edit, h.record(v));
+      expected.push_back(v);
+      v = v.set(edit * 997, -edit);
+      }
+    TEST_EQ(20, (uint32_t)h.size());
+    TEST_ASSERT(h.memory_usage() < single + single / 2);
+    TEST_ASSERT(h.unique_bytes(5) < single / 10);
+    for (uint64_t version = 0; version < 20; ++version)
+      TEST_ASSERT(h.checkout(version) == expected[version]);
+    h.drop_before(19);
+    TEST_EQ(19, (uint32_t)h.first());
+    TEST_EQ(single, h.memory_usage());
+    TEST_ASSERT(!h.contains(3));
+    bool thrown = false;
+    try
+      {
+      h.checkout(3);
+      }
+    catch (std::out_of_range&)
+      {
+      thrown = true;
+      }
+    TEST_ASSERT(thrown);
+
+    // unrelated versions over a budget are dropped, or compressed first
+    history_type evicting(single * 5 / 2);
+    history_type compressing(single * 5 / 2, immutable::history_policy::compress_oldest);
+    std::vector<vector_type> unrelated;
+    for (int i = 0; i < 6; ++i)
+      {
+      std::vector<int> shifted(values);
+      for (int& x : shifted)
+        x += i;
+      unrelated.push_back(vector_type(shifted.begin(), shifted.end()));
+      evicting.record(unrelated.back());
+      compressing.record(unrelated.back());
+      TEST_ASSERT(evicting.memory_usage() <= single * 5 / 2);
+      TEST_ASSERT(compressing.memory_usage() <= single * 5 / 2);
+      }
+    TEST_EQ(2, (uint32_t)evicting.size());
+    TEST_EQ(4, (uint32_t)evicting.first());
+    TEST_EQ(6, (uint32_t)compressing.size());
+    TEST_ASSERT(compressing.is_compressed(0));
+    TEST_ASSERT(!compressing.is_compressed(5));
+    for (uint64_t version = 0; version < 6; ++version)
+      TEST_ASSERT(compressing.checkout(version) == unrelated[version]);
+
+    // elements that cannot be compressed are dropped
+    immutable::history<std::string, atomic_ref_counting, N> strings(1, immutable::history_policy::compress_oldest, 2);
+    for (int i = 0; i < 5; ++i)
+      strings.record(immutable::vector<std::string, atomic_ref_counting, N>().push_back(std::to_string(i)));
+    TEST_EQ(2, (uint32_t)strings.size());
+    TEST_ASSERT(strings.checkout(4)[0] == "4");
+    }
+
+  template <bool atomic_ref_counting, int N>
+  void test_slice_view()
+    {
+    typedef immutable::vector<int, atomic_ref_counting, N> vector_type;
+    std::vector<int> values;
+    for (int i = 0; i < 50000; ++i)
+      values.push_back(i);
+    // a relaxed source
+    vector_type v = vector_type(values.begin(), values.begin() + 20000) + vector_type(values.begin() + 20000, values.end());
+    for (uint32_t from = 0; from < 50000; from += 1237)
+      {
+      const uint32_t to = std::min<uint32_t>(50000, from + from / 3 + 1);
+      auto view = v.lazy_slice(from, to);
+      TEST_EQ(to - from, view.size());
+      TEST_EQ((int)from, view.front());
+      TEST_EQ((int)to - 1, view.back());
+      TEST_EQ((int)from, view.at(0));
+      TEST_ASSERT(std::equal(view.begin(), view.end(), values.begin() + from));
+      TEST_ASSERT(std::equal(view.rbegin(), view.rend(), values.rbegin() + (50000 - to)));
+      TEST_ASSERT(view.to_vector() == v.slice(from, to));
+      }
+
+    auto view = v.lazy_slice(1000, 41000);
+    auto inner = view.slice(100, 30100).drop(50).take(20000);
+    TEST_EQ(20000, inner.size());
+    TEST_EQ(1150, inner[0]);
+    TEST_EQ(1150u, inner.offset());
+    TEST_ASSERT(inner.source() == v);
+    TEST_ASSERT(inner == v.lazy_slice(1150, 21150));
+    TEST_ASSERT(inner != v.lazy_slice(1151, 21151));
+    TEST_ASSERT(std::equal(inner.begin(), inner.end(), values.begin() + 1150));
+    bool thrown = false;
+    try
+      {
+      inner.at(20000);
+      }
+    catch (std::out_of_range&)
+      {
+      thrown = true;
+      }
+    TEST_ASSERT(thrown);
+
+    // edits build the slice
+    vector_type edited = inner.set(5, -1);
+    TEST_EQ(20000, edited.size());
+    TEST_EQ(-1, edited[5]);
+    TEST_EQ(1156, inner[6]);
+    TEST_EQ(1155, v[1155]);
+    edited = inner.push_back(-2);
+    TEST_EQ(-2, edited.back());
+    TEST_EQ(20001, edited.size());
+    edited = inner.pop_back();
+    TEST_EQ(21148, edited.back());
+    edited = inner.erase(0);
+    TEST_EQ(1151, edited[0]);
+    TEST_EQ(19999, edited.size());
+    edited = inner.insert(1, -3);
+    TEST_EQ(1150, edited[0]);
+    TEST_EQ(-3, edited[1]);
+    TEST_EQ(1151, edited[2]);
+    typedef immutable::slice_view<int, atomic_ref_counting, N> view_type;
+    TEST_ASSERT(view_type(v).to_vector().raw().ptr == v.raw().ptr);
+    TEST_ASSERT(view_type().empty());
+    }
+
+  template <bool atomic_ref_counting, int N>
+  void test_gather()
+    {
+    typedef immutable::vector<int, atomic_ref_counting, N> vector_type;
+    std::vector<int> values;
+    for (int i = 0; i < 100000; ++i)
+      values.push_back(i * 3);
+    vector_type dense(values.begin(), values.end());
+    // a relaxed tree with a different tail
+    vector_type relaxed = dense.insert(777, -1).erase(40000).push_back(-2);
+    std::vector<int> relaxed_values(relaxed.begin(), relaxed.end());
+    std::vector<immutable::rrb_index_type> indices;
+    for (uint32_t i = 0; i < 5000; ++i)
+      indices.push_back((i * 2654435761u) % 100000);
+    indices.push_back(99999);
+    indices.push_back(0);
+    indices.push_back(indices[17]);
+    std::vector<int> out = dense.gather(indices);
+    TEST_EQ(indices.size(), out.size());
+    for (size_t i = 0; i < indices.size(); ++i)
+      TEST_EQ(values[indices[i]], out[i]);
+    out = relaxed.gather(indices);
+    for (size_t i = 0; i < indices.size(); ++i)
+      TEST_EQ(relaxed_values[indices[i]], out[i]);
+    // fewer indices than leaves
+    std::vector<immutable::rrb_index_type> sparse(indices.begin(), indices.begin() + 100);
+    out = relaxed.gather(sparse);
+    for (size_t i = 0; i < sparse.size(); ++i)
+      TEST_EQ(relaxed_values[sparse[i]], out[i]);
+    // sorted indices, and a range that only hits the tail
+    std::sort(indices.begin(), indices.end());
+    out = relaxed.gather(indices);
+    for (size_t i = 0; i < indices.size(); ++i)
+      TEST_EQ(relaxed_values[indices[i]], out[i]);
+    const immutable::rrb_index_type last[] = { relaxed.size() - 1, relaxed.size() - 2 };
+    int tail[2];
+    relaxed.gather(last, 2, tail);
+    TEST_EQ(-2, tail[0]);
+    TEST_EQ(values.back(), tail[1]);
+    TEST_EQ(0u, vector_type().gather(std::vector<immutable::rrb_index_type>()).size());
+    vector_type small = vector_type().push_back(5).push_back(6);
+    TEST_EQ(6, small.gather(std::vector<immutable::rrb_index_type>(1, 1))[0]);
+    }
+
+  template <bool atomic_ref_counting, int N>
+  void test_sorted_vector()
+    {
+    typedef immutable::sorted_vector<int, std::less<int>, atomic_ref_counting, N> set_type;
+    std::set<int> expected;
+    set_type s;
+    for (int i = 0; i < 20000; ++i)
+      {
+      const int value = (i * 7919) % 30011;
+      s = s.insert(value);
+      expected.insert(value);
+      }
+    TEST_EQ((uint32_t)expected.size(), s.size());
+    TEST_ASSERT(std::equal(expected.begin(), expected.end(), s.begin()));
+    // the inserts in the middle make the tree relaxed
+    TEST_ASSERT(((const immutable::rrb_details::internal_node<int, atomic_ref_counting>*)s.values().raw()->root.ptr)->size_table.ptr != nullptr);
+    std::vector<int> sorted(expected.begin(), expected.end());
+    for (int value = -1; value < 30020; value += 3)
+      {
+      const uint32_t lower = (uint32_t)(std::lower_bound(sorted.begin(), sorted.end(), value) - sorted.begin());
+      const uint32_t upper = (uint32_t)(std::upper_bound(sorted.begin(), sorted.end(), value) - sorted.begin());
+      TEST_EQ(lower, s.lower_bound(value));
+      TEST_EQ(upper, s.upper_bound(value));
+      TEST_EQ(expected.count(value) != 0, s.contains(value));
+      }
+    TEST_ASSERT(s.insert(sorted[100]) == s);
+    set_type erased = s;
+    for (int i = 0; i < 5000; ++i)
+      {
+      erased = erased.erase(sorted[i * 4]);
+      expected.erase(sorted[i * 4]);
+      }
+    TEST_EQ((uint32_t)expected.size(), erased.size());
+    TEST_ASSERT(std::equal(expected.begin(), expected.end(), erased.begin()));
+    TEST_ASSERT(erased.erase(-5) == erased);
+
+    // a dense tree, built at once
+    std::vector<int> evens;
+    for (int i = 40000; i > 0; --i)
+      evens.push_back(i * 2);
+    evens.push_back(8);
+    set_type dense(evens.begin(), evens.end());
+    TEST_EQ(40000, dense.size());
+    TEST_EQ(2, dense[0]);
+    TEST_EQ(39999u, dense.find(80000));
+    TEST_EQ(dense.size(), dense.find(3));
+    TEST_EQ(2u, dense.lower_bound(5));
+    TEST_EQ(0u, dense.lower_bound(-1));
+    TEST_EQ(40000u, dense.lower_bound(80001));
+
+    // merging a few elements takes over the runs between them
+    set_type few{ 1, 3, 4, 50001, 90000 };
+    set_type merged = dense.merge(few);
+    TEST_EQ(40004, merged.size());
+    TEST_ASSERT(merged == few.merge(dense));
+    std::vector<int> merged_expected;
+    std::set_union(dense.begin(), dense.end(), few.begin(), few.end(), std::back_inserter(merged_expected));
+    TEST_ASSERT(std::equal(merged_expected.begin(), merged_expected.end(), merged.begin()));
+    // and merging sets of similar size merges them linearly
+    merged = dense.merge(s);
+    merged_expected.clear();
+    std::set_union(dense.begin(), dense.end(), s.begin(), s.end(), std::back_inserter(merged_expected));
+    TEST_EQ((uint32_t)merged_expected.size(), merged.size());
+    TEST_ASSERT(std::equal(merged_expected.begin(), merged_expected.end(), merged.begin()));
+    TEST_ASSERT(set_type().merge(few) == few);
+
+    // a descending order
+    immutable::sorted_vector<int, std::greater<int>, atomic_ref_counting, N> descending(evens.begin(), evens.end());
+    TEST_EQ(80000, descending[0]);
+    TEST_EQ(1u, descending.lower_bound(79999));
+
+    immutable::sorted_map<std::string, int, std::less<std::string>, atomic_ref_counting, N> m;
+    for (int i = 0; i < 2000; ++i)
+      m = m.set(std::to_string(i), i);
+    m = m.set("7", 70);
+    m = m.erase("8").erase("none");
+    TEST_EQ(1999, m.size());
+    TEST_EQ(70, m.at("7"));
+    TEST_EQ(1234, *m.find("1234"));
+    TEST_ASSERT(m.find("8") == nullptr);
+    TEST_ASSERT(!m.contains("x"));
+    TEST_ASSERT(std::is_sorted(m.begin(), m.end()));
+    bool thrown = false;
+    try
+      {
+      m.at("8");
+      }
+    catch (std::out_of_range&)
+      {
+      thrown = true;
+      }
+    TEST_ASSERT(thrown);
+    }
+
+  template <bool atomic_ref_counting, int N>
+  void test_reduce()
+    {
+    test_reduce_type<int32_t, atomic_ref_counting, N>();
+    test_reduce_type<int64_t, atomic_ref_counting, N>();
+    test_reduce_type<float, atomic_ref_counting, N>();
+    test_reduce_type<double, atomic_ref_counting, N>();
+    test_reduce_type<int16_t, atomic_ref_counting, N>();
+    }
+
+  template <int N>
+  void test_transient_split()
+    {
+    typedef immutable::vector<int, true, N> vector_type;
+    std::vector<int> values;
+    for (int i = 0; i < 100000; ++i)
+      values.push_back(i);
+    const vector_type dense(values.begin(), values.end());
+    // the root of a concatenation has a size table
+    const vector_type relaxed = dense.drop(17) + dense.take(5000) + dense.drop(99000);
+    for (const vector_type* v : { &dense, &relaxed })
+    for (uint32_t count : { 4, 64 })
+      {
+      auto tv = v->transient();
+      auto parts = tv.split(count);
+      // there are more leaves than parts, so the split descends far enough
+      TEST_EQ(count, parts.size());
+      TEST_EQ(0, parts.front().begin_index());
+      TEST_EQ(v->size(), parts.back().end_index());
+      bool thrown = false;
+      try { tv.set(0, 1); }
+      catch (std::runtime_error&) { thrown = true; }
+      TEST_ASSERT(thrown);
+      std::vector<std::thread> threads;
+      for (auto& part : parts)
+        {
+        threads.emplace_back([&part]()
+          {
+          for (uint32_t i = part.begin_index(); i < part.end_index(); ++i)
+            part.set(i, -part[i]);
+          });
+        }
+      for (auto& t : threads)
+        t.join();
+      thrown = false;
+      try { parts[0].set(parts[0].end_index(), 1); }
+      catch (std::out_of_range&) { thrown = true; }
+      TEST_ASSERT(thrown);
+      tv.join(parts);
+      TEST_ASSERT(parts.empty());
+      tv.push_back(1);
+      vector_type result = tv.persistent();
+      TEST_ASSERT(immutable::validate_rrb(result.raw()));
+      TEST_EQ(v->size() + 1, result.size());
+      for (uint32_t i = 0; i < v->size(); ++i)
+        TEST_EQ(-(*v)[i], result[i]);
+      }
+    TEST_EQ(99999, dense.back());
+    }
+
+  void test_guids()
+    {
+    typedef immutable::rrb_details::guid_type guid_type;
+    const int threads = 4;
+    const int per_thread = 70000; // more than one block per thread
+    std::vector<std::vector<guid_type>> guids(threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t)
+      {
+      workers.emplace_back([&guids, t]()
+        {
+        for (int i = 0; i < per_thread; ++i)
+          guids[t].push_back(immutable::rrb_details::rrb_guid_create());
+        });
+      }
+    for (auto& w : workers)
+      w.join();
+    std::vector<guid_type> all;
+    for (const auto& g : guids)
+      all.insert(all.end(), g.begin(), g.end());
+    std::sort(all.begin(), all.end());
+    TEST_ASSERT(all.front() != 0);
+    TEST_ASSERT(std::adjacent_find(all.begin(), all.end()) == all.end());
+    TEST_EQ(8, sizeof(guid_type));
+    }
+
+  void test_atomic_vector()
+    {
+    typedef immutable::vector<int> vector_type;
+    immutable::atomic_vector<int> cell;
+    TEST_ASSERT(cell.load().empty());
+
+    vector_type v = vector_type().push_back(1).push_back(2);
+    cell.store(v);
+    TEST_ASSERT(cell.load() == v);
+
+    vector_type expected;
+    TEST_ASSERT(!cell.compare_exchange(expected, vector_type()));
+    TEST_ASSERT(expected.raw().ptr == v.raw().ptr);
+    TEST_ASSERT(cell.compare_exchange(expected, v.push_back(3)));
+    TEST_EQ(3, cell.load().size());
+
+    // many loads exhaust the prepaid references several times over
+    std::vector<vector_type> loads;
+    for (int i = 0; i < 50000; ++i)
+      loads.push_back(cell.load());
+    loads.clear();
+    TEST_EQ(3, cell.load().back());
+
+    // concurrent writers each append their own values, readers only ever see
+    // consistent versions
+    cell.store(vector_type());
+    const int writers = 4;
+    const int values_per_writer = 2000;
+    std::atomic<bool> done(false);
+    std::atomic<int> inconsistent(0);
+    std::vector<std::thread> threads;
+    for (int r = 0; r < 4; ++r)
+      {
+      threads.emplace_back([&]()
+        {
+        while (!done.load())
+          {
+          vector_type current = cell.load();
+          int sum = 0;
+          for (auto value : current)
+            sum += value >= 0 ? 1 : 0;
+          if (sum != (int)current.size())
+            ++inconsistent;
+          }
+        });
+      }
+    std::vector<std::thread> writer_threads;
+    for (int w = 0; w < writers; ++w)
+      {
+      writer_threads.emplace_back([&, w]()
+        {
+        for (int i = 0; i < values_per_writer; ++i)
+          cell.update([&](const vector_type& current) { return current.push_back(w * values_per_writer + i); });
+        });
+      }
+    for (auto& t : writer_threads)
+      t.join();
+    done = true;
+    for (auto& t : threads)
+      t.join();
+    TEST_EQ(0, inconsistent.load());
+    vector_type result = cell.load();
+    TEST_EQ(writers * values_per_writer, (int)result.size());
+    std::vector<int> sorted(result.begin(), result.end());
+    std::sort(sorted.begin(), sorted.end());
+    for (int i = 0; i < writers * values_per_writer; ++i)
+      TEST_EQ(i, sorted[i]);
+    }
+
+  void test_deferred_ref_counting()
+    {
+    typedef immutable::vector<int> vector_type;
+    vector_type v;
+    for (int i = 0; i < 5000; ++i)
+      v = v.push_back(i);
+    // a node that is shared by v and all versions derived from it below
+    const auto* shared = ((immutable::rrb_details::internal_node<int, true>*)v.raw()->root.ptr)->child[1].ptr;
+    const uint32_t count = shared->_ref_count.load();
+      {
+      immutable::deferred_ref_counting_scope scope;
+        {
+        vector_type w = v.set(0, -1);
+        TEST_EQ(count + 1, shared->_ref_count.load());
+        }
+      // the decrement is pending
+      TEST_EQ(count + 1, shared->_ref_count.load());
+      for (int i = 0; i < 100; ++i)
+        {
+        // and is cancelled by the next copy, so the shared count is not touched
+        vector_type w = v.set(i, -i);
+        TEST_EQ(-i, w[i]);
+        TEST_EQ(count + 1, shared->_ref_count.load());
+        }
+        {
+        immutable::deferred_ref_counting_scope nested;
+        vector_type w = v.set(1, 1);
+        }
+      TEST_EQ(count + 1, shared->_ref_count.load());
+      scope.flush();
+      TEST_EQ(count, shared->_ref_count.load());
+
+      vector_type w = v;
+      for (int i = 0; i < 5000; ++i)
+        w = w.set(i, -i);
+      for (int i = 0; i < 5000; ++i)
+        {
+        TEST_EQ(i, v[i]);
+        TEST_EQ(-i, w[i]);
+        }
+      TEST_ASSERT(immutable::validate_rrb(w.raw()));
+      }
+    TEST_EQ(count, shared->_ref_count.load());
+    }
+
+  void test_epoch_reclamation()
+    {
+    typedef immutable::vector<int> vector_type;
+    vector_type v;
+    for (int i = 0; i < 5000; ++i)
+      v = v.push_back(i);
+    const auto* head = v.raw().ptr;
+    const uint32_t count = head->_ref_count.load();
+    immutable::atomic_vector<int> cell(v);
+      {
+      immutable::epoch_guard guard;
+      immutable::borrowed_vector<int> borrowed = cell.borrow(guard);
+      cell.store(vector_type());
+      immutable::epoch_reclaim();
+      // the replaced version is retired, but not reclaimed while borrowed
+      TEST_ASSERT(head->_ref_count.load() > count);
+      TEST_EQ(5000, borrowed.size());
+      int i = 0;
+      for (int value : borrowed)
+        TEST_EQ(i++, value);
+      TEST_EQ(4999, borrowed.back());
+      TEST_ASSERT(borrowed.to_vector() == v);
+      }
+    immutable::epoch_reclaim();
+    TEST_EQ(count, head->_ref_count.load());
+
+    // a version that a writer replaced is reclaimed when the last guard that
+    // borrowed it ends, even if the writer does not retire anything anymore
+    cell.store(v);
+      {
+      std::atomic<int> step(0);
+      std::thread writer;
+        {
+        immutable::epoch_guard guard;
+        TEST_EQ(5000, cell.borrow(guard).size());
+        writer = std::thread([&]()
+          {
+          cell.store(vector_type());
+          step = 1;
+          while (step.load() != 2)
+            std::this_thread::yield();
+          });
+        while (step.load() != 1)
+          std::this_thread::yield();
+        TEST_ASSERT(head->_ref_count.load() > count);
+        }
+      TEST_EQ(count, head->_ref_count.load());
+      step = 2;
+      writer.join();
+      }
+
+    // readers only ever borrow consistent versions, in which every element
+    // equals the size
+    std::atomic<bool> done(false);
+    std::atomic<int> inconsistent(0);
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 4; ++r)
+      {
+      readers.emplace_back([&]()
+        {
+        while (!done.load())
+          {
+          immutable::epoch_guard guard;
+          immutable::borrowed_vector<int> current = cell.borrow(guard);
+          for (int value : current)
+            {
+            if (value != (int)current.size())
+              ++inconsistent;
+            }
+          }
+        });
+      }
+    for (int n = 0; n < 2000; ++n)
+      {
+      vector_type next;
+      for (int i = 0; i < n % 300; ++i)
+        next = next.push_back(n % 300);
+      cell.store(next);
+      }
+    done = true;
+    for (auto& t : readers)
+      t.join();
+    TEST_EQ(0, inconsistent.load());
+    }
+
   template <bool atomic_ref_counting, int N>
   void run_tests()
     {        
@@ -1077,6 +2297,22 @@ namespace
     test_vector_of_vector<atomic_ref_counting, N>();
     test_vector_bug_1<atomic_ref_counting, N>();
     test_bug_concat<atomic_ref_counting, N>();
+    test_deduplicate<atomic_ref_counting, N>();
+    test_hash<atomic_ref_counting, N>();
+    test_concat_all<atomic_ref_counting, N>();
+    test_small_vector<atomic_ref_counting, N>();
+    test_vector_view<atomic_ref_counting, N>();
+    test_build<atomic_ref_counting, N>();
+    test_sorted<atomic_ref_counting, N>();
+    test_text<atomic_ref_counting, N>();
+    test_search<atomic_ref_counting, N>();
+    test_reduce<atomic_ref_counting, N>();
+    test_packed<atomic_ref_counting, N>();
+    test_compressed<atomic_ref_counting, N>();
+    test_history<atomic_ref_counting, N>();
+    test_sorted_vector<atomic_ref_counting, N>();
+    test_slice_view<atomic_ref_counting, N>();
+    test_gather<atomic_ref_counting, N>();
     }
 
   }
@@ -1086,4 +2322,10 @@ void run_all_vector_tests()
   run_tests<true, 5>();
   run_tests<false, 5>();
   run_tests<false, 6>();
+  test_atomic_vector();
+  test_deferred_ref_counting();
+  test_epoch_reclamation();
+  test_transient_split<5>();
+  test_transient_split<6>();
+  test_guids();
   }
\ No newline at end of file